@@ -15,14 +15,17 @@
 typedef struct lexeme_list {
   char *lex;
   token_type t;
+  int line;   // where the lexeme starts in the source
+  int column;
   struct lexeme_list *next;
 } lexeme_list;
 
-lexeme_list *add_lexeme(lexeme_list *lexemes, char *lex, token_type t);
+lexeme_list *add_lexeme(lexeme_list *lexemes, char *lex, token_type t, int line, int column);
 void destroy_lexemes(lexeme_list *lexemes);
 void print_lexeme_table(lexeme_list *lexemes);
 void print_lexeme_list(lexeme_list *lexemes);
 void print_internal_lexeme_list(FILE *output_file, lexeme_list *lexemes);
+void print_positioned_lexeme_list(FILE *output_file, lexeme_list *lexemes);
 void print_symbolic_internal_lexeme_list(FILE *output_file, lexeme_list *lexemes);
 char *get_lexeme_list_str(lexeme_list *lexemes);
 
@@ -0,0 +1,28 @@
+/*
+ * PL/0 Compiler
+ * Filename: pl0-cache.h
+ *
+ * Header for the incremental compilation cache.
+ */
+
+#ifndef PL0_CACHE_H
+#define PL0_CACHE_H
+
+// 64-bit FNV-1a
+typedef unsigned long long fingerprint;
+#define FINGERPRINT_BASIS 14695981039346656037ULL
+#define FINGERPRINT_PRIME 1099511628211ULL
+
+// bump this whenever the code generator changes what it emits
+#define CACHE_VERSION 2
+
+extern int cache_hits;
+extern int cache_lookups;
+
+fingerprint fingerprint_int(fingerprint fp, int n);
+int load_cache(char *path);
+int emit_cached(int s, fingerprint fp, int line);
+int save_cache(char *path, fingerprint *fingerprints, int *cacheable, int *lines);
+void destroy_cache();
+
+#endif
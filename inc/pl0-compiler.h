@@ -13,6 +13,7 @@
 
 #define MAX_SYMBOL_TABLE_SIZE 100 // What is a reasonable amount here..?
 #define MAX_CODE_LENGTH 1000 // 1000? I would certainly hope not
+#define MAX_SEGMENTS 100 // one per procedure, plus one for the main block
 
 /*
  * For constants, you must store kind, name and value.
@@ -33,15 +34,56 @@ typedef struct {
   int op;
   int l;
   int m;
+  int line; // source line the instruction came from, 0 if unknown
 } instruction;
 
+/*
+ * The line table maps code[] addresses back to the source. There's only an
+ * entry where the line or the procedure changes, and the entries are sorted
+ * by pc, so find_line() can do a binary search.
+ */
+typedef struct {
+  int pc;   // first instruction this entry covers
+  int line; // source line
+  int seg;  // segment (procedure) the instructions belong to
+} line_entry;
+
+/*
+ * Every procedure body (and the main block) is generated into its own
+ * segment. JMP/JPC targets inside of a segment are relative to the start of
+ * that segment, and CAL targets are segment numbers. pl0_link() places the
+ * segments into code[] and relocates everything.
+ */
+typedef struct {
+  char name[12];     // procedure name, empty for the main block
+  int level;         // L level of the code in this segment
+  int parent;        // enclosing segment, -1 for the main block
+  int offset;        // where this segment is placed inside of its parent
+  int addr;          // address in code[] (set by pl0_link())
+  int external;      // 1 if the procedure lives in another unit
+  int body;          // index of the first instruction of the statement part
+  int cx;            // number of instructions in code
+  int size;          // number of instructions allocated for code
+  instruction *code;
+} segment;
+
 extern const symbol EMPTY_SYMBOL;
 extern symbol symbol_table[];
 extern instruction code[];
 extern int cx;
+extern segment segments[];
+extern int num_segments;
+extern line_entry line_table[];
+extern int num_line_entries;
 
 void print_code(FILE *output_file);
 void print_code_pretty(FILE *output_file);
+void add_line_entry(int pc, int line, int seg);
+line_entry *find_line(int pc);
+void print_line_table(FILE *output_file);
+int run_code(int v_flag);
+char *derive_path(char *input_path, char *ext);
+int write_object_file(char *input_path);
 int symbol_hash(char *value, int level);
 
 #endif
@@ -0,0 +1,123 @@
+/*
+ * PL/0 Compiler
+ * Filename: pl0-ir.h
+ *
+ * Header for the mid-level IR (see -O2).
+ */
+
+#ifndef PL0_IR_H
+#define PL0_IR_H
+
+#include "pl0-compiler.h"
+
+#define MAX_FRAME_SIZE (MAX_SYMBOL_TABLE_SIZE + 3) // sl, dl, ra + variables
+
+// lattice values for constant propagation
+#define LATTICE_TOP 0    // no idea yet
+#define LATTICE_CONST 1  // always the same value
+#define LATTICE_BOTTOM 2 // could be anything
+
+// IR operations
+enum {
+  IR_CONST,    // m
+  IR_LOAD,     // local variable var, as defined by def
+  IR_LOADMEM,  // variable through the static link (l, m)
+  IR_OP,       // opr a [b]
+  IR_READ,     // read a number
+  IR_PHI,      // one def per predecessor in args
+  IR_STORE,    // local variable var := a
+  IR_STOREMEM, // variable through the static link (l, m) := a
+  IR_WRITE,    // write a
+  IR_CALL,     // call (l, m)
+  IR_JMP,      // goto succ[0]
+  IR_BR,       // if a then succ[0] else succ[1]
+  IR_RET
+};
+
+typedef struct {
+  int *v;
+  int n;
+  int size;
+} int_list;
+
+/*
+ * Every op that makes a value is named by its index in ir_ops[], so operands
+ * (a, b) and SSA definitions (def, args) are just op numbers. STOREs and PHIs
+ * are the definitions of the local variables. -1 means "nothing", or for
+ * def/args, the value the variable had when the procedure started.
+ */
+typedef struct {
+  int kind;
+  int a, b;    // operands, -1 if unused
+  int opr;     // OPR code for IR_OP
+  int l, m;    // static link level and address/segment/constant
+  int var;     // local variable (frame address)
+  int def;     // IR_LOAD: the STORE or PHI it reads
+  int *args;   // IR_PHI: the definition coming from each predecessor
+  int block;
+  int pos;     // index in its block's ops (phis aren't in there)
+  int line;
+  int live;
+  int use;     // the op that uses this value, -1 if none (see ir_hoist())
+} ir_op;
+
+typedef struct {
+  int start;      // first instruction of the block in the segment
+  int_list ops;   // everything but the phis, in order
+  int_list phis;
+  int succ[2];    // IR_BR falls through to succ[0] and jumps to succ[1]
+  int num_succ;
+  int_list preds;
+  int_list frontier;
+  int_list children; // in the dominator tree
+  int idom;
+  int rpo;        // position in reverse postorder, -1 if unreachable
+  int executable;
+  int addr;       // where it got emitted
+  int_list pre;   // STOREs hoisted out of the loop this block is the header of
+  int pre_addr;   // where those got emitted
+} ir_block;
+
+extern int var_escapes[MAX_SEGMENTS][MAX_FRAME_SIZE];
+extern int_list proc_writes[MAX_SEGMENTS];
+extern int writes_unknown[MAX_SEGMENTS];
+extern int_list proc_reads[MAX_SEGMENTS];
+extern int reads_unknown[MAX_SEGMENTS];
+
+void list_add(int_list *list, int value);
+int optimize_segments();
+int optimize_segment(int s);
+void find_escaping_vars();
+void find_proc_writes();
+void find_proc_reads();
+void find_proc_effects(int op, int_list *sets, int *unknown);
+int may_touch(int_list *sets, int *unknown, int p, int owner, int m);
+int may_write(int p, int owner, int m);
+int may_read(int p, int owner, int m);
+int is_ancestor(int o, int p);
+int meet_value(int *lattice, int *value, int new_lattice, int new_value);
+int propagate_memory_constants();
+int propagate_segment(int s, int nv, int (*var_index)[MAX_FRAME_SIZE], int *var_of,
+    int *entry_lattice, int *entry_value, int *load_lattice, int *load_value);
+int ir_build(int s);
+int ir_new_op(int kind, int block, int line);
+int ir_is_pure(int op);
+void ir_find_preds();
+void ir_order(int b, int *n);
+void ir_dominators();
+void ir_place_phis();
+void ir_rename(int b, int_list *stacks);
+int ir_meet(int *lattice, int *value, int op, int new_lattice, int new_value);
+void ir_sccp();
+int ir_reaching_def(int var, int block, int pos);
+int ir_propagate_copies();
+void ir_mark_live(int s);
+int ir_dominates(int a, int b);
+int ir_invariant(int op, char *in_loop, int *memo, int s);
+int ir_hoist(int s);
+int ir_emit_tree(int op);
+int ir_jump(int_list *fixups, int op, int from, int to);
+int ir_lower(int s);
+void ir_destroy();
+
+#endif
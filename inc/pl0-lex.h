@@ -12,5 +12,7 @@
 #include <stdio.h>
 
 int pl0_lex(FILE *input_file, FILE *output_file, int l_flag);
+int read_char(FILE *input_file);
+void unread_char(int c, FILE *input_file);
 
 #endif
@@ -0,0 +1,24 @@
+/*
+ * PL/0 Compiler
+ * Filename: pl0-link.h
+ *
+ * Segment bookkeeping and the linker header.
+ */
+
+#ifndef PL0_LINK_H
+#define PL0_LINK_H
+
+#include <stdio.h>
+#include "pl0-compiler.h"
+
+int new_segment(char *name, int parent, int level);
+int segment_emit(int s, int op, int l, int m);
+void destroy_segments();
+int pl0_link();
+int linked_addr(int s, int i);
+int write_object(FILE *output_file, symbol *symbols, int num_symbols);
+int is_relocatable(segment *seg, int i);
+int read_object(FILE *input_file);
+int resolve_externals();
+
+#endif
@@ -0,0 +1,85 @@
+/*
+ * PL/0 Compiler
+ * Filename: pl0-opt.h
+ *
+ * Header for the optimization passes (see -O).
+ */
+
+#ifndef PL0_OPT_H
+#define PL0_OPT_H
+
+#include "pl0-compiler.h"
+
+#define INLINE_SIZE 12      // procedures this small always get inlined
+#define INLINE_LOOP_SIZE 48 // and this small when they're called in a loop
+#define INLINE_HOT_SIZE 96  // and this small when the profile says it's hot
+#define UNROLL_FACTOR 4 // copies of a counted loop's body (see -U)
+#define UNROLL_SIZE 64  // as long as they come to no more than this
+#define UNROLL_HOT_SIZE 128 // or this when the profile says the loop is hot
+#define LAYOUT_LOOP_WEIGHT 10           // a loop is guessed to go around this many times
+#define LAYOUT_MAX_WEIGHT 10000         // but no more than 4 of them count
+#define LAYOUT_MAX_HEAT 1000000000000LL // nor does recursion
+#define LAYOUT_COLD 100                 // a block is cold at 1/100th of its procedure's busiest one
+
+// a while loop that counts a variable towards a bound (see unroll_loops())
+typedef struct {
+  int head;          // first instruction of the condition
+  int jump;          // the JMP back to head
+  int l, m;          // the counter
+  int rel;           // how the counter compares to the bound (counter on the left)
+  instruction bound; // LIT or LOD
+  int step;          // what the counter goes up by every time around
+} counted_loop;
+
+extern int unroll_factor;
+
+int fused_branch(int opr);
+int is_branch(int op);
+int value_number(int (*values)[4], int *n, int op, int m, int a, int b);
+int local_cse();
+int peephole();
+int specialize_access();
+int invert_branch(int op);
+void block_weights(int *start, int *end, int nb, long long *weight);
+int layout_code();
+int exact_log2(int n);
+int strength_reduce(instruction *ir, int opr);
+void find_targets(int *targets);
+int thread_jump(int target);
+int compact_code(int *removed);
+int var_owner(int s, int l);
+int remove_dead_procedures();
+int value_start(segment *seg, int i, int *targets);
+int compact_segment(int s, int *removed);
+int remove_dead_variables();
+int release_slots();
+char *find_live_vars(int s, int size);
+int live_after(segment *seg, int i, char *live, int size, int m);
+int color_slots(int s);
+int share_slots();
+int promote_registers();
+int frame_size(int s);
+int is_recursive(int p);
+int count_calls(int p);
+int in_loop(segment *seg, int i);
+int inline_size(int p);
+int inline_call(int s, int i);
+int inline_procedures();
+int skip_jumps(segment *seg, int i);
+int is_return(segment *seg, int i);
+int is_local_value(segment *seg, int start, int end);
+int match_accumulator(segment *seg, int j, int *targets, int *update, int *e_start, int *e_end);
+int tail_calls(int s);
+int eliminate_tail_calls();
+int find_counted_loop(int s, int head, int jump, counted_loop *loop);
+int unroll_loop(int s, counted_loop *loop, int n);
+int unroll_loops();
+int linear_updates(int s, counted_loop *loop, int *updates);
+int segment_insert(int s, int at, instruction *ins, int n);
+int close_loop(int s, counted_loop *loop, int *updates, int n, int t);
+int closed_form_loops();
+unsigned procedure_hash(int s);
+int same_procedure(int s, int t, int *same);
+int fold_procedures();
+
+#endif
@@ -11,14 +11,22 @@
 
 #include <stdio.h>
 #include "pl0-tokens.h"
+#include "pl0-cache.h"
 
 // This should match the number of things in the parse_errors[] array (see
 // pl0-parsegen.c).
-#define NUM_PARSE_ERRORS 30
+#define NUM_PARSE_ERRORS 31
 
 extern const char *parse_errors[];
+extern int allow_externals;
+extern int opt_level;
+extern char *cache_path;
+extern int token_line;
+extern int token_column;
+extern int curr_line;
+extern int curr_seg;
 
-int pl0_parse(FILE *input_file, int a_flag);
+int pl0_parse(FILE *input_file);
 
 int block(FILE *input_file, token_type *token);
 int statement(FILE *input_file, token_type *token);
@@ -29,9 +37,19 @@ int factor(FILE *input_file, token_type *token);
 
 token_type get_token(FILE *input_file);
 symbol *get_symbol(FILE *input_file, int is_new);
+symbol *find_symbol(char *symbol_name, int is_new);
+fingerprint fingerprint_statement(FILE *input_file, token_type *token, int *cacheable);
 int get_number(FILE *input_file);
 const char *get_parse_error(int e);
 int emit(int op, int l, int m);
+int is_constant(int start);
+void truncate_code(int start);
+void remove_code(int start, int end);
+int has_division(int start, int end);
+int can_fold(int m, int a, int b);
+int fold_operation(int m, int a, int b);
+int emit_operation(int m, int left, int right);
+int declare_external(symbol *symbol);
 void proc_cleanup();
 
 #endif
@@ -0,0 +1,37 @@
+/*
+ * PL/0 Compiler
+ * Filename: pl0-peval.h
+ *
+ * Header for running the start of a program at compile time (see -O2).
+ */
+
+#ifndef PL0_PEVAL_H
+#define PL0_PEVAL_H
+
+#include "pl0-compiler.h"
+#include "pm0.h"
+
+#define PEVAL_STEPS 100000 // most instructions to run at compile time
+
+/*
+ * Where a run was in the main block. The main block's frame and registers are
+ * all a prologue can put back, so the run always stops (or backs up to) a
+ * point where no procedure is active.
+ */
+typedef struct {
+  int pc;      // the next instruction, -1 once the program is over
+  int sp;
+  int steps;   // instructions run to get here
+  int outputs; // outputs printed to get here
+  int stack[MAX_STACK_HEIGHT];
+  char known[MAX_STACK_HEIGHT]; // 1 for every slot the run wrote
+  int registers[NUM_REGISTERS];
+  char known_registers[NUM_REGISTERS];
+} main_state;
+
+void save_main_state(main_state *state, int pc, int sp, int *stack, char *known, int *registers, char *known_registers);
+int run_prefix(main_state *state, int *outputs);
+int write_prologue(main_state *state, int *outputs, instruction *prologue);
+int partial_evaluate();
+
+#endif
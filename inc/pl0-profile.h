@@ -0,0 +1,51 @@
+/*
+ * PL/0 Compiler
+ * Filename: pl0-profile.h
+ *
+ * Header for execution profiles (see -p and -u).
+ */
+
+#ifndef PL0_PROFILE_H
+#define PL0_PROFILE_H
+
+#include "pl0-compiler.h"
+
+#define PROFILE_VERSION 1
+#define MAX_PROFILE_ENTRIES (MAX_CODE_LENGTH * 3)
+#define PROFILE_HOT 20 // a call is hot at 1/20th of the busiest one
+
+// kinds of profile entries
+enum {
+  PROFILE_LINE,   // count = times the line ran
+  PROFILE_BRANCH, // count = times taken, other = times not taken
+  PROFILE_CALL    // count = times callee got called from here
+};
+
+/*
+ * Everything is keyed by the procedure a source line is in and how far the
+ * line is from the start of that procedure, so editing one procedure leaves
+ * the entries for all of the others alone.
+ */
+typedef struct {
+  int kind;
+  char proc[12];   // "-" for the main block
+  int offset;      // source line - first line of proc
+  char callee[12]; // PROFILE_CALL only
+  long long count;
+  long long other;
+} profile_entry;
+
+extern int profile_size;
+
+void record_line_ranges();
+int line_owner(int line);
+profile_entry *add_profile_entry(profile_entry *entries, int *n, profile_entry *key);
+int make_profile_key(profile_entry *key, int kind, int line, char *callee);
+int load_profile(char *path);
+int save_profile(char *path, int *counts, int *taken);
+profile_entry *find_profile_entry(int kind, int line, char *callee);
+int profile_call_heat(int s, int i);
+int profile_loop_heat(int s, int i);
+void destroy_profile();
+
+#endif
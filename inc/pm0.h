@@ -14,22 +14,59 @@
 // Not really sure about these values...
 #define MAX_STACK_HEIGHT 2000
 #define MAX_LEXI_LEVELS 10
+#define NUM_REGISTERS 8 // per frame, see LODR and STOR
 
 // op codes
 enum {
-  LIT = 1, OPR, LOD, STO, CAL, INC, JMP, JPC, SIO_OUT, SIO_IN
+  LIT = 1, OPR, LOD, STO, CAL, INC, JMP, JPC, SIO_OUT, SIO_IN, TCL, SHL, DIVC,
+  JEQ, JNE, JLT, JLE, JGT, JGE, JEVN, // fused compare and branch
+  LODL, STOL, // l = 0
+  LODG, STOG, // the main block's frame
+  LODD, STOD, // l is the static level of the frame, found in the display
+  LODR, STOR  // m is a register in the current frame's register file
 };
 
 // opr m codes
 enum {
   OPR_RET, OPR_NEG, OPR_ADD, OPR_SUB, OPR_MUL, OPR_DIV, OPR_ODD, OPR_MOD,
-  OPR_EQL, OPR_NEQ, OPR_LSS, OPR_LEQ, OPR_GTR, OPR_GEQ
+  OPR_EQL, OPR_NEQ, OPR_LSS, OPR_LEQ, OPR_GTR, OPR_GEQ, OPR_DUP,
+  OPR_OVER
 };
 
+/*
+ * Everything PM/0 keeps while it runs a program, from load_vm() on.
+ */
+typedef struct {
+  instruction *code;
+  int n; // the number of instructions
+  int need[MAX_CODE_LENGTH]; // for CAL and TCL, see verify_code()
+  int magic[MAX_CODE_LENGTH], shift[MAX_CODE_LENGTH]; // for DIVC
+  int sp, bp, pc;
+  int ar; // current activation record
+  int stack[MAX_STACK_HEIGHT];
+  int activation_records[MAX_STACK_HEIGHT / 3 + 1]; // every frame takes at least 3
+  int display[MAX_LEXI_LEVELS + 1]; // bp of the innermost frame at each level
+  int frame_level[MAX_STACK_HEIGHT / 3 + 1]; // static level of each frame
+  int saved_display[MAX_STACK_HEIGHT / 3 + 1]; // what it replaced in display
+  int registers[MAX_STACK_HEIGHT / 3 + 1][NUM_REGISTERS]; // one file per frame
+} vm_state;
+
+extern int *exec_counts;
+extern int *taken_counts;
+
 int pm0(FILE *input_file, int v_flag);
+int load_vm(vm_state *vm, instruction *code, int n);
+int vm_address(vm_state *vm, instruction *ir);
+int vm_step(vm_state *vm);
+int vm_error(const char *message, int pc);
+int stack_effect(instruction *ir, int *pops);
+int walk_procedure(instruction *code, int n, int e, int *seen, int *body);
+int verify_code(instruction *code, int n, int *need);
 const char *get_op_code_symbol(int op);
 const char *get_opr_symbol(int op);
 int base(int *stack, int l, int bp);
+void magic_number(int d, int *magic, int *shift);
+int magic_divide(int n, int magic, int shift);
 void print_stack(int *stack, int sp, int *activation_records, int ar);
 
 #endif
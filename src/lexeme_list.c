@@ -21,9 +21,11 @@
  * @param lexemes pointer to a lexeme_list
  * @param lex a lexeme string
  * @param t a token_type
+ * @param line the source line the lexeme starts on
+ * @param column the source column the lexeme starts on
  * @return a pointer to the first element in a lexeme_list
  */
-lexeme_list *add_lexeme(lexeme_list *lexemes, char *lex, token_type t) {
+lexeme_list *add_lexeme(lexeme_list *lexemes, char *lex, token_type t, int line, int column) {
   lexeme_list *pos = lexemes;
 
   // lexemes is empty
@@ -44,6 +46,8 @@ lexeme_list *add_lexeme(lexeme_list *lexemes, char *lex, token_type t) {
   pos->lex = (char *)malloc((strlen(lex) + 1) * sizeof(char));
   strcpy(pos->lex, lex);
   pos->t = t;
+  pos->line = line;
+  pos->column = column;
   pos->next = NULL;
 
   return lexemes;
@@ -144,6 +148,31 @@ void print_internal_lexeme_list(FILE *output_file, lexeme_list *lexemes) {
   fprintf(output_file, "\n");
 }
 
+/**
+ * Prints out the internal list of lexemes to a file, with source positions.
+ *
+ * This is the token file the parser reads. Same as the internal list, except
+ * that every token is preceded by its line and column.
+ *
+ * Example (for "int x;" on line 1):
+ * 1 1 29 1 5 2 x 1 6 18
+ */
+void print_positioned_lexeme_list(FILE *output_file, lexeme_list *lexemes) {
+  if(!output_file) output_file = stdout;
+  lexeme_list *pos = lexemes;
+
+  while(pos) {
+    fprintf(output_file, "%d %d %d", pos->line, pos->column, pos->t);
+
+    if(pos->t == identsym || pos->t == numbersym)
+      fprintf(output_file, " %s", pos->lex);
+    if(pos->next) fprintf(output_file, " ");
+
+    pos = pos->next;
+  }
+  fprintf(output_file, "\n");
+}
+
 /**
  * Prints out the symbolic internal list of lexemes to a file.
  *
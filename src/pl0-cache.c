@@ -0,0 +1,182 @@
+/*
+ * PL/0 Compiler
+ * Filename: pl0-cache.c
+ *
+ * The incremental compilation cache. The code for each procedure's statement
+ * part is saved along with a fingerprint of its tokens and of whatever its
+ * identifiers resolved to. On the next compile, any procedure with the same
+ * fingerprint gets its code from here instead of from the code generator, and
+ * pl0_link() takes care of the rest.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "pl0-compiler.h"
+#include "pl0-cache.h"
+#include "pl0-parsegen.h"
+#include "pm0.h"
+
+typedef struct {
+  fingerprint fp;
+  int cx;
+  instruction *code;
+} cache_entry;
+
+cache_entry cache[MAX_SEGMENTS];
+int cache_size = 0;
+int cache_hits = 0;
+int cache_lookups = 0;
+
+/**
+ * Adds an integer to a fingerprint.
+ *
+ * @param fp the fingerprint so far
+ * @param n the integer
+ * @return the new fingerprint
+ */
+fingerprint fingerprint_int(fingerprint fp, int n) {
+  int i;
+  for(i = 0; i < 4; i++) {
+    fp ^= (n >> (i * 8)) & 0xff;
+    fp *= FINGERPRINT_PRIME;
+  }
+  return fp;
+}
+
+/**
+ * Loads the cache file, if there is one.
+ *
+ * A missing or unreadable cache just means everything gets compiled.
+ *
+ * @param path the cache file
+ * @return the number of entries loaded
+ */
+int load_cache(char *path) {
+  FILE *cache_file = fopen(path, "r");
+  char magic[12];
+  int version = 0, n = 0, i, j;
+
+  destroy_cache();
+  if(!cache_file)
+    return 0;
+
+  if(fscanf(cache_file, "%11s %d %d", magic, &version, &n) != 3 || version != CACHE_VERSION
+      || n < 0 || n > MAX_SEGMENTS) {
+    fclose(cache_file);
+    return 0;
+  }
+
+  for(i = 0; i < n; i++) {
+    cache_entry *entry = &cache[cache_size];
+    if(fscanf(cache_file, "%llx %d", &entry->fp, &entry->cx) != 2 || entry->cx < 0 || entry->cx > MAX_CODE_LENGTH)
+      break;
+    entry->code = (instruction *)malloc((entry->cx + 1) * sizeof(instruction));
+    if(!entry->code)
+      break;
+    for(j = 0; j < entry->cx; j++) {
+      if(fscanf(cache_file, "%d %d %d %d", &entry->code[j].op, &entry->code[j].l, &entry->code[j].m, &entry->code[j].line) != 4)
+        break;
+    }
+    if(j < entry->cx) {
+      free(entry->code);
+      break;
+    }
+    cache_size++;
+  }
+
+  fclose(cache_file);
+  if(DEBUG) printf("DEBUG: loaded %d cache entries from %s\n", cache_size, path);
+  return cache_size;
+}
+
+/**
+ * Emits the cached code for a statement into a segment.
+ *
+ * Jumps and line numbers in the cache are relative to the start of the
+ * statement part.
+ *
+ * @param s the segment number (must be the segment being generated)
+ * @param fp the statement's fingerprint
+ * @param line the line the statement starts on
+ * @return 0 on success, 1 if it wasn't cached, or the error code from emit()
+ */
+int emit_cached(int s, fingerprint fp, int line) {
+  int i, j, error_code;
+
+  cache_lookups++;
+  for(i = 0; i < cache_size; i++) {
+    if(cache[i].fp != fp)
+      continue;
+
+    for(j = 0; j < cache[i].cx; j++) {
+      instruction *ir = &cache[i].code[j];
+      int m = ir->m;
+      if(ir->op == JMP || ir->op == JPC)
+        m += segments[s].body;
+      curr_line = line + ir->line;
+      error_code = emit(ir->op, ir->l, m);
+      if(error_code)
+        return error_code;
+    }
+
+    if(DEBUG) printf("DEBUG: segment %d (%s) came from the cache\n", s, segments[s].name);
+    cache_hits++;
+    return 0;
+  }
+
+  return 1;
+}
+
+/**
+ * Saves the statement code of every cacheable segment.
+ *
+ * Has to be called right after parsing, while the last instruction of every
+ * segment is still its OPR_RET.
+ *
+ * @param path the cache file
+ * @param fingerprints the fingerprint of each segment's statement
+ * @param cacheable whether or not each segment can be cached
+ * @param lines the line each segment's statement starts on
+ * @return 0 on success, 1 on failure
+ */
+int save_cache(char *path, fingerprint *fingerprints, int *cacheable, int *lines) {
+  FILE *cache_file = fopen(path, "w");
+  int s, i, n = 0;
+
+  if(!cache_file)
+    return 1;
+
+  for(s = 0; s < num_segments; s++) {
+    if(cacheable[s])
+      n++;
+  }
+
+  fprintf(cache_file, "pl0-cache %d %d\n", CACHE_VERSION, n);
+  for(s = 0; s < num_segments; s++) {
+    segment *seg = &segments[s];
+    if(!cacheable[s])
+      continue;
+
+    fprintf(cache_file, "%llx %d\n", fingerprints[s], seg->cx - 1 - seg->body);
+    for(i = seg->body; i < seg->cx - 1; i++) {
+      int m = seg->code[i].m;
+      if(seg->code[i].op == JMP || seg->code[i].op == JPC)
+        m -= seg->body;
+      fprintf(cache_file, "%d %d %d %d\n", seg->code[i].op, seg->code[i].l, m, seg->code[i].line - lines[s]);
+    }
+  }
+
+  fclose(cache_file);
+  return 0;
+}
+
+/**
+ * Frees up the memory used by the cache.
+ */
+void destroy_cache() {
+  int i;
+  for(i = 0; i < cache_size; i++) {
+    free(cache[i].code);
+  }
+  cache_size = 0;
+}
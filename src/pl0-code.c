@@ -0,0 +1,173 @@
+/*
+ * PL/0 Compiler
+ * Filename: pl0-code.c
+ *
+ * The generated code lives here, along with the functions for printing it
+ * and running it in PM/0. Shared by the compiler and the linker.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pl0-compiler.h"
+#include "pm0.h"
+
+instruction code[MAX_CODE_LENGTH] = {{0}};
+int cx = 0;
+segment segments[MAX_SEGMENTS] = {{{0}}};
+int num_segments = 0;
+line_entry line_table[MAX_CODE_LENGTH] = {{0}};
+int num_line_entries = 0;
+
+/**
+ * Prints the raw generated code to a file.
+ *
+ * The file can be stdout.
+ *
+ * @param output_file the output file pointer
+ */
+void print_code(FILE *output_file) {
+  int i;
+  if(output_file == stdout) {
+    printf("\n");
+    printf("Generated Code (Raw)\n");
+    printf("====================\n");
+    printf("op  l  m\n");
+    printf("--------\n");
+  }
+  for(i = 0; i < cx; i++) {
+    fprintf(output_file, "%2d %2d %2d\n", code[i].op, code[i].l, code[i].m);
+  }
+  if(output_file == stdout) {
+    printf("\n");
+  }
+}
+
+/**
+ * Prints the pretty generated code to a file.
+ *
+ * The file can be stdout.
+ *
+ * @param output_file the output file pointer
+ */
+void print_code_pretty(FILE *output_file) {
+  int i;
+  printf("\n");
+  printf("Generated Code (Pretty)\n");
+  printf("=======================\n");
+  printf("  # | op   l       m\n");
+  printf("--------------------\n");
+  for(i = 0; i < cx; i++) {
+    fprintf(output_file, "%3d | %-4s%2d ", i, get_op_code_symbol(code[i].op), code[i].l);
+    if(code[i].op == OPR)
+      fprintf(output_file, "%s\n", get_opr_symbol(code[i].m));
+    else
+      fprintf(output_file, "%7d\n", code[i].m);
+  }
+  printf("\n");
+}
+
+/**
+ * Records the source line of the instruction at pc.
+ *
+ * Has to be called in order of pc. Nothing gets added if the line and the
+ * procedure are the same as for the instruction before it.
+ *
+ * @param pc the address in code[]
+ * @param line the source line (0 if unknown)
+ * @param seg the segment the instruction came from
+ */
+void add_line_entry(int pc, int line, int seg) {
+  line_entry *last = num_line_entries ? &line_table[num_line_entries - 1] : NULL;
+
+  if(last && last->line == line && last->seg == seg)
+    return;
+  if(num_line_entries >= MAX_CODE_LENGTH)
+    return;
+
+  line_table[num_line_entries].pc = pc;
+  line_table[num_line_entries].line = line;
+  line_table[num_line_entries].seg = seg;
+  num_line_entries++;
+}
+
+/**
+ * Finds the line table entry covering an address in code[].
+ *
+ * O(log n), so it's cheap enough to use from error reports and profilers.
+ *
+ * @param pc the address in code[]
+ * @return the entry, or NULL if there isn't one
+ */
+line_entry *find_line(int pc) {
+  int lo = 0, hi = num_line_entries - 1;
+
+  if(pc < 0 || !num_line_entries || pc < line_table[0].pc)
+    return NULL;
+
+  // last entry with entry.pc <= pc
+  while(lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if(line_table[mid].pc <= pc)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+
+  return &line_table[lo];
+}
+
+/**
+ * Prints the line table to a file.
+ *
+ * The file can be stdout.
+ *
+ * @param output_file the output file pointer
+ */
+void print_line_table(FILE *output_file) {
+  int i;
+  fprintf(output_file, "Line Table\n");
+  fprintf(output_file, "==========\n");
+  fprintf(output_file, " pc | line  procedure\n");
+  fprintf(output_file, "--------------------\n");
+  for(i = 0; i < num_line_entries; i++) {
+    segment *seg = &segments[line_table[i].seg];
+    fprintf(output_file, "%3d | %4d  %s\n", line_table[i].pc, line_table[i].line,
+        strlen(seg->name) ? seg->name : "(main)");
+  }
+  fprintf(output_file, "\n");
+}
+
+/**
+ * Runs the code in code[] through PM/0.
+ *
+ * @param v_flag whether or not to display the stack trace
+ * @return the error code from pm0()
+ */
+int run_code(int v_flag) {
+  int error_code = 0;
+  FILE *code_file = tmpfile();
+  print_code(code_file);
+  rewind(code_file);
+
+  if(v_flag) {
+    printf("Running in PM/0\n");
+    printf("===============\n\n");
+  }
+
+  error_code = pm0(code_file, v_flag);
+
+  if(v_flag) {
+    printf("\n===============\n\n");
+  }
+  if(!error_code) {
+    if(v_flag) {
+      printf("Finished without error.\n");
+    }
+  } else {
+    printf("Error number %d.\n", error_code);
+  }
+
+  fclose(code_file);
+  return error_code;
+}
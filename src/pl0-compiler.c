@@ -7,12 +7,19 @@
  * symbol_hash() function.
  */
 
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "pl0-compiler.h"
+#include "pl0-cache.h"
+#include "pl0-ir.h"
 #include "pl0-lex.h"
+#include "pl0-link.h"
+#include "pl0-opt.h"
 #include "pl0-parsegen.h"
+#include "pl0-peval.h"
+#include "pl0-profile.h"
 #include "pl0-tokens.h"
 #include "pm0.h"
 #include "lexeme_list.h"
@@ -21,18 +28,34 @@
 // gcc is stupid and wants me to add extra curly braces here
 const symbol EMPTY_SYMBOL = {0};
 symbol symbol_table[MAX_SYMBOL_TABLE_SIZE] = {{0}};
-instruction code[MAX_CODE_LENGTH] = {{0}};
-int cx = 0;
 
 int main(int argc, char **argv) {
   FILE *input_file = NULL;
   int l_flag = 0, a_flag = 0, v_flag = 0; // output flags
+  int c_flag = 0; // compile into an object file instead of running
+  int i_flag = 0; // incremental compile, reusing unchanged procedures
+  int p_flag = 0; // add the counts from this run to the profile
+  int u_flag = 0; // optimize using the profile
+  char *profile_path = NULL;
+  int saved = 0; // instructions saved by the peephole optimizer
+  int laid_out = 0; // blocks moved by the layout pass
+  int evaluated = 0; // instructions run at compile time
+  int inlined = 0; // calls replaced by the inliner
+  int tail = 0; // calls in tail position turned into jumps
+  int unrolled = 0; // counted loops unrolled
+  int closed = 0; // counted loops replaced by what they work out to
+  int dead_procs = 0, dead_vars = 0; // removed by the dead code passes
+  int frames[MAX_SEGMENTS]; // frame sizes before the variables got squeezed
+  int promoted = 0; // variables moved into registers
+  int folded = 0; // procedures folded into identical ones
+  char *input_path = NULL;
 
   if(argc > 1) {
     int i;
     for(i = 1; i < argc; i++) {
       // last arg must be the input_file
       if((i+1) == argc) {
+        input_path = argv[i];
         input_file = fopen(argv[i], "r");
         if(!input_file) {
           printf("File %s not found.\n", argv[1]);
@@ -45,6 +68,22 @@ int main(int argc, char **argv) {
             if(argv[i][j] == 'l') l_flag = 1;
             else if(argv[i][j] == 'a') a_flag = 1;
             else if(argv[i][j] == 'v') v_flag = 1;
+            else if(argv[i][j] == 'c') c_flag = 1;
+            else if(argv[i][j] == 'i') i_flag = 1;
+            else if(argv[i][j] == 'p') p_flag = 1;
+            else if(argv[i][j] == 'u') u_flag = 1;
+            else if(argv[i][j] == 'O') {
+              // -O is the same as -O1
+              opt_level = 1;
+              if(isdigit(argv[i][j + 1]))
+                opt_level = argv[i][++j] - '0';
+            }
+            else if(argv[i][j] == 'U') {
+              // -U is the same as -U4
+              unroll_factor = UNROLL_FACTOR;
+              if(isdigit(argv[i][j + 1]))
+                unroll_factor = argv[i][++j] - '0';
+            }
             else {
               printf("Unknown option: %s\n", argv[i]);
               exit(EXIT_FAILURE);
@@ -54,7 +93,7 @@ int main(int argc, char **argv) {
       }
     }
   } else {
-    printf("Usage: pl0-compiler [-l] [-a] [-v] /path/to/input_file\n");
+    printf("Usage: pl0-compiler [-l] [-a] [-v] [-c] [-i] [-p] [-u] [-O[level]] [-U[factor]] /path/to/input_file\n");
     exit(EXIT_FAILURE);
   }
 
@@ -65,86 +104,172 @@ int main(int argc, char **argv) {
 
   rewind(lexeme_file);
 
-  int error_code = pl0_parse(lexeme_file, a_flag);
+  allow_externals = c_flag;
+  if(i_flag && !c_flag)
+    cache_path = derive_path(input_path, ".cache");
+
+  int error_code = pl0_parse(lexeme_file);
   fclose(lexeme_file);
 
-  if(error_code == 0) {
-    FILE *code_file = tmpfile();
-    print_code(code_file);
-    rewind(code_file);
+  if(cache_path) {
+    if(!error_code && a_flag)
+      printf("Reused %d of %d procedures from %s.\n", cache_hits, cache_lookups, cache_path);
+    destroy_cache();
+    free(cache_path);
+  }
 
-    if(v_flag) {
-      printf("Running in PM/0\n");
-      printf("===============\n\n");
-    }
+  if(!error_code && !c_flag && (p_flag || (u_flag && opt_level))) {
+    profile_path = derive_path(input_path, ".prof");
+    record_line_ranges();
+  }
+  if(profile_path && u_flag && opt_level) {
+    load_profile(profile_path);
+    if(a_flag)
+      printf("Read %d entries from %s.\n", profile_size, profile_path);
+  }
 
-    error_code = pm0(code_file, v_flag);
+  if(!error_code && opt_level)
+    inlined = inline_procedures();
 
-    if(v_flag) {
-      printf("\n===============\n\n");
-    }
-    if(!error_code) {
-      if(v_flag) {
-        printf("Finished without error.\n");
+  if(!error_code && opt_level >= 2)
+    optimize_segments();
+
+  if(!error_code && opt_level)
+    tail = eliminate_tail_calls();
+
+  if(!error_code && opt_level) {
+    closed = closed_form_loops();
+    unrolled = unroll_loops();
+  }
+
+  if(!error_code && opt_level) {
+    int s;
+    dead_procs = remove_dead_procedures();
+    for(s = 0; s < num_segments; s++)
+      frames[s] = frame_size(s);
+    dead_vars = remove_dead_variables();
+    share_slots();
+    promoted = promote_registers();
+    folded = fold_procedures();
+  }
+
+  if(!error_code && c_flag) {
+    error_code = write_object_file(input_path);
+    destroy_segments();
+    return error_code ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+
+  if(!error_code)
+    error_code = pl0_link();
+
+  if(!error_code && opt_level) {
+    saved = peephole();
+    specialize_access();
+    laid_out = layout_code();
+  }
+
+  // profiles need the program to run for real
+  if(!error_code && opt_level >= 2 && !p_flag)
+    evaluated = partial_evaluate();
+
+  if(!error_code && a_flag) {
+    printf("%s\n\n", get_parse_error(error_code));
+    if(opt_level) {
+      int s;
+      printf("Inlined %d calls and turned %d tail calls into jumps.\n", inlined, tail);
+      printf("Replaced %d loops with what they work out to and unrolled %d more.\n", closed, unrolled);
+      printf("Removed %d unused procedures and %d unused variables.\n", dead_procs, dead_vars);
+      printf("Folded %d procedures into identical ones.\n", folded);
+      printf("Moved %d variables into registers.\n", promoted);
+      for(s = 0; s < num_segments; s++) {
+        if(segments[s].cx && frame_size(s) < frames[s])
+          printf("Frame of %s shrank from %d to %d.\n", strlen(segments[s].name) ? segments[s].name : "(main)", frames[s], frame_size(s));
       }
-    } else {
-      printf("Error number %d.\n", error_code);
+      printf("Peephole optimizer saved %d instructions.\n", saved);
+      printf("Moved %d blocks to keep the hot code together.\n", laid_out);
+      printf("Ran %d instructions at compile time.\n\n", evaluated);
     }
 
-    fclose(code_file);
+    print_code(stdout);
+    print_code_pretty(stdout);
+    printf("\n");
+    print_line_table(stdout);
+  }
+
+  if(error_code == 0) {
+    if(profile_path && p_flag) {
+      exec_counts = (int *)calloc(cx, sizeof(int));
+      taken_counts = (int *)calloc(cx, sizeof(int));
+    }
+    run_code(v_flag);
+    if(exec_counts && taken_counts && save_profile(profile_path, exec_counts, taken_counts))
+      fprintf(stderr, "PROFILE ERROR: Could not write %s.\n", profile_path);
+    free(exec_counts);
+    free(taken_counts);
   } else {
-    printf("Error number %d, %s\n", error_code, get_parse_error(error_code));
+    printf("Error number %d, %s (line %d, column %d)\n", error_code, get_parse_error(error_code), token_line, token_column);
   }
 
+  destroy_profile();
+  free(profile_path);
+  destroy_segments();
+
   return EXIT_SUCCESS;
 }
 
 /**
- * Prints the raw generated code to a file.
+ * Makes a path for a file that goes along with the input file.
  *
- * The file can be stdout.
+ * The input file's extension (if any) gets replaced with ext.
  *
- * @param output_file the output file pointer
+ * @param input_path the path of the PL/0 source
+ * @param ext the new extension, including the dot
+ * @return the new path (to be freed by the caller), NULL on failure
  */
-void print_code(FILE *output_file) {
-  int i;
-  if(output_file == stdout) {
-    printf("\n");
-    printf("Generated Code (Raw)\n");
-    printf("====================\n");
-    printf("op  l  m\n");
-    printf("--------\n");
-  }
-  for(i = 0; i < cx; i++) {
-    fprintf(output_file, "%2d %2d %2d\n", code[i].op, code[i].l, code[i].m);
-  }
-  if(output_file == stdout) {
-    printf("\n");
-  }
+char *derive_path(char *input_path, char *ext) {
+  char *path = (char *)malloc(strlen(input_path) + strlen(ext) + 1);
+  char *dot;
+
+  if(!path)
+    return NULL;
+
+  strcpy(path, input_path);
+  dot = strrchr(path, '.');
+  if(dot && !strchr(dot, '/'))
+    *dot = '\0';
+  strcat(path, ext);
+
+  return path;
 }
 
 /**
- * Prints the pretty generated code to a file.
+ * Writes the parsed unit out as an object file.
  *
- * The file can be stdout.
+ * The object file is named after the input file, with its extension (if any)
+ * replaced by ".obj".
  *
- * @param output_file the output file pointer
+ * @param input_path the path of the PL/0 source
+ * @return 0 on success, 1 on failure
  */
-void print_code_pretty(FILE *output_file) {
-  int i;
-  printf("\n");
-  printf("Generated Code (Pretty)\n");
-  printf("=======================\n");
-  printf("  # | op   l       m\n");
-  printf("--------------------\n");
-  for(i = 0; i < cx; i++) {
-    fprintf(output_file, "%3d | %s %2d ", i, get_op_code_symbol(code[i].op), code[i].l);
-    if(code[i].op == OPR)
-      fprintf(output_file, "%s\n", get_opr_symbol(code[i].m));
-    else
-      fprintf(output_file, "%7d\n", code[i].m);
+int write_object_file(char *input_path) {
+  char *object_path = derive_path(input_path, ".obj");
+  FILE *object_file;
+
+  if(!object_path)
+    return 1;
+
+  object_file = fopen(object_path, "w");
+  if(!object_file) {
+    printf("Could not write %s.\n", object_path);
+    free(object_path);
+    return 1;
   }
-  printf("\n");
+
+  write_object(object_file, symbol_table, MAX_SYMBOL_TABLE_SIZE);
+
+  fclose(object_file);
+  free(object_path);
+  return 0;
 }
 
 /**
@@ -0,0 +1,1820 @@
+/*
+ * PL/0 Compiler
+ * Filename: pl0-ir.c
+ *
+ * The mid-level IR, only used with -O2. Each procedure's statement part gets
+ * turned from stack code back into a control-flow graph of basic blocks
+ * holding three-address operations, put into SSA form, optimized, and then
+ * emitted into its segment again.
+ *
+ * Local variables that no nested procedure can see are the SSA variables.
+ * Anything reached through a static link (or any global, when compiling a
+ * unit with -c) is memory: a call can change it, so it's always loaded.
+ *
+ * Before that, propagate_memory_constants() follows constants in memory
+ * variables across the whole program, through calls and into the procedures
+ * being called.
+ *
+ * The passes are sparse conditional constant propagation, copy propagation,
+ * dead store elimination and loop-invariant code motion. Going back to stack code doesn't need any phi
+ * copies, since every STORE still goes to its variable's own slot in the
+ * frame and every LOAD reads from there.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pl0-compiler.h"
+#include "pl0-ir.h"
+#include "pl0-opt.h"
+#include "pl0-parsegen.h"
+#include "pm0.h"
+
+// 1 if the variable at [segment][address] is used by a nested procedure
+int var_escapes[MAX_SEGMENTS][MAX_FRAME_SIZE] = {{0}};
+
+// variables each procedure (and whatever it calls) might store to, as
+// owner * MAX_FRAME_SIZE + address, and whether it calls into another unit
+int_list proc_writes[MAX_SEGMENTS];
+int writes_unknown[MAX_SEGMENTS] = {0};
+
+// same thing for the variables each procedure might load from
+int_list proc_reads[MAX_SEGMENTS];
+int reads_unknown[MAX_SEGMENTS] = {0};
+
+ir_op *ir_ops = NULL;
+int num_ir_ops = 0;
+int ir_ops_size = 0;
+ir_block *ir_blocks = NULL;
+int num_ir_blocks = 0;
+int *ir_rpo = NULL; // reachable blocks, in reverse postorder
+int num_ir_rpo = 0;
+int **edge_executable = NULL; // [block][pred], for constant propagation
+int *lattice = NULL;
+int *lattice_value = NULL;
+int ir_frame_size = 0; // grows when ir_hoist() needs temporaries
+
+/**
+ * Adds a value to the end of a list.
+ *
+ * @param list the list
+ * @param value the value
+ */
+void list_add(int_list *list, int value) {
+  if(list->n >= list->size) {
+    int size = list->size ? list->size * 2 : 4;
+    int *tmp = (int *)realloc(list->v, size * sizeof(int));
+    if(!tmp) {
+      fprintf(stderr, "OPTIMIZER ERROR: Out of memory.\n");
+      exit(EXIT_FAILURE);
+    }
+    list->v = tmp;
+    list->size = size;
+  }
+  list->v[list->n++] = value;
+}
+
+/**
+ * Runs the IR passes over every procedure.
+ *
+ * Must be called after pl0_parse() and before pl0_link().
+ *
+ * @return the number of segments that got optimized
+ */
+int optimize_segments() {
+  int s, n = 0;
+
+  find_escaping_vars();
+  find_proc_writes();
+  find_proc_reads();
+  propagate_memory_constants();
+
+  for(s = 0; s < num_segments; s++) {
+    if(!segments[s].external && segments[s].cx && !optimize_segment(s))
+      n++;
+  }
+
+  for(s = 0; s < num_segments; s++) {
+    free(proc_writes[s].v);
+    memset(&proc_writes[s], 0, sizeof(int_list));
+    free(proc_reads[s].v);
+    memset(&proc_reads[s], 0, sizeof(int_list));
+  }
+
+  if(DEBUG) printf("DEBUG: optimized %d of %d segments\n", n, num_segments);
+
+  return n;
+}
+
+/**
+ * Runs the IR passes over a single procedure.
+ *
+ * Anything the IR doesn't understand leaves the segment alone.
+ *
+ * @param s the segment number
+ * @return 0 if the segment got optimized, 1 if it was left alone
+ */
+int optimize_segment(int s) {
+  int error_code = 1;
+
+  if(!ir_build(s)) {
+    ir_find_preds();
+    ir_rpo = (int *)malloc(num_ir_blocks * sizeof(int));
+    if(!ir_rpo) {
+      ir_destroy();
+      return 1;
+    }
+    num_ir_rpo = 0;
+    ir_order(0, &num_ir_rpo);
+    ir_dominators();
+    ir_place_phis();
+
+    int_list *stacks = (int_list *)calloc(MAX_FRAME_SIZE, sizeof(int_list));
+    if(stacks) {
+      int v;
+      ir_rename(0, stacks);
+      for(v = 0; v < MAX_FRAME_SIZE; v++)
+        free(stacks[v].v);
+      free(stacks);
+
+      ir_sccp();
+      ir_propagate_copies();
+      ir_mark_live(s);
+      ir_hoist(s);
+      error_code = ir_lower(s);
+    }
+  }
+
+  ir_destroy();
+  return error_code;
+}
+
+/**
+ * Finds the variables that nested procedures use through a static link.
+ *
+ * Those can change during any call, so they can't be SSA variables. When
+ * compiling a unit with -c, other units can get at the globals too.
+ */
+void find_escaping_vars() {
+  int s, i, k;
+
+  memset(var_escapes, 0, sizeof(var_escapes));
+
+  for(s = 0; s < num_segments; s++) {
+    for(i = 0; i < segments[s].cx; i++) {
+      instruction *ir = &segments[s].code[i];
+      int owner = s;
+
+      if((ir->op != LOD && ir->op != STO) || ir->l <= 0)
+        continue;
+      for(k = 0; k < ir->l && owner >= 0; k++)
+        owner = segments[owner].parent;
+      if(owner >= 0 && ir->m >= 0 && ir->m < MAX_FRAME_SIZE)
+        var_escapes[owner][ir->m] = 1;
+    }
+  }
+
+  if(allow_externals) {
+    for(i = 0; i < MAX_FRAME_SIZE; i++)
+      var_escapes[0][i] = 1;
+  }
+}
+
+/**
+ * Works out which variables each procedure might store to, counting
+ * everything it calls.
+ *
+ * This is what lets ir_hoist() know that a call can't change a variable.
+ */
+void find_proc_writes() {
+  find_proc_effects(STO, proc_writes, writes_unknown);
+}
+
+/**
+ * Works out which variables each procedure might load from, counting
+ * everything it calls.
+ *
+ * This is what lets ir_mark_live() know that a call can't look at a
+ * variable.
+ */
+void find_proc_reads() {
+  find_proc_effects(LOD, proc_reads, reads_unknown);
+}
+
+/**
+ * Collects the variables each procedure (and everything it calls) touches
+ * with a certain instruction.
+ *
+ * @param op LOD or STO
+ * @param sets gets the variables, as owner * MAX_FRAME_SIZE + address
+ * @param unknown set to 1 for procedures that call into another unit
+ */
+void find_proc_effects(int op, int_list *sets, int *unknown) {
+  int changed = 1;
+  int s, i, j;
+
+  for(s = 0; s < num_segments; s++) {
+    sets[s].n = 0;
+    unknown[s] = 0;
+    for(i = 0; i < segments[s].cx; i++) {
+      instruction *ir = &segments[s].code[i];
+      int owner = var_owner(s, ir->l);
+      if(ir->op == op && owner >= 0 && ir->m >= 0 && ir->m < MAX_FRAME_SIZE && !may_touch(sets, unknown, s, owner, ir->m))
+        list_add(&sets[s], owner * MAX_FRAME_SIZE + ir->m);
+    }
+  }
+
+  while(changed) {
+    changed = 0;
+    for(s = 0; s < num_segments; s++) {
+      for(i = 0; i < segments[s].cx; i++) {
+        instruction *ir = &segments[s].code[i];
+        int p = ir->m;
+
+        if(ir->op != CAL || unknown[s])
+          continue;
+        if(p < 0 || p >= num_segments || segments[p].external || unknown[p]) {
+          unknown[s] = 1;
+          changed = 1;
+          continue;
+        }
+        for(j = 0; j < sets[p].n; j++) {
+          int v = sets[p].v[j];
+          if(!may_touch(sets, unknown, s, v / MAX_FRAME_SIZE, v % MAX_FRAME_SIZE)) {
+            list_add(&sets[s], v);
+            changed = 1;
+          }
+        }
+      }
+    }
+  }
+}
+
+/**
+ * Checks whether a procedure's summary from find_proc_effects() has a
+ * variable in it.
+ *
+ * @param sets the summaries
+ * @param unknown the procedures that call into another unit
+ * @param p the procedure's segment number
+ * @param owner the segment whose frame the variable is in
+ * @param m the variable's address
+ * @return 1 if it might touch the variable, 0 if it can't
+ */
+int may_touch(int_list *sets, int *unknown, int p, int owner, int m) {
+  int i;
+
+  if(p < 0 || p >= num_segments || segments[p].external || unknown[p])
+    return 1;
+  for(i = 0; i < sets[p].n; i++) {
+    if(sets[p].v[i] == owner * MAX_FRAME_SIZE + m)
+      return 1;
+  }
+  return 0;
+}
+
+/**
+ * Checks whether a procedure might store to a variable.
+ *
+ * @param p the procedure's segment number
+ * @param owner the segment whose frame the variable is in
+ * @param m the variable's address
+ * @return 1 if it might, 0 if it can't
+ */
+int may_write(int p, int owner, int m) {
+  return may_touch(proc_writes, writes_unknown, p, owner, m);
+}
+
+/**
+ * Checks whether a procedure might load from a variable.
+ *
+ * @param p the procedure's segment number
+ * @param owner the segment whose frame the variable is in
+ * @param m the variable's address
+ * @return 1 if it might, 0 if it can't
+ */
+int may_read(int p, int owner, int m) {
+  return may_touch(proc_reads, reads_unknown, p, owner, m);
+}
+
+/**
+ * Checks whether a segment is nested (at any depth) inside of another one.
+ *
+ * @param o the outer segment
+ * @param p the inner segment
+ * @return 1 if o is a strict ancestor of p, 0 otherwise
+ */
+int is_ancestor(int o, int p) {
+  for(p = segments[p].parent; p >= 0; p = segments[p].parent) {
+    if(p == o)
+      return 1;
+  }
+  return 0;
+}
+
+/**
+ * Lowers a (lattice, constant) pair towards BOTTOM to take in another one.
+ *
+ * Same as ir_meet(), for lattice values that aren't IR ops.
+ *
+ * @return 1 if it changed, 0 otherwise
+ */
+int meet_value(int *lattice, int *value, int new_lattice, int new_value) {
+  return ir_meet(lattice, value, 0, new_lattice, new_value);
+}
+
+/**
+ * Interprocedural constant propagation for the memory variables.
+ *
+ * Goes through the stack code of every procedure, keeping track of which
+ * memory variables (see find_escaping_vars()) hold a known constant. A store
+ * of a constant sets one, and a call only forgets what the procedure might
+ * store to (see may_write()). What's known at each call site also flows into
+ * the procedure being called, so a procedure that's always called with g = 3
+ * knows that g = 3, except for its own variables (they start out with
+ * whatever was on the stack). The main block, and with -c the procedures
+ * other units can call, start out knowing nothing. This repeats until nothing
+ * changes.
+ *
+ * Loads that always see the same constant become LITs, so the rest of the
+ * IR can fold them.
+ *
+ * @return the number of loads that became constants
+ */
+int propagate_memory_constants() {
+  static int var_index[MAX_SEGMENTS][MAX_FRAME_SIZE];
+  static int var_of[MAX_SEGMENTS * MAX_FRAME_SIZE]; // owner * MAX_FRAME_SIZE + address
+  int *entry_lattice, *entry_value;
+  int *load_lattice[MAX_SEGMENTS], *load_value[MAX_SEGMENTS];
+  int nv = 0, changed = 1, n = 0;
+  int s, i, k, m;
+
+  for(s = 0; s < num_segments; s++) {
+    for(m = 0; m < MAX_FRAME_SIZE; m++) {
+      var_index[s][m] = -1;
+      if(var_escapes[s][m] && m >= 3) {
+        var_of[nv] = s * MAX_FRAME_SIZE + m;
+        var_index[s][m] = nv++;
+      }
+    }
+  }
+  if(!nv)
+    return 0;
+
+  entry_lattice = (int *)malloc(num_segments * nv * sizeof(int));
+  entry_value = (int *)calloc(num_segments * nv, sizeof(int));
+  if(!entry_lattice || !entry_value) {
+    free(entry_lattice);
+    free(entry_value);
+    return 0;
+  }
+  for(s = 0; s < num_segments; s++) {
+    int root = s == 0 || (allow_externals && segments[s].parent == 0);
+    for(k = 0; k < nv; k++)
+      entry_lattice[s * nv + k] = !root && is_ancestor(var_of[k] / MAX_FRAME_SIZE, s) ? LATTICE_TOP : LATTICE_BOTTOM;
+    load_lattice[s] = (int *)calloc(segments[s].cx + 1, sizeof(int));
+    load_value[s] = (int *)calloc(segments[s].cx + 1, sizeof(int));
+  }
+
+  while(changed) {
+    changed = 0;
+    for(s = 0; s < num_segments; s++) {
+      if(segments[s].cx && !segments[s].external && load_lattice[s] && load_value[s])
+        changed |= propagate_segment(s, nv, var_index, var_of, entry_lattice, entry_value, load_lattice[s], load_value[s]);
+    }
+  }
+
+  for(s = 0; s < num_segments; s++) {
+    for(i = 0; i < segments[s].cx && load_lattice[s] && load_value[s]; i++) {
+      instruction *ir = &segments[s].code[i];
+      if(ir->op == LOD && load_lattice[s][i] == LATTICE_CONST) {
+        ir->op = LIT;
+        ir->l = 0;
+        ir->m = load_value[s][i];
+        n++;
+      }
+    }
+    free(load_lattice[s]);
+    free(load_value[s]);
+  }
+  free(entry_lattice);
+  free(entry_value);
+
+  if(DEBUG) printf("DEBUG: %d loads of memory variables became constants\n", n);
+
+  return n;
+}
+
+/**
+ * Goes through one procedure for propagate_memory_constants().
+ *
+ * Works a basic block at a time, with a small stack of lattice values for
+ * the expressions. Anything it doesn't understand makes all of the
+ * procedure's loads BOTTOM.
+ *
+ * @param s the segment number
+ * @param nv the number of memory variables
+ * @param var_index the number of each memory variable, -1 for the others
+ * @param var_of each memory variable, as owner * MAX_FRAME_SIZE + address
+ * @param entry_lattice what's known on entry to each procedure ([s * nv + k])
+ * @param entry_value the constants that go with entry_lattice
+ * @param load_lattice what each LOD in the segment has seen so far
+ * @param load_value the constants that go with load_lattice
+ * @return 1 if what's known on entry to some procedure changed
+ */
+int propagate_segment(int s, int nv, int (*var_index)[MAX_FRAME_SIZE], int *var_of,
+    int *entry_lattice, int *entry_value, int *load_lattice, int *load_value) {
+  segment *seg = &segments[s];
+  int cx1 = seg->cx + 1;
+  int *in_lattice = (int *)calloc(cx1 * nv, sizeof(int));
+  int *in_value = (int *)calloc(cx1 * nv, sizeof(int));
+  int *cur_lattice = (int *)malloc(nv * sizeof(int));
+  int *cur_value = (int *)malloc(nv * sizeof(int));
+  int *stack_lattice = (int *)malloc(cx1 * sizeof(int));
+  int *stack_value = (int *)malloc(cx1 * sizeof(int));
+  char *start = (char *)calloc(cx1, 1);
+  char *pending = (char *)calloc(cx1, 1);
+  int changed = 0, bail = 0;
+  int b, i, j, k;
+
+  if(!in_lattice || !in_value || !cur_lattice || !cur_value || !stack_lattice || !stack_value || !start || !pending) {
+    bail = 1;
+    goto done;
+  }
+
+  start[seg->body] = 1;
+  for(i = seg->body; i < seg->cx; i++) {
+    instruction *ir = &seg->code[i];
+    if((ir->op == JMP || ir->op == JPC) && ir->m >= seg->body && ir->m <= seg->cx)
+      start[ir->m] = 1;
+    if(ir->op == JMP || ir->op == JPC || (ir->op == OPR && ir->m == OPR_RET))
+      start[i + 1] = 1;
+  }
+
+  for(k = 0; k < nv; k++) {
+    in_lattice[seg->body * nv + k] = entry_lattice[s * nv + k];
+    in_value[seg->body * nv + k] = entry_value[s * nv + k];
+  }
+  pending[seg->body] = 1;
+
+  for(b = seg->body; b < seg->cx && !bail; b++) {
+    int sp = 0, back = b + 1;
+
+    if(!pending[b])
+      continue;
+    pending[b] = 0;
+    memcpy(cur_lattice, &in_lattice[b * nv], nv * sizeof(int));
+    memcpy(cur_value, &in_value[b * nv], nv * sizeof(int));
+
+    for(j = b; j < seg->cx && !bail; j++) {
+      instruction *ir = &seg->code[j];
+      int owner = var_owner(s, ir->l);
+      int v = (owner >= 0 && ir->m >= 0 && ir->m < MAX_FRAME_SIZE) ? var_index[owner][ir->m] : -1;
+      int target = -1;
+
+      if(j > b && start[j]) {
+        target = j;
+      } else if(ir->op == LIT) {
+        stack_lattice[sp] = LATTICE_CONST;
+        stack_value[sp++] = ir->m;
+      } else if(ir->op == LOD) {
+        stack_lattice[sp] = v >= 0 ? cur_lattice[v] : LATTICE_BOTTOM;
+        stack_value[sp] = v >= 0 ? cur_value[v] : 0;
+        if(v >= 0)
+          meet_value(&load_lattice[j], &load_value[j], stack_lattice[sp], stack_value[sp]);
+        sp++;
+      } else if(ir->op == STO && sp > 0) {
+        sp--;
+        if(v >= 0) {
+          cur_lattice[v] = stack_lattice[sp];
+          cur_value[v] = stack_value[sp];
+        }
+      } else if(ir->op == OPR && (ir->m == OPR_NEG || ir->m == OPR_ODD) && sp > 0) {
+        if(stack_lattice[sp - 1] == LATTICE_CONST)
+          stack_value[sp - 1] = fold_operation(ir->m, stack_value[sp - 1], 0);
+      } else if(ir->op == OPR && ir->m >= OPR_ADD && ir->m <= OPR_GEQ && ir->m != OPR_ODD && sp > 1) {
+        int la = stack_lattice[sp - 2], lb = stack_lattice[sp - 1];
+        sp--;
+        if(la == LATTICE_BOTTOM || lb == LATTICE_BOTTOM
+            || (la == LATTICE_CONST && lb == LATTICE_CONST && !can_fold(ir->m, stack_value[sp - 1], stack_value[sp])))
+          stack_lattice[sp - 1] = LATTICE_BOTTOM;
+        else if(la == LATTICE_CONST && lb == LATTICE_CONST)
+          stack_value[sp - 1] = fold_operation(ir->m, stack_value[sp - 1], stack_value[sp]);
+        else
+          stack_lattice[sp - 1] = LATTICE_TOP;
+      } else if(ir->op == OPR && ir->m == OPR_RET) {
+        break;
+      } else if(ir->op == CAL) {
+        int p = ir->m;
+        for(k = 0; k < nv; k++) {
+          if(p >= 0 && p < num_segments && is_ancestor(var_of[k] / MAX_FRAME_SIZE, p))
+            changed |= ir_meet(&entry_lattice[p * nv], &entry_value[p * nv], k, cur_lattice[k], cur_value[k]);
+          if(may_write(p, var_of[k] / MAX_FRAME_SIZE, var_of[k] % MAX_FRAME_SIZE))
+            cur_lattice[k] = LATTICE_BOTTOM;
+        }
+      } else if(ir->op == SIO_IN) {
+        stack_lattice[sp] = LATTICE_BOTTOM;
+        stack_value[sp++] = 0;
+      } else if(ir->op == SIO_OUT && sp > 0) {
+        sp--;
+      } else if(ir->op == JMP) {
+        target = ir->m;
+      } else if(ir->op == JPC && sp > 0) {
+        sp--;
+        target = ir->m;
+      } else if(ir->op != INC) {
+        bail = 1;
+      }
+
+      if(target >= 0) {
+        if(target < seg->body || target > seg->cx) {
+          bail = 1;
+          break;
+        }
+        for(k = 0; k < nv; k++) {
+          if(ir_meet(&in_lattice[target * nv], &in_value[target * nv], k, cur_lattice[k], cur_value[k]))
+            pending[target] = 1;
+        }
+        if(pending[target] && target < back)
+          back = target;
+        if(target == j || ir->op == JMP)
+          break;
+      }
+    }
+
+    // a loop sent something back to an earlier block, so go around again
+    b = back - 1;
+  }
+
+done:
+  if(bail) {
+    for(i = 0; i < seg->cx; i++)
+      load_lattice[i] = LATTICE_BOTTOM;
+  }
+  free(in_lattice);
+  free(in_value);
+  free(cur_lattice);
+  free(cur_value);
+  free(stack_lattice);
+  free(stack_value);
+  free(start);
+  free(pending);
+  return changed;
+}
+
+/**
+ * Adds a new op to the end of a block.
+ *
+ * @param kind the kind of op
+ * @param block the block it goes in
+ * @param line the source line it came from
+ * @return the op number
+ */
+int ir_new_op(int kind, int block, int line) {
+  ir_op *op;
+
+  if(num_ir_ops >= ir_ops_size) {
+    int size = ir_ops_size ? ir_ops_size * 2 : 64;
+    ir_op *tmp = (ir_op *)realloc(ir_ops, size * sizeof(ir_op));
+    if(!tmp) {
+      fprintf(stderr, "OPTIMIZER ERROR: Out of memory.\n");
+      exit(EXIT_FAILURE);
+    }
+    ir_ops = tmp;
+    ir_ops_size = size;
+  }
+
+  op = &ir_ops[num_ir_ops];
+  memset(op, 0, sizeof(ir_op));
+  op->kind = kind;
+  op->a = op->b = op->def = op->var = op->use = -1;
+  op->block = block;
+  op->line = line;
+
+  if(kind == IR_PHI) {
+    op->pos = -1;
+    list_add(&ir_blocks[block].phis, num_ir_ops);
+  } else {
+    op->pos = ir_blocks[block].ops.n;
+    list_add(&ir_blocks[block].ops, num_ir_ops);
+  }
+
+  return num_ir_ops++;
+}
+
+/**
+ * Checks whether a block already ends with a JMP, BR or RET.
+ *
+ * @param b the block
+ * @return 1 if it does, 0 otherwise
+ */
+int ir_terminated(int b) {
+  int_list *ops = &ir_blocks[b].ops;
+  int kind;
+
+  if(!ops->n)
+    return 0;
+  kind = ir_ops[ops->v[ops->n - 1]].kind;
+  return kind == IR_JMP || kind == IR_BR || kind == IR_RET;
+}
+
+/**
+ * Turns a segment's statement part into basic blocks of IR.
+ *
+ * The code generator never leaves anything on the stack between statements,
+ * so every block starts and ends with an empty stack, and each stack slot
+ * turns into the op that pushed it.
+ *
+ * @param s the segment number
+ * @return 0 on success, 1 if the code doesn't look like something the code
+ *         generator made
+ */
+int ir_build(int s) {
+  segment *seg = &segments[s];
+  int n = seg->cx, body = seg->body;
+  int *leader, *block_of, *stack;
+  int i, b, op, sp = 0, error_code = 0;
+
+  if(body >= n)
+    return 1;
+  ir_frame_size = frame_size(s);
+
+  leader = (int *)calloc(n + 1, sizeof(int));
+  block_of = (int *)malloc((n + 1) * sizeof(int));
+  stack = (int *)malloc(n * sizeof(int));
+  if(!leader || !block_of || !stack) {
+    free(leader);
+    free(block_of);
+    free(stack);
+    return 1;
+  }
+
+  // find the leaders
+  leader[body] = 1;
+  for(i = body; i < n && !error_code; i++) {
+    instruction *ir = &seg->code[i];
+    if(ir->op == JMP || ir->op == JPC) {
+      if(ir->m < body || ir->m >= n)
+        error_code = 1;
+      else
+        leader[ir->m] = 1;
+    }
+    if(ir->op == JMP || ir->op == JPC || (ir->op == OPR && ir->m == OPR_RET))
+      leader[i + 1] = 1;
+  }
+
+  num_ir_blocks = 0;
+  for(i = body; i < n; i++) {
+    if(leader[i])
+      num_ir_blocks++;
+    block_of[i] = num_ir_blocks - 1;
+  }
+
+  ir_blocks = (ir_block *)calloc(num_ir_blocks, sizeof(ir_block));
+  if(!ir_blocks)
+    error_code = 1;
+
+  for(i = body; i < n && !error_code; i++) {
+    if(leader[i]) {
+      b = block_of[i];
+      ir_blocks[b].start = i;
+      ir_blocks[b].idom = -1;
+      ir_blocks[b].rpo = -1;
+      ir_blocks[b].pre_addr = -1;
+    }
+  }
+
+  for(i = body; i < n && !error_code; i++) {
+    instruction *ir = &seg->code[i];
+    b = block_of[i];
+
+    switch(ir->op) {
+      case LIT:
+        op = ir_new_op(IR_CONST, b, ir->line);
+        ir_ops[op].m = ir->m;
+        stack[sp++] = op;
+        break;
+      case LOD:
+        if(ir->l == 0 && ir->m >= 0 && ir->m < MAX_FRAME_SIZE && !var_escapes[s][ir->m]) {
+          op = ir_new_op(IR_LOAD, b, ir->line);
+          ir_ops[op].var = ir->m;
+        } else {
+          op = ir_new_op(IR_LOADMEM, b, ir->line);
+          ir_ops[op].l = ir->l;
+          ir_ops[op].m = ir->m;
+        }
+        stack[sp++] = op;
+        break;
+      case STO:
+        if(!sp) {
+          error_code = 1;
+          break;
+        }
+        if(ir->l == 0 && ir->m >= 0 && ir->m < MAX_FRAME_SIZE && !var_escapes[s][ir->m]) {
+          op = ir_new_op(IR_STORE, b, ir->line);
+          ir_ops[op].var = ir->m;
+        } else {
+          op = ir_new_op(IR_STOREMEM, b, ir->line);
+          ir_ops[op].l = ir->l;
+          ir_ops[op].m = ir->m;
+        }
+        ir_ops[op].a = stack[--sp];
+        break;
+      case OPR:
+        if(ir->m == OPR_RET && !sp) {
+          ir_new_op(IR_RET, b, ir->line);
+        } else if((ir->m == OPR_NEG || ir->m == OPR_ODD) && sp >= 1) {
+          op = ir_new_op(IR_OP, b, ir->line);
+          ir_ops[op].opr = ir->m;
+          ir_ops[op].a = stack[sp - 1];
+          stack[sp - 1] = op;
+        } else if(ir->m >= OPR_ADD && ir->m <= OPR_GEQ && ir->m != OPR_ODD && sp >= 2) {
+          op = ir_new_op(IR_OP, b, ir->line);
+          ir_ops[op].opr = ir->m;
+          ir_ops[op].a = stack[sp - 2];
+          ir_ops[op].b = stack[sp - 1];
+          stack[--sp - 1] = op;
+        } else {
+          error_code = 1;
+        }
+        break;
+      case CAL:
+        if(sp) {
+          error_code = 1;
+          break;
+        }
+        op = ir_new_op(IR_CALL, b, ir->line);
+        ir_ops[op].l = ir->l;
+        ir_ops[op].m = ir->m;
+        break;
+      case JMP:
+        if(sp) {
+          error_code = 1;
+          break;
+        }
+        ir_new_op(IR_JMP, b, ir->line);
+        ir_blocks[b].succ[0] = block_of[ir->m];
+        ir_blocks[b].num_succ = 1;
+        break;
+      case JPC:
+        if(sp != 1 || i + 1 >= n) {
+          error_code = 1;
+          break;
+        }
+        op = ir_new_op(IR_BR, b, ir->line);
+        ir_ops[op].a = stack[--sp];
+        ir_blocks[b].succ[0] = block_of[i + 1];
+        ir_blocks[b].succ[1] = block_of[ir->m];
+        ir_blocks[b].num_succ = 2;
+        break;
+      case SIO_OUT:
+        if(!sp) {
+          error_code = 1;
+          break;
+        }
+        op = ir_new_op(IR_WRITE, b, ir->line);
+        ir_ops[op].a = stack[--sp];
+        break;
+      case SIO_IN:
+        stack[sp++] = ir_new_op(IR_READ, b, ir->line);
+        break;
+      default:
+        error_code = 1;
+        break;
+    }
+
+    // blocks that just fall into the next one get an explicit JMP
+    if(!error_code && leader[i + 1] && !ir_terminated(b)) {
+      if(sp || i + 1 >= n) {
+        error_code = 1;
+      } else {
+        ir_new_op(IR_JMP, b, ir->line);
+        ir_blocks[b].succ[0] = block_of[i + 1];
+        ir_blocks[b].num_succ = 1;
+      }
+    }
+  }
+
+  if(!error_code && (sp || !ir_terminated(num_ir_blocks - 1)))
+    error_code = 1;
+
+  free(leader);
+  free(block_of);
+  free(stack);
+  return error_code;
+}
+
+/**
+ * Checks whether a value can be thrown away without changing what the program
+ * does. Division can fail and reading eats up input, everything else is fine.
+ *
+ * @param op the op that makes the value
+ * @return 1 if it can be thrown away, 0 otherwise
+ */
+int ir_is_pure(int op) {
+  ir_op *o = &ir_ops[op];
+
+  if(o->kind == IR_READ)
+    return 0;
+  if(o->kind == IR_OP && (o->opr == OPR_DIV || o->opr == OPR_MOD))
+    return 0;
+  if(o->a >= 0 && !ir_is_pure(o->a))
+    return 0;
+  if(o->b >= 0 && !ir_is_pure(o->b))
+    return 0;
+  return 1;
+}
+
+/**
+ * Fills in the predecessors of every block.
+ */
+void ir_find_preds() {
+  int b, i;
+  for(b = 0; b < num_ir_blocks; b++) {
+    for(i = 0; i < ir_blocks[b].num_succ; i++)
+      list_add(&ir_blocks[ir_blocks[b].succ[i]].preds, b);
+  }
+}
+
+/**
+ * Orders the blocks that can be reached from b, depth first.
+ *
+ * Leaves ir_rpo in reverse postorder once it gets back to the entry block.
+ *
+ * @param b the block to start from
+ * @param n the number of blocks ordered so far
+ */
+void ir_order(int b, int *n) {
+  int i;
+
+  ir_blocks[b].rpo = 0; // visited
+  for(i = 0; i < ir_blocks[b].num_succ; i++) {
+    if(ir_blocks[ir_blocks[b].succ[i]].rpo < 0)
+      ir_order(ir_blocks[b].succ[i], n);
+  }
+  ir_rpo[(*n)++] = b;
+
+  if(b == 0) {
+    for(i = 0; i < *n / 2; i++) {
+      int tmp = ir_rpo[i];
+      ir_rpo[i] = ir_rpo[*n - 1 - i];
+      ir_rpo[*n - 1 - i] = tmp;
+    }
+    for(i = 0; i < *n; i++)
+      ir_blocks[ir_rpo[i]].rpo = i;
+  }
+}
+
+/**
+ * Works out the dominator tree and the dominance frontiers.
+ *
+ * Uses the iterative algorithm from Cooper, Harvey and Kennedy.
+ */
+void ir_dominators() {
+  int changed = 1;
+  int i, j, b;
+
+  ir_blocks[0].idom = 0;
+  while(changed) {
+    changed = 0;
+    for(i = 1; i < num_ir_rpo; i++) {
+      int new_idom = -1;
+      b = ir_rpo[i];
+
+      for(j = 0; j < ir_blocks[b].preds.n; j++) {
+        int p = ir_blocks[b].preds.v[j];
+        if(ir_blocks[p].rpo < 0 || ir_blocks[p].idom < 0)
+          continue;
+        if(new_idom < 0) {
+          new_idom = p;
+        } else {
+          // walk both up the tree until they meet
+          int f1 = p, f2 = new_idom;
+          while(f1 != f2) {
+            while(ir_blocks[f1].rpo > ir_blocks[f2].rpo)
+              f1 = ir_blocks[f1].idom;
+            while(ir_blocks[f2].rpo > ir_blocks[f1].rpo)
+              f2 = ir_blocks[f2].idom;
+          }
+          new_idom = f1;
+        }
+      }
+
+      if(ir_blocks[b].idom != new_idom) {
+        ir_blocks[b].idom = new_idom;
+        changed = 1;
+      }
+    }
+  }
+
+  for(i = 1; i < num_ir_rpo; i++) {
+    b = ir_rpo[i];
+    list_add(&ir_blocks[ir_blocks[b].idom].children, b);
+  }
+
+  for(i = 0; i < num_ir_rpo; i++) {
+    b = ir_rpo[i];
+    if(ir_blocks[b].preds.n < 2)
+      continue;
+    for(j = 0; j < ir_blocks[b].preds.n; j++) {
+      int runner = ir_blocks[b].preds.v[j];
+      if(ir_blocks[runner].rpo < 0)
+        continue;
+      while(runner != ir_blocks[b].idom) {
+        int_list *frontier = &ir_blocks[runner].frontier;
+        if(!frontier->n || frontier->v[frontier->n - 1] != b)
+          list_add(frontier, b);
+        runner = ir_blocks[runner].idom;
+      }
+    }
+  }
+}
+
+/**
+ * Puts a phi for every local variable at the start of every block in the
+ * (iterated) dominance frontier of the blocks that store it.
+ */
+void ir_place_phis() {
+  int *has_phi = (int *)calloc(num_ir_blocks, sizeof(int));
+  int *queued = (int *)calloc(num_ir_blocks, sizeof(int));
+  int stored[MAX_FRAME_SIZE] = {0};
+  int_list work = {0};
+  int i, j, v, b;
+
+  if(!has_phi || !queued) {
+    free(has_phi);
+    free(queued);
+    return;
+  }
+
+  for(i = 0; i < num_ir_ops; i++) {
+    if(ir_ops[i].kind == IR_STORE)
+      stored[ir_ops[i].var] = 1;
+  }
+
+  for(v = 0; v < MAX_FRAME_SIZE; v++) {
+    if(!stored[v])
+      continue;
+
+    // blocks get stamped with v + 1 so nothing needs clearing between vars
+    work.n = 0;
+    for(i = 0; i < num_ir_ops; i++) {
+      b = ir_ops[i].block;
+      if(ir_ops[i].kind == IR_STORE && ir_ops[i].var == v && ir_blocks[b].rpo >= 0 && queued[b] != v + 1) {
+        queued[b] = v + 1;
+        list_add(&work, b);
+      }
+    }
+
+    while(work.n) {
+      b = work.v[--work.n];
+      for(j = 0; j < ir_blocks[b].frontier.n; j++) {
+        int y = ir_blocks[b].frontier.v[j];
+        if(has_phi[y] == v + 1)
+          continue;
+
+        int phi = ir_new_op(IR_PHI, y, 0);
+        ir_ops[phi].var = v;
+        ir_ops[phi].args = (int *)malloc(ir_blocks[y].preds.n * sizeof(int));
+        if(!ir_ops[phi].args) {
+          fprintf(stderr, "OPTIMIZER ERROR: Out of memory.\n");
+          exit(EXIT_FAILURE);
+        }
+        for(i = 0; i < ir_blocks[y].preds.n; i++)
+          ir_ops[phi].args[i] = -1;
+
+        has_phi[y] = v + 1;
+        if(queued[y] != v + 1) {
+          queued[y] = v + 1;
+          list_add(&work, y);
+        }
+      }
+    }
+  }
+
+  free(work.v);
+  free(has_phi);
+  free(queued);
+}
+
+/**
+ * Renames the variables into SSA form, walking down the dominator tree.
+ *
+ * Every LOAD gets the STORE or PHI it reads from, and every PHI gets the
+ * definition coming in from each predecessor.
+ *
+ * @param b the block
+ * @param stacks the current definition of each variable (on top)
+ */
+void ir_rename(int b, int_list *stacks) {
+  ir_block *blk = &ir_blocks[b];
+  int_list pushed = {0};
+  int i, j, k;
+
+  for(i = 0; i < blk->phis.n; i++) {
+    int phi = blk->phis.v[i];
+    list_add(&stacks[ir_ops[phi].var], phi);
+    list_add(&pushed, ir_ops[phi].var);
+  }
+
+  for(i = 0; i < blk->ops.n; i++) {
+    ir_op *op = &ir_ops[blk->ops.v[i]];
+    if(op->kind == IR_LOAD) {
+      int_list *stack = &stacks[op->var];
+      op->def = stack->n ? stack->v[stack->n - 1] : -1;
+    } else if(op->kind == IR_STORE) {
+      list_add(&stacks[op->var], blk->ops.v[i]);
+      list_add(&pushed, op->var);
+    }
+  }
+
+  for(i = 0; i < blk->num_succ; i++) {
+    ir_block *succ = &ir_blocks[blk->succ[i]];
+    if(i == 1 && blk->succ[1] == blk->succ[0])
+      break;
+    for(k = 0; k < succ->preds.n; k++) {
+      if(succ->preds.v[k] != b)
+        continue;
+      for(j = 0; j < succ->phis.n; j++) {
+        ir_op *phi = &ir_ops[succ->phis.v[j]];
+        int_list *stack = &stacks[phi->var];
+        phi->args[k] = stack->n ? stack->v[stack->n - 1] : -1;
+      }
+    }
+  }
+
+  for(i = 0; i < blk->children.n; i++)
+    ir_rename(blk->children.v[i], stacks);
+
+  for(i = 0; i < pushed.n; i++)
+    stacks[pushed.v[i]].n--;
+  free(pushed.v);
+}
+
+/**
+ * Lowers an op's lattice value towards BOTTOM to take in a new value.
+ *
+ * @param lattice the lattice values
+ * @param value the constants
+ * @param op the op
+ * @param new_lattice the lattice value to take in
+ * @param new_value the constant to take in (for LATTICE_CONST)
+ * @return 1 if the op's lattice value changed, 0 otherwise
+ */
+int ir_meet(int *lattice, int *value, int op, int new_lattice, int new_value) {
+  if(lattice[op] == LATTICE_BOTTOM || new_lattice == LATTICE_TOP)
+    return 0;
+  if(lattice[op] == LATTICE_CONST && new_lattice == LATTICE_CONST && value[op] == new_value)
+    return 0;
+
+  if(lattice[op] == LATTICE_TOP && new_lattice == LATTICE_CONST) {
+    lattice[op] = LATTICE_CONST;
+    value[op] = new_value;
+  } else {
+    lattice[op] = LATTICE_BOTTOM;
+  }
+  return 1;
+}
+
+/**
+ * Marks a CFG edge as executable.
+ *
+ * @param from the block the edge leaves
+ * @param to the block the edge goes to
+ * @return 1 if that's news, 0 otherwise
+ */
+int ir_mark_edge(int from, int to) {
+  int k, changed = 0;
+  for(k = 0; k < ir_blocks[to].preds.n; k++) {
+    if(ir_blocks[to].preds.v[k] == from && !edge_executable[to][k]) {
+      edge_executable[to][k] = 1;
+      changed = 1;
+    }
+  }
+  if(changed)
+    ir_blocks[to].executable = 1;
+  return changed;
+}
+
+/**
+ * Sparse conditional constant propagation.
+ *
+ * Works out which values are constants and which edges can ever be taken,
+ * assuming the best until proven otherwise, so constants make it around
+ * loops and through branches that always go the same way. Then constant
+ * values get replaced with IR_CONST and constant branches with IR_JMP.
+ *
+ * (Instead of the usual worklists, this just keeps sweeping over the blocks
+ * in reverse postorder until nothing changes. Procedures are small.)
+ */
+void ir_sccp() {
+  int changed = 1;
+  int i, j, k, b;
+
+  lattice = (int *)calloc(num_ir_ops, sizeof(int));
+  lattice_value = (int *)calloc(num_ir_ops, sizeof(int));
+  edge_executable = (int **)calloc(num_ir_blocks, sizeof(int *));
+  if(!lattice || !lattice_value || !edge_executable) {
+    fprintf(stderr, "OPTIMIZER ERROR: Out of memory.\n");
+    exit(EXIT_FAILURE);
+  }
+  for(b = 0; b < num_ir_blocks; b++) {
+    edge_executable[b] = (int *)calloc(ir_blocks[b].preds.n + 1, sizeof(int));
+    if(!edge_executable[b]) {
+      fprintf(stderr, "OPTIMIZER ERROR: Out of memory.\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  ir_blocks[0].executable = 1;
+
+  while(changed) {
+    changed = 0;
+    for(i = 0; i < num_ir_rpo; i++) {
+      ir_block *blk = &ir_blocks[ir_rpo[i]];
+      b = ir_rpo[i];
+      if(!blk->executable)
+        continue;
+
+      for(j = 0; j < blk->phis.n; j++) {
+        int phi = blk->phis.v[j];
+        for(k = 0; k < blk->preds.n; k++) {
+          int arg = ir_ops[phi].args[k];
+          if(!edge_executable[b][k])
+            continue;
+          if(arg < 0)
+            changed |= ir_meet(lattice, lattice_value, phi, LATTICE_BOTTOM, 0);
+          else
+            changed |= ir_meet(lattice, lattice_value, phi, lattice[arg], lattice_value[arg]);
+        }
+      }
+
+      for(j = 0; j < blk->ops.n; j++) {
+        int op = blk->ops.v[j];
+        ir_op *o = &ir_ops[op];
+        int la, lb;
+
+        switch(o->kind) {
+          case IR_CONST:
+            changed |= ir_meet(lattice, lattice_value, op, LATTICE_CONST, o->m);
+            break;
+          case IR_LOAD:
+            if(o->def < 0)
+              changed |= ir_meet(lattice, lattice_value, op, LATTICE_BOTTOM, 0);
+            else
+              changed |= ir_meet(lattice, lattice_value, op, lattice[o->def], lattice_value[o->def]);
+            break;
+          case IR_LOADMEM:
+          case IR_READ:
+            changed |= ir_meet(lattice, lattice_value, op, LATTICE_BOTTOM, 0);
+            break;
+          case IR_OP:
+            la = lattice[o->a];
+            lb = (o->b >= 0) ? lattice[o->b] : LATTICE_CONST;
+            if(la == LATTICE_BOTTOM || lb == LATTICE_BOTTOM)
+              changed |= ir_meet(lattice, lattice_value, op, LATTICE_BOTTOM, 0);
+            else if(la == LATTICE_TOP || lb == LATTICE_TOP)
+              ;
+            else if(!can_fold(o->opr, lattice_value[o->a], (o->b >= 0) ? lattice_value[o->b] : 0))
+              changed |= ir_meet(lattice, lattice_value, op, LATTICE_BOTTOM, 0);
+            else
+              changed |= ir_meet(lattice, lattice_value, op, LATTICE_CONST,
+                  fold_operation(o->opr, lattice_value[o->a], (o->b >= 0) ? lattice_value[o->b] : 0));
+            break;
+          case IR_STORE:
+            changed |= ir_meet(lattice, lattice_value, op, lattice[o->a], lattice_value[o->a]);
+            break;
+          case IR_JMP:
+            changed |= ir_mark_edge(b, blk->succ[0]);
+            break;
+          case IR_BR:
+            la = lattice[o->a];
+            if(la == LATTICE_BOTTOM || (la == LATTICE_CONST && lattice_value[o->a]))
+              changed |= ir_mark_edge(b, blk->succ[0]);
+            if(la == LATTICE_BOTTOM || (la == LATTICE_CONST && !lattice_value[o->a]))
+              changed |= ir_mark_edge(b, blk->succ[1]);
+            break;
+        }
+      }
+    }
+  }
+
+  // now use what we found out
+  for(b = 0; b < num_ir_blocks; b++) {
+    ir_block *blk = &ir_blocks[b];
+    if(!blk->executable)
+      continue;
+
+    for(j = 0; j < blk->ops.n; j++) {
+      ir_op *o = &ir_ops[blk->ops.v[j]];
+      int op = blk->ops.v[j];
+
+      if((o->kind == IR_OP || o->kind == IR_LOAD) && lattice[op] == LATTICE_CONST) {
+        o->kind = IR_CONST;
+        o->m = lattice_value[op];
+        o->a = o->b = o->def = -1;
+      } else if(o->kind == IR_BR && lattice[o->a] == LATTICE_CONST) {
+        o->kind = IR_JMP;
+        if(!lattice_value[o->a])
+          blk->succ[0] = blk->succ[1];
+        blk->num_succ = 1;
+        o->a = -1;
+      }
+    }
+  }
+}
+
+/**
+ * Finds the definition of a local variable that's current at some point.
+ *
+ * That's the closest STORE or PHI that dominates the point.
+ *
+ * @param var the variable
+ * @param block the block the point is in
+ * @param pos the index of the op at the point in the block's ops
+ * @return the definition, -1 if it's still the value from procedure entry
+ */
+int ir_reaching_def(int var, int block, int pos) {
+  int i;
+
+  while(block >= 0) {
+    ir_block *blk = &ir_blocks[block];
+
+    for(i = pos - 1; i >= 0; i--) {
+      ir_op *o = &ir_ops[blk->ops.v[i]];
+      if(o->kind == IR_STORE && o->var == var)
+        return blk->ops.v[i];
+    }
+    for(i = 0; i < blk->phis.n; i++) {
+      if(ir_ops[blk->phis.v[i]].var == var)
+        return blk->phis.v[i];
+    }
+
+    if(blk->idom == block)
+      break;
+    block = blk->idom;
+    pos = ir_blocks[block].ops.n;
+  }
+
+  return -1;
+}
+
+/**
+ * Copy propagation.
+ *
+ * After x := y, a load of x can load y instead, as long as y hasn't changed
+ * in the meantime. That usually leaves the store to x dead.
+ *
+ * @return the number of loads that got changed
+ */
+int ir_propagate_copies() {
+  int changed = 1, n = 0, passes = 0;
+  int b, j;
+
+  while(changed && passes++ < num_ir_ops) {
+    changed = 0;
+    for(b = 0; b < num_ir_blocks; b++) {
+      if(!ir_blocks[b].executable)
+        continue;
+      for(j = 0; j < ir_blocks[b].ops.n; j++) {
+        ir_op *o = &ir_ops[ir_blocks[b].ops.v[j]];
+        ir_op *copy, *source;
+
+        if(o->kind != IR_LOAD || o->def < 0 || ir_ops[o->def].kind != IR_STORE)
+          continue;
+        copy = &ir_ops[o->def];
+        source = &ir_ops[copy->a];
+        if(source->kind != IR_LOAD || source->var == o->var)
+          continue;
+        if(ir_reaching_def(source->var, b, j) != source->def)
+          continue;
+
+        o->var = source->var;
+        o->def = source->def;
+        changed = 1;
+        n++;
+      }
+    }
+  }
+
+  return n;
+}
+
+/**
+ * Marks everything that has to be emitted again.
+ *
+ * Output, calls, control flow and stores to memory are always live (except
+ * for a store to memory that gets overwritten later in the same block before
+ * anything could look at it, calls to procedures that never load it
+ * included). Everything they use is live, and a STORE is live if a live LOAD
+ * or PHI reads it. Whatever is left over is dead.
+ *
+ * @param s the segment number
+ */
+void ir_mark_live(int s) {
+  int_list work = {0};
+  int b, i, j, k;
+
+  for(b = 0; b < num_ir_blocks; b++) {
+    ir_block *blk = &ir_blocks[b];
+    if(!blk->executable)
+      continue;
+
+    for(j = 0; j < blk->ops.n; j++) {
+      int op = blk->ops.v[j];
+      ir_op *o = &ir_ops[op];
+      int root = 0;
+
+      switch(o->kind) {
+        case IR_WRITE:
+        case IR_CALL:
+        case IR_JMP:
+        case IR_BR:
+        case IR_RET:
+          root = 1;
+          break;
+        case IR_STORE:
+          root = !ir_is_pure(o->a);
+          break;
+        case IR_STOREMEM:
+          root = 1;
+          if(!ir_is_pure(o->a))
+            break;
+          for(i = j + 1; i < blk->ops.n; i++) {
+            ir_op *next = &ir_ops[blk->ops.v[i]];
+            if(next->kind == IR_CALL && may_read(next->m, var_owner(s, o->l), o->m))
+              break;
+            if(next->kind == IR_LOADMEM && next->l == o->l && next->m == o->m)
+              break;
+            if(next->kind == IR_STOREMEM && next->l == o->l && next->m == o->m) {
+              root = 0;
+              break;
+            }
+          }
+          break;
+      }
+
+      if(root && !o->live) {
+        o->live = 1;
+        list_add(&work, op);
+      }
+    }
+  }
+
+  while(work.n) {
+    ir_op *o = &ir_ops[work.v[--work.n]];
+    int uses[2] = {o->a, o->b};
+
+    for(i = 0; i < 2; i++) {
+      if(uses[i] >= 0 && !ir_ops[uses[i]].live) {
+        ir_ops[uses[i]].live = 1;
+        list_add(&work, uses[i]);
+      }
+    }
+
+    if(o->kind == IR_LOAD && o->def >= 0 && !ir_ops[o->def].live) {
+      ir_ops[o->def].live = 1;
+      list_add(&work, o->def);
+    } else if(o->kind == IR_PHI) {
+      for(k = 0; k < ir_blocks[o->block].preds.n; k++) {
+        int arg = o->args[k];
+        if(edge_executable[o->block][k] && arg >= 0 && !ir_ops[arg].live) {
+          ir_ops[arg].live = 1;
+          list_add(&work, arg);
+        }
+      }
+    }
+  }
+
+  free(work.v);
+}
+
+/**
+ * Checks whether one block dominates another.
+ *
+ * @param a the block that might dominate
+ * @param b the other block
+ * @return 1 if every path from the entry to b goes through a, 0 otherwise
+ */
+int ir_dominates(int a, int b) {
+  while(b != a) {
+    if(b < 0 || ir_blocks[b].idom == b)
+      return 0;
+    b = ir_blocks[b].idom;
+  }
+  return 1;
+}
+
+/**
+ * Checks whether a value is the same on every trip around a loop.
+ *
+ * @param op the op that makes the value
+ * @param in_loop 1 for every block in the loop
+ * @param memo 0 if unknown, otherwise 1 + the answer (one per op)
+ * @param s the segment number
+ * @return 1 if it is, 0 otherwise
+ */
+int ir_invariant(int op, char *in_loop, int *memo, int s) {
+  ir_op *o = &ir_ops[op];
+  int result = 0;
+  int b, j;
+
+  if(memo[op])
+    return memo[op] - 1;
+
+  switch(o->kind) {
+    case IR_CONST:
+      result = 1;
+      break;
+    case IR_LOAD:
+      result = o->def < 0 || !in_loop[ir_ops[o->def].block];
+      break;
+    case IR_LOADMEM:
+      // nothing in the loop can store to it, calls included
+      result = 1;
+      for(b = 0; b < num_ir_blocks && result; b++) {
+        if(!in_loop[b])
+          continue;
+        for(j = 0; j < ir_blocks[b].ops.n && result; j++) {
+          ir_op *other = &ir_ops[ir_blocks[b].ops.v[j]];
+          if(other->kind == IR_STOREMEM && other->l == o->l && other->m == o->m)
+            result = 0;
+          else if(other->kind == IR_CALL && (other->m < 0 || other->m >= num_segments
+              || may_write(other->m, var_owner(s, o->l), o->m)))
+            result = 0;
+        }
+      }
+      break;
+    case IR_OP:
+      // division could fail, and the loop might not run at all
+      result = o->opr != OPR_DIV && o->opr != OPR_MOD && ir_invariant(o->a, in_loop, memo, s)
+          && (o->b < 0 || ir_invariant(o->b, in_loop, memo, s));
+      break;
+  }
+
+  memo[op] = result + 1;
+  return result;
+}
+
+/**
+ * Loop-invariant code motion.
+ *
+ * Finds the natural loop of every back edge. The biggest invariant values in
+ * each loop (arithmetic on invariant values, and variables reached through a
+ * static link that nothing in the loop stores to) get computed once, into a
+ * new variable, by STOREs that run right before the loop header. The loop
+ * just loads that variable instead. Outer loops go first, so a value is
+ * hoisted as far out as it can go.
+ *
+ * Must be called after ir_mark_live().
+ *
+ * @param s the segment number
+ * @return the number of values hoisted
+ */
+int ir_hoist(int s) {
+  int_list headers = {0};
+  char **loops;
+  int *sizes;
+  int hoisted = 0;
+  int i, j, k, b;
+
+  // with -c, the main block's frame is just the globals
+  if(s == 0 && allow_externals)
+    return 0;
+
+  for(i = 0; i < num_ir_ops; i++) {
+    if(ir_ops[i].a >= 0)
+      ir_ops[ir_ops[i].a].use = i;
+    if(ir_ops[i].b >= 0)
+      ir_ops[ir_ops[i].b].use = i;
+  }
+
+  // every header, along with the blocks of its loop
+  for(b = 0; b < num_ir_blocks; b++) {
+    for(j = 0; j < ir_blocks[b].preds.n && ir_blocks[b].executable; j++) {
+      if(edge_executable[b][j] && ir_dominates(b, ir_blocks[b].preds.v[j])) {
+        list_add(&headers, b);
+        break;
+      }
+    }
+  }
+  if(!headers.n)
+    return 0;
+
+  loops = (char **)calloc(headers.n, sizeof(char *));
+  sizes = (int *)calloc(headers.n, sizeof(int));
+  if(!loops || !sizes) {
+    free(loops);
+    free(sizes);
+    free(headers.v);
+    return 0;
+  }
+
+  for(i = 0; i < headers.n; i++) {
+    int_list work = {0};
+    int h = headers.v[i];
+
+    loops[i] = (char *)calloc(num_ir_blocks, sizeof(char));
+    if(!loops[i])
+      continue;
+    loops[i][h] = 1;
+    sizes[i] = 1;
+    for(j = 0; j < ir_blocks[h].preds.n; j++) {
+      int p = ir_blocks[h].preds.v[j];
+      if(edge_executable[h][j] && ir_dominates(h, p) && !loops[i][p]) {
+        loops[i][p] = 1;
+        sizes[i]++;
+        list_add(&work, p);
+      }
+    }
+    while(work.n) {
+      b = work.v[--work.n];
+      for(j = 0; j < ir_blocks[b].preds.n; j++) {
+        int p = ir_blocks[b].preds.v[j];
+        if(edge_executable[b][j] && !loops[i][p]) {
+          loops[i][p] = 1;
+          sizes[i]++;
+          list_add(&work, p);
+        }
+      }
+    }
+    free(work.v);
+  }
+
+  // biggest (outermost) loops first
+  for(i = 0; i < headers.n; i++) {
+    int biggest = i;
+    for(j = i + 1; j < headers.n; j++) {
+      if(sizes[j] > sizes[biggest])
+        biggest = j;
+    }
+    if(biggest != i) {
+      char *loop = loops[i];
+      int tmp = sizes[i];
+      loops[i] = loops[biggest];
+      loops[biggest] = loop;
+      sizes[i] = sizes[biggest];
+      sizes[biggest] = tmp;
+      tmp = headers.v[i];
+      headers.v[i] = headers.v[biggest];
+      headers.v[biggest] = tmp;
+    }
+  }
+
+  for(i = 0; i < headers.n; i++) {
+    int h = headers.v[i];
+    // each hoist adds two ops
+    int *memo = (int *)calloc(num_ir_ops * 3 + 1, sizeof(int));
+
+    if(!loops[i] || !memo) {
+      free(memo);
+      continue;
+    }
+
+    for(b = 0; b < num_ir_blocks; b++) {
+      if(!loops[i][b])
+        continue;
+      for(j = 0; j < ir_blocks[b].ops.n && ir_frame_size < MAX_FRAME_SIZE; j++) {
+        int op = ir_blocks[b].ops.v[j];
+        ir_op *o = &ir_ops[op];
+        int use = o->use, load, store;
+
+        if(!o->live || use < 0 || (o->kind != IR_OP && !(o->kind == IR_LOADMEM && o->l > 0)))
+          continue;
+        // already hoisted out of an outer loop
+        if(ir_ops[use].kind == IR_STORE && ir_ops[use].pos < 0)
+          continue;
+        if(!ir_invariant(op, loops[i], memo, s))
+          continue;
+        // only the biggest invariant value, not all the pieces of it
+        k = ir_ops[use].kind;
+        if((k == IR_OP || k == IR_CONST || k == IR_LOAD || k == IR_LOADMEM) && ir_invariant(use, loops[i], memo, s))
+          continue;
+
+        store = ir_new_op(IR_STORE, h, o->line);
+        ir_blocks[h].ops.n--;
+        list_add(&ir_blocks[h].pre, store);
+        ir_ops[store].pos = -1;
+        ir_ops[store].var = ir_frame_size;
+        ir_ops[store].a = op;
+        ir_ops[store].live = 1;
+
+        load = ir_new_op(IR_LOAD, b, ir_ops[op].line);
+        ir_ops[load].var = ir_frame_size++;
+        ir_ops[load].live = 1;
+        ir_ops[load].use = use;
+        memo[load] = 2;
+        if(ir_ops[use].a == op)
+          ir_ops[use].a = load;
+        else
+          ir_ops[use].b = load;
+        ir_ops[op].use = store;
+        hoisted++;
+      }
+    }
+
+    free(memo);
+  }
+
+  for(i = 0; i < headers.n; i++)
+    free(loops[i]);
+  free(loops);
+  free(sizes);
+  free(headers.v);
+  return hoisted;
+}
+
+/**
+ * Emits a JMP or JPC to a block, to be patched by ir_lower().
+ *
+ * A block with hoisted code gets jumped into there from outside of its loop,
+ * and right past it from inside.
+ *
+ * @param fixups where to record the jump
+ * @param op JMP or JPC
+ * @param from the block jumping
+ * @param to the block being jumped to
+ * @return 0 on success, 25 on failure
+ */
+int ir_jump(int_list *fixups, int op, int from, int to) {
+  list_add(fixups, segments[curr_seg].cx);
+  list_add(fixups, to);
+  list_add(fixups, ir_blocks[to].pre.n && !ir_dominates(to, from));
+  return emit(op, 0, 0);
+}
+
+/**
+ * Emits the stack code for a value.
+ *
+ * @param op the op that makes the value
+ * @return 0 on success, 25 on failure
+ */
+int ir_emit_tree(int op) {
+  ir_op *o = &ir_ops[op];
+  int error_code = 0;
+
+  switch(o->kind) {
+    case IR_CONST:
+      return emit(LIT, 0, o->m);
+    case IR_LOAD:
+      return emit(LOD, 0, o->var);
+    case IR_LOADMEM:
+      return emit(LOD, o->l, o->m);
+    case IR_READ:
+      return emit(SIO_IN, 0, 2);
+    case IR_OP:
+      error_code = ir_emit_tree(o->a);
+      if(!error_code && o->b >= 0)
+        error_code = ir_emit_tree(o->b);
+      if(!error_code)
+        error_code = emit(OPR, 0, o->opr);
+      return error_code;
+  }
+
+  return error_code;
+}
+
+/**
+ * Emits the IR back into its segment, replacing the old statement part.
+ *
+ * The blocks keep their original order, so a JMP to the next block can just
+ * be left out (unless the next block has hoisted code in front of it, and the
+ * jump is coming from inside of its loop). Temporaries from ir_hoist() make
+ * the frame bigger.
+ *
+ * @param s the segment number
+ * @return 0 on success, 25 on failure
+ */
+int ir_lower(int s) {
+  segment *seg = &segments[s];
+  int saved_seg = curr_seg, saved_line = curr_line;
+  int_list fixups = {0}; // (instruction, block, to the hoisted code?)
+  int b, j, next, error_code = 0;
+
+  curr_seg = s;
+  truncate_code(seg->body);
+
+  if(ir_frame_size > frame_size(s)) {
+    for(j = seg->body - 1; j >= 0; j--) {
+      if(seg->code[j].op == INC) {
+        seg->code[j].m += ir_frame_size - frame_size(s);
+        break;
+      }
+    }
+  }
+
+  for(b = 0; b < num_ir_blocks && !error_code; b++) {
+    ir_block *blk = &ir_blocks[b];
+    if(!blk->executable)
+      continue;
+
+    blk->pre_addr = seg->cx;
+    for(j = 0; j < blk->pre.n && !error_code; j++) {
+      ir_op *o = &ir_ops[blk->pre.v[j]];
+      curr_line = o->line;
+      error_code = ir_emit_tree(o->a);
+      if(!error_code)
+        error_code = emit(STO, 0, o->var);
+    }
+
+    blk->addr = seg->cx;
+    for(next = b + 1; next < num_ir_blocks && !ir_blocks[next].executable; next++);
+    // falling into hoisted code only works from outside of its loop
+    if(next < num_ir_blocks && ir_blocks[next].pre.n && ir_dominates(next, b))
+      next = -1;
+
+    for(j = 0; j < blk->ops.n && !error_code; j++) {
+      ir_op *o = &ir_ops[blk->ops.v[j]];
+      curr_line = o->line;
+
+      switch(o->kind) {
+        case IR_STORE:
+          if(!o->live)
+            break;
+          error_code = ir_emit_tree(o->a);
+          if(!error_code)
+            error_code = emit(STO, 0, o->var);
+          break;
+        case IR_STOREMEM:
+          if(!o->live)
+            break;
+          error_code = ir_emit_tree(o->a);
+          if(!error_code)
+            error_code = emit(STO, o->l, o->m);
+          break;
+        case IR_WRITE:
+          error_code = ir_emit_tree(o->a);
+          if(!error_code)
+            error_code = emit(SIO_OUT, 0, 1);
+          break;
+        case IR_CALL:
+          error_code = emit(CAL, o->l, o->m);
+          break;
+        case IR_JMP:
+          if(blk->succ[0] == next)
+            break;
+          error_code = ir_jump(&fixups, JMP, b, blk->succ[0]);
+          break;
+        case IR_BR:
+          error_code = ir_emit_tree(o->a);
+          if(error_code)
+            break;
+          error_code = ir_jump(&fixups, JPC, b, blk->succ[1]);
+          if(error_code || blk->succ[0] == next)
+            break;
+          error_code = ir_jump(&fixups, JMP, b, blk->succ[0]);
+          break;
+        case IR_RET:
+          error_code = emit(OPR, 0, OPR_RET);
+          break;
+      }
+    }
+  }
+
+  for(j = 0; j + 2 < fixups.n && !error_code; j += 3) {
+    ir_block *target = &ir_blocks[fixups.v[j + 1]];
+    seg->code[fixups.v[j]].m = fixups.v[j + 2] ? target->pre_addr : target->addr;
+  }
+
+  free(fixups.v);
+  curr_seg = saved_seg;
+  curr_line = saved_line;
+  return error_code;
+}
+
+/**
+ * Frees up the memory used by the IR.
+ */
+void ir_destroy() {
+  int i;
+
+  for(i = 0; i < num_ir_ops; i++)
+    free(ir_ops[i].args);
+  free(ir_ops);
+  ir_ops = NULL;
+  num_ir_ops = ir_ops_size = 0;
+
+  for(i = 0; i < num_ir_blocks; i++) {
+    free(ir_blocks[i].ops.v);
+    free(ir_blocks[i].phis.v);
+    free(ir_blocks[i].preds.v);
+    free(ir_blocks[i].frontier.v);
+    free(ir_blocks[i].children.v);
+    free(ir_blocks[i].pre.v);
+    if(edge_executable)
+      free(edge_executable[i]);
+  }
+  free(ir_blocks);
+  ir_blocks = NULL;
+  free(edge_executable);
+  edge_executable = NULL;
+  num_ir_blocks = 0;
+
+  free(ir_rpo);
+  ir_rpo = NULL;
+  num_ir_rpo = 0;
+  free(lattice);
+  lattice = NULL;
+  free(lattice_value);
+  lattice_value = NULL;
+}
@@ -15,6 +15,46 @@
 #include "fancy_string.h"
 #include "lexeme_list.h"
 
+// position of the next character in the input file
+int lex_line = 1, lex_column = 1;
+int lex_last_column = 1; // column before the last newline, for unread_char()
+
+/**
+ * Reads a character from the input file, keeping track of the position.
+ *
+ * @param input_file the PL/0 code
+ * @return the character (or EOF)
+ */
+int read_char(FILE *input_file) {
+  int c = getc(input_file);
+  if(c == '\n') {
+    lex_last_column = lex_column;
+    lex_line++;
+    lex_column = 1;
+  } else if(c != EOF) {
+    lex_column++;
+  }
+  return c;
+}
+
+/**
+ * Puts a character back into the input file, undoing read_char().
+ *
+ * @param c the character
+ * @param input_file the PL/0 code
+ */
+void unread_char(int c, FILE *input_file) {
+  if(c == EOF)
+    return;
+  ungetc(c, input_file);
+  if(c == '\n') {
+    lex_line--;
+    lex_column = lex_last_column;
+  } else {
+    lex_column--;
+  }
+}
+
 /**
  * The main function for lexical analysis.
  *
@@ -29,16 +69,19 @@ int pl0_lex(FILE *input_file, FILE *output_file, int l_flag) {
   fancy_string *lex_tmp = NULL;
   token_type t_tmp = nulsym;
   lexeme_list *lexemes = NULL;
+  int token_line, token_column;
 
   while(!feof(input_file)) {
-    c = getc(input_file);
+    token_line = lex_line;
+    token_column = lex_column;
+    c = read_char(input_file);
 
     /* reserved words, identfiers */
     /******************************/
     if(is_letter(c)) {
       lex_tmp = fancy_push(lex_tmp, (char)c);
       while((is_letter(c) || is_digit(c)) && !feof(input_file)) {
-        c = getc(input_file);
+        c = read_char(input_file);
         if(is_letter(c)) {
           lex_tmp = fancy_push(lex_tmp, (char)c);
         } else if(is_digit(c)) {
@@ -46,7 +89,7 @@ int pl0_lex(FILE *input_file, FILE *output_file, int l_flag) {
           lex_tmp = fancy_push(lex_tmp, (char)c);
         }
       }
-      ungetc(c, input_file);
+      unread_char(c, input_file);
 
       // if we still don't know what t_tmp is...
       if(t_tmp != identsym) {
@@ -75,7 +118,7 @@ int pl0_lex(FILE *input_file, FILE *output_file, int l_flag) {
       }
       */
 
-      lexemes = add_lexeme(lexemes, lex_tmp->value, t_tmp);
+      lexemes = add_lexeme(lexemes, lex_tmp->value, t_tmp, token_line, token_column);
   }
 
   /* numbers */
@@ -84,7 +127,7 @@ int pl0_lex(FILE *input_file, FILE *output_file, int l_flag) {
     t_tmp = numbersym;
     lex_tmp = fancy_push(lex_tmp, (char)c);
     while(is_digit(c) && !feof(input_file)) {
-      c = getc(input_file);
+      c = read_char(input_file);
       if(is_digit(c)) {
         lex_tmp = fancy_push(lex_tmp, (char)c);
       }
@@ -95,14 +138,14 @@ int pl0_lex(FILE *input_file, FILE *output_file, int l_flag) {
       // get the rest of the bad identifier
       lex_tmp = fancy_push(lex_tmp, (char)c);
       while(is_letter(c) && !feof(input_file)) {
-        c = getc(input_file);
+        c = read_char(input_file);
         if(is_letter(c))
           lex_tmp = fancy_push(lex_tmp, (char)c);
       }
       fprintf(stderr, "SCANNER ERROR: Variable does not start with letter: %s.\n", lex_tmp->value);
       exit(EXIT_FAILURE);
     }
-    ungetc(c, input_file);
+    unread_char(c, input_file);
 
     // number has too many digits
     if(lex_tmp->size > 5) {
@@ -110,7 +153,7 @@ int pl0_lex(FILE *input_file, FILE *output_file, int l_flag) {
       exit(EXIT_FAILURE);
     }
 
-    lexemes = add_lexeme(lexemes, lex_tmp->value, t_tmp);
+    lexemes = add_lexeme(lexemes, lex_tmp->value, t_tmp, token_line, token_column);
   }
 
   /* special symbols */
@@ -118,13 +161,13 @@ int pl0_lex(FILE *input_file, FILE *output_file, int l_flag) {
   else if(is_special_symbol(c)) {
     // check for comment...
     if(c == '/') {
-      c = getc(input_file);
+      c = read_char(input_file);
       // got a comment here...
       if(c == '*') {
         while(!end_comment && !feof(input_file)) {
-          c = getc(input_file);
+          c = read_char(input_file);
           if(c == '*') {
-            c = getc(input_file);
+            c = read_char(input_file);
             if(c == '/')
               end_comment = 1;
           }
@@ -136,7 +179,7 @@ int pl0_lex(FILE *input_file, FILE *output_file, int l_flag) {
           exit(EXIT_FAILURE);
         }
       } else {
-        ungetc(c, input_file);
+        unread_char(c, input_file);
         c = '/';
       }
     }
@@ -145,24 +188,24 @@ int pl0_lex(FILE *input_file, FILE *output_file, int l_flag) {
     if(!end_comment) {
       lex_tmp = fancy_push(lex_tmp, (char)c);
       if(is_special_symbol(c)) {
-        c = getc(input_file);
+        c = read_char(input_file);
         if(is_special_symbol(c))
           lex_tmp = fancy_push(lex_tmp, (char)c);
         else
-          ungetc(c, input_file);
+          unread_char(c, input_file);
       } else {
-        ungetc(c, input_file);
+        unread_char(c, input_file);
       }
 
       // check to make sure t_tmp gets set
       while(lex_tmp->size > 0 && t_tmp == nulsym) {
         t_tmp = get_special_symbol_sym(lex_tmp->value);
         if(t_tmp == nulsym)
-          ungetc(fancy_pop(lex_tmp), input_file);
+          unread_char(fancy_pop(lex_tmp), input_file);
       }
 
       if(t_tmp != nulsym)
-        lexemes = add_lexeme(lexemes, lex_tmp->value, t_tmp);
+        lexemes = add_lexeme(lexemes, lex_tmp->value, t_tmp, token_line, token_column);
       else if(!(lex_tmp->size <= 1 && is_invisible_character(lex_tmp->value[0]))) {
         fprintf(stderr, "SCANNER ERROR: Invalid symbol: ");
         int i;
@@ -196,7 +239,7 @@ if(l_flag) {
   printf("\n");
 }
 
-print_internal_lexeme_list(output_file, lexemes);
+print_positioned_lexeme_list(output_file, lexemes);
 
 destroy_lexemes(lexemes);
 
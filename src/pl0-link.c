@@ -0,0 +1,540 @@
+/*
+ * PL/0 Compiler
+ * Filename: pl0-link.c
+ *
+ * Keeps track of the per-procedure code segments and links them together into
+ * the global code array once everything has been generated.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pl0-compiler.h"
+#include "pl0-link.h"
+#include "pm0.h"
+
+// number of instructions a segment takes up once linked (children included)
+int link_size[MAX_SEGMENTS] = {0};
+
+/**
+ * Creates a new (empty) code segment.
+ *
+ * The segment gets placed inside of its parent wherever the parent currently
+ * ends, which is the spot where the procedure was declared.
+ *
+ * @param name the procedure name (empty string for the main block)
+ * @param parent the enclosing segment, -1 for the main block
+ * @param level the L level of the code in the segment
+ * @return the new segment number, -1 if there are too many segments
+ */
+int new_segment(char *name, int parent, int level) {
+  segment *seg;
+
+  if(num_segments >= MAX_SEGMENTS)
+    return -1;
+
+  seg = &segments[num_segments];
+  strncpy(seg->name, name, 11);
+  seg->name[11] = '\0';
+  seg->level = level;
+  seg->parent = parent;
+  seg->offset = (parent >= 0) ? segments[parent].cx : 0;
+  seg->addr = 0;
+  seg->external = 0;
+  seg->body = 0;
+  seg->cx = 0;
+  seg->size = 0;
+  seg->code = NULL;
+
+  if(DEBUG) printf("DEBUG: new segment %d (%s), parent %d, level %d\n", num_segments, name, parent, level);
+
+  return num_segments++;
+}
+
+/**
+ * Appends an instruction to the end of a segment.
+ *
+ * @param s the segment number
+ * @param op the op code
+ * @param l the l value (lexical level)
+ * @param m an address, value, OPR code, etc.
+ * @return 0 on success, 25 on failure
+ */
+int segment_emit(int s, int op, int l, int m) {
+  segment *seg = &segments[s];
+
+  if(seg->cx >= seg->size) {
+    int size = seg->size ? seg->size * 2 : 16;
+    instruction *tmp = (instruction *)realloc(seg->code, size * sizeof(instruction));
+    if(!tmp)
+      return 25;
+    seg->code = tmp;
+    seg->size = size;
+  }
+
+  seg->code[seg->cx].op = op;
+  seg->code[seg->cx].l = l;
+  seg->code[seg->cx].m = m;
+  seg->code[seg->cx].line = 0;
+  seg->cx++;
+
+  return 0;
+}
+
+/**
+ * Frees up the memory used by the segments.
+ */
+void destroy_segments() {
+  int i;
+  for(i = 0; i < num_segments; i++) {
+    free(segments[i].code);
+    segments[i].code = NULL;
+    segments[i].cx = segments[i].size = 0;
+  }
+  num_segments = 0;
+}
+
+/**
+ * Returns the address in code[] of an instruction in a segment.
+ *
+ * Every child segment placed at or before the instruction pushes it down by
+ * the size of the child plus the JMP over it.
+ *
+ * @param s the segment number
+ * @param i the instruction index inside of the segment
+ * @return the linked address
+ */
+int linked_addr(int s, int i) {
+  int addr = segments[s].addr + i;
+  int c;
+  for(c = s + 1; c < num_segments; c++) {
+    if(segments[c].parent == s && segments[c].cx && segments[c].offset <= i)
+      addr += 1 + link_size[c];
+  }
+  return addr;
+}
+
+/**
+ * Gives addresses to a segment and (recursively) to its children.
+ *
+ * @param s the segment number
+ * @param addr the address where the segment starts
+ */
+void place_segment(int s, int addr) {
+  int i, c;
+  segments[s].addr = addr;
+  for(i = 0; i <= segments[s].cx; i++) {
+    for(c = s + 1; c < num_segments; c++) {
+      if(segments[c].parent == s && segments[c].cx && segments[c].offset == i) {
+        addr++; // JMP over the child
+        place_segment(c, addr);
+        addr += link_size[c];
+      }
+    }
+    addr++;
+  }
+}
+
+/**
+ * Copies a segment (and its children) into code[], relocating as it goes.
+ *
+ * @param s the segment number
+ */
+void copy_segment(int s) {
+  segment *seg = &segments[s];
+  int i, c;
+
+  for(i = 0; i <= seg->cx; i++) {
+    // children declared here go first, each with a JMP over it
+    for(c = s + 1; c < num_segments; c++) {
+      if(segments[c].parent == s && segments[c].cx && segments[c].offset == i) {
+        code[cx].op = JMP;
+        code[cx].l = 0;
+        code[cx].m = segments[c].addr + link_size[c];
+        code[cx].line = 0;
+        cx++;
+        copy_segment(c);
+      }
+    }
+
+    if(i == seg->cx)
+      break;
+
+    code[cx] = seg->code[i];
+    add_line_entry(cx, code[cx].line, s);
+    if(code[cx].op == JMP || code[cx].op == JPC)
+      code[cx].m = linked_addr(s, code[cx].m);
+    else if(code[cx].op == CAL || code[cx].op == TCL)
+      code[cx].m = linked_addr(code[cx].m, 0);
+    cx++;
+  }
+}
+
+/**
+ * Links all of the segments together into code[].
+ *
+ * The main block (segment 0) is placed at address 0 and every procedure is
+ * placed where it was declared, with a JMP over it, so the result is laid out
+ * just like a single pass over the source would have laid it out. Empty
+ * segments (procedures that remove_dead_procedures() threw out) don't get
+ * placed at all.
+ *
+ * @return 0 on success, 25 if the program is too long
+ */
+int pl0_link() {
+  int s, total = 0;
+
+  if(!num_segments)
+    return 0;
+
+  // sizes, bottom-up (children always come after their parents)
+  for(s = num_segments - 1; s >= 0; s--) {
+    link_size[s] = segments[s].cx;
+  }
+  for(s = num_segments - 1; s > 0; s--) {
+    if(segments[s].cx)
+      link_size[segments[s].parent] += 1 + link_size[s];
+  }
+  total = link_size[0];
+
+  if(total > MAX_CODE_LENGTH)
+    return 25;
+
+  place_segment(0, 0);
+
+  cx = 0;
+  num_line_entries = 0;
+  copy_segment(0);
+
+  if(DEBUG) printf("DEBUG: linked %d segments, %d instructions\n", num_segments, cx);
+
+  return 0;
+}
+
+/*
+ * Object files
+ * ============
+ *
+ * A unit compiled with -c gets written out as a plain text object file:
+ *
+ *   pl0-object 1
+ *   globals <n>
+ *   <name> <addr>                          (one per global variable)
+ *   segments <n>
+ *   <name> <level> <parent> <offset> <external> <cx>
+ *   <op> <l> <m>                           (cx of these per segment)
+ *   relocations <n>
+ *   <segment> <index> jump|call|global <target>
+ *
+ * Segment names are "-" for the main block. Relocations cover every JMP/JPC
+ * (segment-relative), every CAL and TCL (target is a segment number in the same
+ * object) and every LOD/STO of a global (target is the global's name).
+ * Procedures declared in a unit's main block are exported, and calls to
+ * procedures the unit never declared become external segments that the
+ * linker resolves by name.
+ */
+
+// state for the linker, see read_object()
+char link_globals[MAX_SYMBOL_TABLE_SIZE][12];
+int num_link_globals = 0;
+char link_externals[MAX_SEGMENTS][12];
+int num_link_externals = 0;
+
+/**
+ * Writes the segments out as an object file.
+ *
+ * @param output_file the object file
+ * @param symbols the symbol table (for the names of the globals)
+ * @param num_symbols the size of the symbol table
+ * @return 0 on success
+ */
+int write_object(FILE *output_file, symbol *symbols, int num_symbols) {
+  int i, s, n = 0;
+
+  fprintf(output_file, "pl0-object 1\n");
+
+  for(i = 0; i < num_symbols; i++) {
+    if(symbols[i].kind == 2 && symbols[i].level == 0)
+      n++;
+  }
+  fprintf(output_file, "globals %d\n", n);
+  for(i = 0; i < num_symbols; i++) {
+    if(symbols[i].kind == 2 && symbols[i].level == 0)
+      fprintf(output_file, "%s %d\n", symbols[i].name, symbols[i].addr);
+  }
+
+  fprintf(output_file, "segments %d\n", num_segments);
+  n = 0;
+  for(s = 0; s < num_segments; s++) {
+    segment *seg = &segments[s];
+    fprintf(output_file, "%s %d %d %d %d %d\n", strlen(seg->name) ? seg->name : "-",
+        seg->level, seg->parent, seg->offset, seg->external, seg->cx);
+    for(i = 0; i < seg->cx; i++) {
+      fprintf(output_file, "%d %d %d\n", seg->code[i].op, seg->code[i].l, seg->code[i].m);
+      if(is_relocatable(seg, i))
+        n++;
+    }
+  }
+
+  fprintf(output_file, "relocations %d\n", n);
+  for(s = 0; s < num_segments; s++) {
+    segment *seg = &segments[s];
+    for(i = 0; i < seg->cx; i++) {
+      instruction *ir = &seg->code[i];
+      if(!is_relocatable(seg, i))
+        continue;
+      if(ir->op == JMP || ir->op == JPC) {
+        fprintf(output_file, "%d %d jump %d\n", s, i, ir->m);
+      } else if(ir->op == CAL || ir->op == TCL) {
+        fprintf(output_file, "%d %d call %d\n", s, i, ir->m);
+      } else {
+        // LOD/STO of a global
+        for(n = 0; n < num_symbols; n++) {
+          if(symbols[n].kind == 2 && symbols[n].level == 0 && symbols[n].addr == ir->m)
+            break;
+        }
+        fprintf(output_file, "%d %d global %s\n", s, i, (n < num_symbols) ? symbols[n].name : "-");
+      }
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Checks whether an instruction needs a relocation entry.
+ *
+ * @param seg the segment
+ * @param i the instruction index inside of the segment
+ * @return 1 if the instruction needs relocating, 0 otherwise
+ */
+int is_relocatable(segment *seg, int i) {
+  instruction *ir = &seg->code[i];
+  if(ir->op == JMP || ir->op == JPC || ir->op == CAL || ir->op == TCL)
+    return 1;
+  // l levels down from this segment is the main block
+  if((ir->op == LOD || ir->op == STO) && seg->level - ir->l == 0)
+    return 1;
+  return 0;
+}
+
+/**
+ * Returns the frame slot for a global, adding it if it's new.
+ *
+ * Globals with the same name in different units are the same variable.
+ *
+ * @param name the name of the global
+ * @return the address of the global in the main block's frame
+ */
+int link_global(char *name) {
+  int i;
+  for(i = 0; i < num_link_globals; i++) {
+    if(strcmp(link_globals[i], name) == 0)
+      return 3 + i;
+  }
+  strcpy(link_globals[num_link_globals], name);
+  return 3 + num_link_globals++;
+}
+
+/**
+ * Reads an object file and merges it into the segments.
+ *
+ * The first object creates the main block. Every unit's main block statement
+ * gets appended to it (in the order the objects are read), and every unit's
+ * procedures become children of it.
+ *
+ * @param input_file the object file
+ * @return 0 on success, 1 on failure
+ */
+int read_object(FILE *input_file) {
+  int seg_map[MAX_SEGMENTS];
+  int num_globals = 0, num_segs = 0, num_relocs = 0;
+  int version = 0, main_base = 0, main_prologue = 0;
+  int i, j;
+  char name[12], kind[12];
+
+  if(fscanf(input_file, "%11s %d", name, &version) != 2 || strcmp(name, "pl0-object") != 0 || version != 1) {
+    fprintf(stderr, "LINKER ERROR: Not an object file.\n");
+    return 1;
+  }
+
+  // the merged main block: INC 0 3, INC 0 (globals), unit statements, RET
+  if(!num_segments) {
+    new_segment("", -1, 0);
+    segment_emit(0, INC, 0, 3);
+    segment_emit(0, INC, 0, 0);
+  }
+
+  if(fscanf(input_file, "%11s %d", name, &num_globals) != 2 || num_globals < 0 || num_globals > MAX_SYMBOL_TABLE_SIZE) {
+    fprintf(stderr, "LINKER ERROR: Bad globals table.\n");
+    return 1;
+  }
+  for(i = 0; i < num_globals; i++) {
+    int addr;
+    if(fscanf(input_file, "%11s %d", name, &addr) != 2 || addr < 0 || addr >= MAX_SYMBOL_TABLE_SIZE + 3) {
+      fprintf(stderr, "LINKER ERROR: Bad globals table.\n");
+      return 1;
+    }
+    link_global(name);
+  }
+
+  if(fscanf(input_file, "%11s %d", name, &num_segs) != 2 || num_segs < 1 || num_segs > MAX_SEGMENTS) {
+    fprintf(stderr, "LINKER ERROR: Bad segment table.\n");
+    return 1;
+  }
+  for(i = 0; i < num_segs; i++) {
+    int level, parent, offset, external, seg_cx, s;
+    if(fscanf(input_file, "%11s %d %d %d %d %d", name, &level, &parent, &offset, &external, &seg_cx) != 6
+        || parent >= i || (i > 0 && parent < 0)) {
+      fprintf(stderr, "LINKER ERROR: Bad segment table.\n");
+      return 1;
+    }
+
+    if(i == 0) {
+      // the unit's main block, minus its INCs and its RET
+      seg_map[0] = 0;
+      main_base = segments[0].cx;
+      for(j = 0; j < seg_cx; j++) {
+        instruction ir;
+        if(fscanf(input_file, "%d %d %d", &ir.op, &ir.l, &ir.m) != 3) {
+          fprintf(stderr, "LINKER ERROR: Unexpected end of object file.\n");
+          return 1;
+        }
+        if(ir.op == INC && j == main_prologue)
+          main_prologue++;
+        else if(j < seg_cx - 1)
+          segment_emit(0, ir.op, ir.l, ir.m);
+      }
+      continue;
+    }
+
+    if(external) {
+      // calls to it get patched in resolve_externals()
+      for(j = 0; j < num_link_externals; j++) {
+        if(strcmp(link_externals[j], name) == 0)
+          break;
+      }
+      if(j == num_link_externals)
+        strcpy(link_externals[num_link_externals++], name);
+      seg_map[i] = -1 - j;
+      continue;
+    }
+
+    s = new_segment(name, seg_map[parent], level);
+    if(s < 0) {
+      fprintf(stderr, "LINKER ERROR: Too many procedures.\n");
+      return 1;
+    }
+    // procedures from the unit's main block go right after the merged INCs
+    segments[s].offset = (parent == 0) ? 2 : offset;
+    seg_map[i] = s;
+
+    for(j = 0; j < seg_cx; j++) {
+      instruction ir;
+      if(fscanf(input_file, "%d %d %d", &ir.op, &ir.l, &ir.m) != 3) {
+        fprintf(stderr, "LINKER ERROR: Unexpected end of object file.\n");
+        return 1;
+      }
+      if(segment_emit(s, ir.op, ir.l, ir.m))
+        return 1;
+    }
+  }
+
+  if(fscanf(input_file, "%11s %d", name, &num_relocs) != 2 || num_relocs < 0) {
+    fprintf(stderr, "LINKER ERROR: Bad relocation table.\n");
+    return 1;
+  }
+  for(i = 0; i < num_relocs; i++) {
+    int s, idx;
+    instruction *ir;
+    char target[12];
+
+    if(fscanf(input_file, "%d %d %11s %11s", &s, &idx, kind, target) != 4 || s < 0 || s >= num_segs || seg_map[s] < 0) {
+      fprintf(stderr, "LINKER ERROR: Bad relocation table.\n");
+      return 1;
+    }
+
+    if(s == 0) {
+      if(idx < main_prologue)
+        continue;
+      idx = main_base + idx - main_prologue;
+    }
+    if(idx < 0 || idx >= segments[seg_map[s]].cx) {
+      fprintf(stderr, "LINKER ERROR: Bad relocation table.\n");
+      return 1;
+    }
+    ir = &segments[seg_map[s]].code[idx];
+
+    if(strcmp(kind, "jump") == 0) {
+      if(s == 0)
+        ir->m = main_base + ir->m - main_prologue;
+    } else if(strcmp(kind, "call") == 0) {
+      if(ir->m <= 0 || ir->m >= num_segs) {
+        fprintf(stderr, "LINKER ERROR: Bad relocation table.\n");
+        return 1;
+      }
+      ir->m = seg_map[ir->m];
+    } else if(strcmp(kind, "global") == 0) {
+      ir->m = link_global(target);
+    } else {
+      fprintf(stderr, "LINKER ERROR: Unknown relocation \"%s\".\n", kind);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Resolves calls to external procedures and finishes off the main block.
+ *
+ * Must be called after the last read_object() and before pl0_link().
+ *
+ * @return 0 on success, 1 on failure
+ */
+int resolve_externals() {
+  int external_seg[MAX_SEGMENTS];
+  int i, s, t;
+
+  if(!num_segments) {
+    fprintf(stderr, "LINKER ERROR: Nothing to link.\n");
+    return 1;
+  }
+
+  // exported procedures must have unique names
+  for(s = 1; s < num_segments; s++) {
+    if(segments[s].parent != 0)
+      continue;
+    for(t = s + 1; t < num_segments; t++) {
+      if(segments[t].parent == 0 && strcmp(segments[s].name, segments[t].name) == 0) {
+        fprintf(stderr, "LINKER ERROR: Procedure %s is defined more than once.\n", segments[s].name);
+        return 1;
+      }
+    }
+  }
+
+  for(i = 0; i < num_link_externals; i++) {
+    external_seg[i] = -1;
+    for(s = 1; s < num_segments; s++) {
+      if(segments[s].parent == 0 && strcmp(segments[s].name, link_externals[i]) == 0)
+        external_seg[i] = s;
+    }
+    if(external_seg[i] < 0) {
+      fprintf(stderr, "LINKER ERROR: Undefined procedure %s.\n", link_externals[i]);
+      return 1;
+    }
+  }
+
+  for(s = 0; s < num_segments; s++) {
+    for(i = 0; i < segments[s].cx; i++) {
+      if(segments[s].code[i].op == CAL && segments[s].code[i].m < 0)
+        segments[s].code[i].m = external_seg[-1 - segments[s].code[i].m];
+    }
+  }
+
+  segments[0].code[1].m = num_link_globals;
+  if(segment_emit(0, OPR, 0, OPR_RET))
+    return 1;
+
+  return 0;
+}
@@ -0,0 +1,80 @@
+/*
+ * PL/0 Compiler
+ * Filename: pl0-linker.c
+ *
+ * Driver for pl0-link. Links object files made with pl0-compiler -c into a
+ * single program and runs it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pl0-compiler.h"
+#include "pl0-link.h"
+#include "pm0.h"
+
+int main(int argc, char **argv) {
+  int a_flag = 0, v_flag = 0; // output flags
+  int num_objects = 0;
+  int error_code = 0;
+  int i, j;
+
+  for(i = 1; i < argc; i++) {
+    if(argv[i][0] == '-') {
+      for(j = 1; j < strlen(argv[i]); j++) {
+        if(argv[i][j] == 'a') a_flag = 1;
+        else if(argv[i][j] == 'v') v_flag = 1;
+        else {
+          printf("Unknown option: %s\n", argv[i]);
+          exit(EXIT_FAILURE);
+        }
+      }
+    } else {
+      num_objects++;
+    }
+  }
+
+  if(!num_objects) {
+    printf("Usage: pl0-link [-a] [-v] object_file [object_file ...]\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // objects are linked in the order they were given
+  for(i = 1; i < argc; i++) {
+    if(argv[i][0] == '-')
+      continue;
+
+    FILE *object_file = fopen(argv[i], "r");
+    if(!object_file) {
+      printf("File %s not found.\n", argv[i]);
+      exit(EXIT_FAILURE);
+    }
+    error_code = read_object(object_file);
+    fclose(object_file);
+
+    if(error_code) {
+      fprintf(stderr, "LINKER ERROR: Could not link %s.\n", argv[i]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if(resolve_externals())
+    exit(EXIT_FAILURE);
+
+  if(pl0_link()) {
+    fprintf(stderr, "LINKER ERROR: Program is too long.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if(a_flag) {
+    print_code(stdout);
+    print_code_pretty(stdout);
+    printf("\n");
+  }
+
+  run_code(v_flag);
+
+  destroy_segments();
+
+  return EXIT_SUCCESS;
+}
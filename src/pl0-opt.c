@@ -0,0 +1,2554 @@
+/*
+ * PL/0 Compiler
+ * Filename: pl0-opt.c
+ *
+ * Optimization passes, only run with -O. The dead code passes work on the
+ * segments before linking. The peephole optimizer works on the linked program
+ * in code[], so it can also clean up after pl0_link().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pl0-compiler.h"
+#include "pl0-ir.h"
+#include "pl0-opt.h"
+#include "pl0-parsegen.h"
+#include "pl0-profile.h"
+#include "pm0.h"
+
+int unroll_factor = UNROLL_FACTOR; // set with -U
+
+/**
+ * Marks every instruction that something can jump or call to.
+ *
+ * @param targets set to 1 for every target, 0 for everything else (must hold
+ *                cx ints)
+ */
+void find_targets(int *targets) {
+  int i;
+
+  memset(targets, 0, cx * sizeof(int));
+  if(cx)
+    targets[0] = 1;
+
+  for(i = 0; i < cx; i++) {
+    if((code[i].op == JMP || is_branch(code[i].op) || code[i].op == CAL || code[i].op == TCL) && code[i].m >= 0 && code[i].m < cx)
+      targets[code[i].m] = 1;
+  }
+}
+
+/**
+ * Follows a chain of JMPs to where it finally ends up.
+ *
+ * @param target the address being jumped to
+ * @return the address at the end of the chain
+ */
+int thread_jump(int target) {
+  int hops = 0;
+
+  // hops keeps a JMP loop from spinning forever
+  while(target >= 0 && target < cx && code[target].op == JMP && code[target].m != target && hops++ < cx) {
+    target = code[target].m;
+  }
+
+  return target;
+}
+
+/**
+ * Squeezes the removed instructions out of code[].
+ *
+ * Every JMP, JPC (or fused branch), CAL and TCL gets retargeted. Anything aimed at a removed
+ * instruction ends up at the next instruction that was kept. The segment
+ * addresses and the line table are moved along with the code.
+ *
+ * @param removed 1 for every instruction to remove (must hold cx ints)
+ * @return the number of instructions removed
+ */
+int compact_code(int *removed) {
+  int new_addr[MAX_CODE_LENGTH + 1];
+  int i, j, n = 0;
+
+  for(i = 0; i < cx; i++) {
+    new_addr[i] = n;
+    if(!removed[i])
+      n++;
+  }
+  new_addr[cx] = n;
+
+  if(n == cx)
+    return 0;
+
+  for(i = 0, j = 0; i < cx; i++) {
+    if(removed[i])
+      continue;
+    code[j] = code[i];
+    if((code[j].op == JMP || is_branch(code[j].op) || code[j].op == CAL || code[j].op == TCL) && code[j].m >= 0 && code[j].m <= cx)
+      code[j].m = new_addr[code[j].m];
+    j++;
+  }
+
+  for(i = 0; i < num_segments; i++) {
+    if(segments[i].addr >= 0 && segments[i].addr <= cx)
+      segments[i].addr = new_addr[segments[i].addr];
+  }
+
+  // entries that lost all of their instructions get dropped
+  for(i = 0, j = 0; i < num_line_entries; i++) {
+    line_entry entry = line_table[i];
+    entry.pc = new_addr[entry.pc];
+    if(entry.pc >= n)
+      continue;
+    if(j && line_table[j - 1].pc == entry.pc)
+      j--;
+    if(j && line_table[j - 1].line == entry.line && line_table[j - 1].seg == entry.seg)
+      continue;
+    line_table[j++] = entry;
+  }
+  num_line_entries = j;
+
+  i = cx - n;
+  cx = n;
+  return i;
+}
+
+/**
+ * Finds the power of two a number is.
+ *
+ * @param n the number
+ * @return k if n is 2^k (with k > 0), -1 otherwise
+ */
+int exact_log2(int n) {
+  int k = 0;
+  if(n < 2 || (n & (n - 1)))
+    return -1;
+  while(n > 1) {
+    n >>= 1;
+    k++;
+  }
+  return k;
+}
+
+/**
+ * Turns a LIT into a cheaper instruction that does the OPR after it too.
+ *
+ * Multiplying by 2^k becomes SHL k, and dividing by a constant of at least 2
+ * becomes DIVC, which the VM does with a multiply-high instead of a divide.
+ *
+ * @param ir the LIT
+ * @param opr the OPR code that comes after it
+ * @return 1 if the LIT got replaced (and the OPR should go), 0 otherwise
+ */
+int strength_reduce(instruction *ir, int opr) {
+  int k = exact_log2(ir->m);
+
+  if(opr == OPR_MUL && k > 0) {
+    ir->op = SHL;
+    ir->m = k;
+  } else if(opr == OPR_DIV && ir->m >= 2) {
+    ir->op = DIVC;
+  } else {
+    return 0;
+  }
+
+  ir->l = 0;
+  return 1;
+}
+
+/**
+ * Finds the fused branch that does a relational OPR and the JPC after it.
+ *
+ * JPC jumps when the condition is false, so the fused branch tests for the
+ * opposite: OPR_LSS followed by JPC becomes JGE.
+ *
+ * @param opr the OPR code
+ * @return the fused op code, -1 if opr isn't a relational operator
+ */
+int fused_branch(int opr) {
+  switch(opr) {
+    case OPR_EQL:
+      return JNE;
+    case OPR_NEQ:
+      return JEQ;
+    case OPR_LSS:
+      return JGE;
+    case OPR_LEQ:
+      return JGT;
+    case OPR_GTR:
+      return JLE;
+    case OPR_GEQ:
+      return JLT;
+    case OPR_ODD:
+      return JEVN;
+  }
+  return -1;
+}
+
+/**
+ * Tells whether an instruction is a conditional branch.
+ *
+ * @param op the op code
+ * @return 1 for JPC and the fused branches, 0 otherwise
+ */
+int is_branch(int op) {
+  return op == JPC || (op >= JEQ && op <= JEVN);
+}
+
+/**
+ * Finds the value number of an expression, giving it a new one the first time
+ * it shows up.
+ *
+ * @param values the expressions numbered so far, as {op, m, a, b}
+ * @param n how many there are
+ * @param op the instruction's op code
+ * @param m the instruction's m value
+ * @param a the value number of the first operand, -1 if none
+ * @param b the value number of the second operand, -1 if none
+ * @return the value number
+ */
+int value_number(int (*values)[4], int *n, int op, int m, int a, int b) {
+  int v;
+
+  for(v = 0; v < *n; v++) {
+    if(values[v][0] == op && values[v][1] == m && values[v][2] == a && values[v][3] == b)
+      return v;
+  }
+
+  values[*n][0] = op;
+  values[*n][1] = m;
+  values[*n][2] = a;
+  values[*n][3] = b;
+  return (*n)++;
+}
+
+/**
+ * Common subexpression elimination inside of each basic block.
+ *
+ * Goes through the block keeping track of the value number of everything on
+ * the stack (and of every variable, as of its last STO or LOD). When the code
+ * for a value ends up computing something that is already on top of the stack
+ * or right under it, all of that code becomes a single DUP or OVER, so
+ * (a + b) * (a + b) only adds once.
+ *
+ * A CAL can change any variable, so it forgets all of them, and every `in`
+ * reads a new value (the code around one never goes away).
+ *
+ * Must be called after pl0_link().
+ *
+ * @return the number of instructions saved
+ */
+int local_cse() {
+  int targets[MAX_CODE_LENGTH];
+  int removed[MAX_CODE_LENGTH];
+  int values[MAX_CODE_LENGTH][4];
+  int vars[MAX_CODE_LENGTH][3]; // l, m, value number
+  int stack[MAX_STACK_HEIGHT];  // value numbers
+  int start[MAX_STACK_HEIGHT];  // where the code for each one starts
+  int pure[MAX_STACK_HEIGHT];   // 0 if that code reads a number
+  int sp = 0, n = 0, num_vars = 0;
+  int i, j, l, saved;
+
+  find_targets(targets);
+  memset(removed, 0, cx * sizeof(int));
+
+  for(i = 0; i < cx; i++) {
+    instruction *ir = &code[i];
+    int v = -1, s = i, p = 1, reset = 0;
+
+    if(targets[i])
+      sp = n = num_vars = 0;
+
+    switch(ir->op) {
+      case LIT:
+        v = value_number(values, &n, LIT, ir->m, -1, -1);
+        break;
+      case LOD:
+      case LODR:
+        l = ir->op == LODR ? -1 : ir->l; // registers get l = -1
+        for(j = 0; j < num_vars; j++) {
+          if(vars[j][0] == l && vars[j][1] == ir->m)
+            v = vars[j][2];
+        }
+        if(v < 0) {
+          // nothing else can have this value number
+          v = value_number(values, &n, LOD, n, -1, -1);
+          vars[num_vars][0] = l;
+          vars[num_vars][1] = ir->m;
+          vars[num_vars++][2] = v;
+        }
+        break;
+      case STO:
+      case STOR:
+        if(sp < 1) {
+          reset = 1;
+          break;
+        }
+        sp--;
+        l = ir->op == STOR ? -1 : ir->l;
+        for(j = 0; j < num_vars && (vars[j][0] != l || vars[j][1] != ir->m); j++);
+        vars[j][0] = l;
+        vars[j][1] = ir->m;
+        vars[j][2] = stack[sp];
+        if(j == num_vars)
+          num_vars++;
+        break;
+      case OPR:
+        if(ir->m == OPR_DUP || ir->m == OPR_OVER) {
+          j = ir->m == OPR_DUP ? 1 : 2;
+          if(sp < j)
+            reset = 1;
+          else
+            v = stack[sp - j];
+        } else if(ir->m == OPR_NEG || ir->m == OPR_ODD) {
+          if(sp < 1) {
+            reset = 1;
+            break;
+          }
+          sp--;
+          s = start[sp];
+          p = pure[sp];
+          v = value_number(values, &n, OPR, ir->m, stack[sp], -1);
+        } else if(ir->m != OPR_RET && sp >= 2) {
+          int a = stack[sp - 2], b = stack[sp - 1];
+          if((ir->m == OPR_ADD || ir->m == OPR_MUL || ir->m == OPR_EQL || ir->m == OPR_NEQ) && a > b) {
+            a = stack[sp - 1];
+            b = stack[sp - 2];
+          }
+          sp -= 2;
+          s = start[sp];
+          p = pure[sp] && pure[sp + 1];
+          v = value_number(values, &n, OPR, ir->m, a, b);
+        } else {
+          reset = 1;
+        }
+        break;
+      case SHL:
+      case DIVC:
+        if(sp < 1) {
+          reset = 1;
+          break;
+        }
+        sp--;
+        s = start[sp];
+        p = pure[sp];
+        v = value_number(values, &n, ir->op, ir->m, stack[sp], -1);
+        break;
+      case SIO_OUT:
+        if(sp < 1)
+          reset = 1;
+        else
+          sp--;
+        break;
+      case SIO_IN:
+        v = value_number(values, &n, SIO_IN, n, -1, -1);
+        p = 0;
+        break;
+      case CAL:
+        num_vars = 0;
+        break;
+      default:
+        // INC, JMP, TCL and the branches
+        reset = 1;
+        break;
+    }
+
+    if(reset || sp >= MAX_STACK_HEIGHT) {
+      sp = n = num_vars = 0;
+      continue;
+    }
+    if(v < 0)
+      continue;
+
+    // a lone LIT isn't worth it, but a LOD has to walk the static links
+    if(p && (i > s || ir->op == LOD || ir->op == LODR)) {
+      int dup = -1;
+      if(sp >= 1 && stack[sp - 1] == v)
+        dup = OPR_DUP;
+      else if(sp >= 2 && stack[sp - 2] == v)
+        dup = OPR_OVER;
+
+      if(dup >= 0) {
+        code[s].op = OPR;
+        code[s].l = 0;
+        code[s].m = dup;
+        for(j = s + 1; j <= i; j++)
+          removed[j] = 1;
+      }
+    }
+
+    stack[sp] = v;
+    start[sp] = s;
+    pure[sp++] = p;
+  }
+
+  saved = compact_code(removed);
+
+  if(DEBUG) printf("DEBUG: local CSE saved %d instructions\n", saved);
+
+  return saved;
+}
+
+/**
+ * The peephole optimizer.
+ *
+ * Runs local_cse() first, then makes passes over code[] until nothing else
+ * changes:
+ *
+ * - JMPs and branches that land on a JMP go straight to where that JMP goes
+ * - a JMP that lands on a RET becomes a RET
+ * - a JMP to the very next instruction goes away (like the one over an empty
+ *   else)
+ * - nothing can reach the code right after a JMP, TCL or RET unless something
+ *   jumps or calls there, so it goes away (like the JMP over the next
+ *   procedure)
+ * - INC followed by INC becomes a single INC
+ * - STO x followed by LOD x becomes DUP, STO x (same for STOR and LODR)
+ * - multiplying by a power of two becomes a SHL, and dividing by a constant
+ *   becomes a DIVC, see strength_reduce()
+ * - a relational OPR followed by JPC becomes a single fused branch, see
+ *   fused_branch()
+ *
+ * Must be called after pl0_link().
+ *
+ * @return the number of instructions saved
+ */
+int peephole() {
+  int targets[MAX_CODE_LENGTH];
+  int removed[MAX_CODE_LENGTH];
+  int saved = 0, changed = 1;
+  int i, j;
+
+  saved += local_cse();
+
+  while(changed) {
+    changed = 0;
+    find_targets(targets);
+    memset(removed, 0, cx * sizeof(int));
+
+    for(i = 0; i < cx; i++) {
+      instruction *ir = &code[i];
+      if(removed[i])
+        continue;
+
+      if(ir->op == JMP || is_branch(ir->op)) {
+        int target = thread_jump(ir->m);
+        if(target != ir->m) {
+          ir->m = target;
+          changed = 1;
+        }
+      }
+
+      if(ir->op == JMP && ir->m >= 0 && ir->m < cx && code[ir->m].op == OPR && code[ir->m].m == OPR_RET) {
+        ir->op = OPR;
+        ir->l = 0;
+        ir->m = OPR_RET;
+        changed = 1;
+      }
+
+      if(ir->op == JMP && ir->m == i + 1) {
+        removed[i] = 1;
+        changed = 1;
+        continue;
+      }
+
+      if(ir->op == JMP || ir->op == TCL || (ir->op == OPR && ir->m == OPR_RET)) {
+        for(j = i + 1; j < cx && !targets[j]; j++) {
+          removed[j] = 1;
+          changed = 1;
+        }
+        continue;
+      }
+
+      if(i + 1 < cx && !targets[i + 1]) {
+        instruction *next = &code[i + 1];
+
+        if(ir->op == INC && next->op == INC) {
+          ir->m += next->m;
+          removed[i + 1] = 1;
+          changed = 1;
+        } else if(((ir->op == STO && next->op == LOD) || (ir->op == STOR && next->op == LODR)) && ir->l == next->l && ir->m == next->m) {
+          *next = *ir;
+          ir->op = OPR;
+          ir->l = 0;
+          ir->m = OPR_DUP;
+          changed = 1;
+        } else if(ir->op == OPR && next->op == JPC && fused_branch(ir->m) >= 0) {
+          ir->op = fused_branch(ir->m);
+          ir->m = next->m;
+          removed[i + 1] = 1;
+          changed = 1;
+        } else if(ir->op == LIT && next->op == OPR && strength_reduce(ir, next->m)) {
+          removed[i + 1] = 1;
+          changed = 1;
+        } else if(ir->op == LIT && (next->op == LIT || next->op == LOD) && i + 2 < cx && !targets[i + 2]
+            && code[i + 2].op == OPR && code[i + 2].m == OPR_MUL && exact_log2(ir->m) > 0) {
+          // 2^k * x is x * 2^k
+          instruction lit = *ir;
+          *ir = *next;
+          *next = lit;
+          strength_reduce(next, OPR_MUL);
+          removed[i + 2] = 1;
+          changed = 1;
+        }
+      }
+    }
+
+    saved += compact_code(removed);
+  }
+
+  if(DEBUG) printf("DEBUG: peephole saved %d instructions\n", saved);
+
+  return saved;
+}
+
+/**
+ * Swaps LOD and STO for the versions that don't walk the static links.
+ *
+ * Locals (l = 0) become LODL/STOL and the main block's variables become
+ * LODG/STOG, since the main block's frame never moves. Everything else
+ * becomes LODD/STOD with l set to the static level of the frame, which the VM
+ * finds in its display. The line table tells which segment (and so which
+ * level) each instruction came from.
+ *
+ * Must be called after peephole(), which only knows about LOD and STO.
+ *
+ * @return the number of instructions specialized
+ */
+int specialize_access() {
+  int n = 0;
+  int i;
+
+  for(i = 0; i < cx; i++) {
+    instruction *ir = &code[i];
+    line_entry *entry;
+    int level;
+
+    if(ir->op != LOD && ir->op != STO)
+      continue;
+    entry = find_line(i);
+    if(!entry || entry->seg < 0 || entry->seg >= num_segments)
+      continue;
+
+    level = segments[entry->seg].level - ir->l;
+    if(level < 0)
+      continue;
+    if(level == 0)
+      ir->op = ir->op == LOD ? LODG : STOG;
+    else if(ir->l == 0)
+      ir->op = ir->op == LOD ? LODL : STOL;
+    else {
+      ir->op = ir->op == LOD ? LODD : STOD;
+      ir->l = level;
+    }
+    n++;
+  }
+
+  if(DEBUG) printf("DEBUG: specialized %d loads and stores\n", n);
+
+  return n;
+}
+
+/**
+ * Finds the branch that jumps exactly when another one doesn't.
+ *
+ * @param op the branch's op code
+ * @return the inverted op code, -1 if there isn't one (JPC and JEVN)
+ */
+int invert_branch(int op) {
+  switch(op) {
+    case JEQ:
+      return JNE;
+    case JNE:
+      return JEQ;
+    case JLT:
+      return JGE;
+    case JGE:
+      return JLT;
+    case JLE:
+      return JGT;
+    case JGT:
+      return JLE;
+  }
+  return -1;
+}
+
+/**
+ * Guesses how often each basic block runs.
+ *
+ * With a profile (-u), a block's weight is the count of its busiest line, or
+ * -1 if the profile doesn't know any of its lines. Without one, it's
+ * LAYOUT_LOOP_WEIGHT for every loop the block is in (a JMP or branch further
+ * down that goes back to or before it), up to LAYOUT_MAX_WEIGHT.
+ *
+ * @param start the first instruction of each block
+ * @param end one past the last instruction of each block
+ * @param nb the number of blocks
+ * @param weight set to the weight of each block
+ */
+void block_weights(int *start, int *end, int nb, long long *weight) {
+  int b, i;
+
+  for(b = 0; b < nb; b++) {
+    weight[b] = profile_size ? -1 : 1;
+    for(i = start[b]; profile_size && i < end[b]; i++) {
+      profile_entry *e = code[i].line > 0 ? find_profile_entry(PROFILE_LINE, code[i].line, NULL) : NULL;
+      if(e && e->count > weight[b])
+        weight[b] = e->count;
+    }
+  }
+
+  if(profile_size)
+    return;
+
+  for(i = 0; i < cx; i++) {
+    if((code[i].op != JMP && !is_branch(code[i].op)) || code[i].m < 0 || code[i].m > i)
+      continue;
+    for(b = 0; b < nb; b++) {
+      if(start[b] >= code[i].m && start[b] <= i && weight[b] < LAYOUT_MAX_WEIGHT)
+        weight[b] *= LAYOUT_LOOP_WEIGHT;
+    }
+  }
+}
+
+/**
+ * Reorders the basic blocks of code[] so that hot code sits together.
+ *
+ * The main block goes first (so the JMP at address 0 can go), followed by the
+ * procedures from hottest to coldest. A procedure's heat comes from the
+ * profile with -u, and otherwise from how deeply nested in loops its calls
+ * are (and how hot the caller is). With a profile, blocks that run less than
+ * 1/LAYOUT_COLD as often as the busiest block of their procedure (like an
+ * else that hardly ever runs) move to the very end of code[].
+ *
+ * A block that used to fall through to one that isn't next anymore gets a
+ * JMP, unless it ends in a fused branch to the block that is next, in which
+ * case the branch gets turned around. A JMP to the next block goes away.
+ * Every jump and call gets retargeted, and the segment addresses and the
+ * line table are rebuilt.
+ *
+ * Must be called after pl0_link() and peephole().
+ *
+ * @return the number of blocks that moved
+ */
+int layout_code() {
+  static instruction old_code[MAX_CODE_LENGTH];
+  static int old_seg[MAX_CODE_LENGTH];
+  static long long weight[MAX_CODE_LENGTH];
+  int targets[MAX_CODE_LENGTH], block_of[MAX_CODE_LENGTH];
+  int start[MAX_CODE_LENGTH], end[MAX_CODE_LENGTH], next[MAX_CODE_LENGTH];
+  int group[MAX_CODE_LENGTH], reached[MAX_CODE_LENGTH], order[MAX_CODE_LENGTH];
+  int new_start[MAX_CODE_LENGTH], tail[MAX_CODE_LENGTH], cold[MAX_CODE_LENGTH];
+  long long heat[MAX_SEGMENTS];
+  int placed[MAX_SEGMENTS];
+  int nb = 0, n = 0, total = 0, moved = 0, prev = -1, old_cx = cx;
+  int b, g, i, k, round;
+
+  if(!cx)
+    return 0;
+
+  // split code[] into basic blocks
+  find_targets(targets);
+  for(i = 0; i < cx; i++) {
+    instruction *last = i ? &code[i - 1] : NULL;
+    if(!i || targets[i] || last->op == JMP || last->op == TCL || is_branch(last->op) || (last->op == OPR && last->m == OPR_RET)) {
+      if(nb)
+        end[nb - 1] = i;
+      start[nb++] = i;
+    }
+    block_of[i] = nb - 1;
+  }
+  end[nb - 1] = cx;
+
+  // where each block goes when it doesn't jump (past any JMP it falls into)
+  for(b = 0; b < nb; b++) {
+    instruction *last = &code[end[b] - 1];
+    next[b] = -1;
+    if(last->op == JMP || last->op == TCL || (last->op == OPR && last->m == OPR_RET))
+      continue;
+    if(end[b] == cx)
+      return 0; // runs off the end of the program
+    next[b] = thread_jump(end[b]);
+    if(next[b] < 0 || next[b] >= cx)
+      return 0;
+  }
+
+  // only the blocks that can run get placed
+  memset(reached, 0, nb * sizeof(int));
+  reached[0] = 1;
+  order[n++] = 0;
+  for(k = 0; k < n; k++) {
+    b = order[k];
+    if(next[b] >= 0 && !reached[block_of[next[b]]]) {
+      reached[block_of[next[b]]] = 1;
+      order[n++] = block_of[next[b]];
+    }
+    for(i = start[b]; i < end[b]; i++) {
+      if((code[i].op == JMP || is_branch(code[i].op) || code[i].op == CAL || code[i].op == TCL)
+          && code[i].m >= 0 && code[i].m < cx && !reached[block_of[code[i].m]]) {
+        reached[block_of[code[i].m]] = 1;
+        order[n++] = block_of[code[i].m];
+      }
+    }
+  }
+
+  // group the blocks by the procedure they came from
+  for(b = 0; b < nb; b++) {
+    line_entry *entry = find_line(start[b]);
+    if(entry && entry->seg >= 0 && entry->seg < num_segments)
+      group[b] = entry->seg;
+    else
+      group[b] = b ? group[b - 1] : 0;
+  }
+
+  block_weights(start, end, nb, weight);
+
+  for(g = 0; g < num_segments; g++)
+    heat[g] = 0;
+  if(profile_size) {
+    for(b = 0; b < nb; b++) {
+      if(reached[b] && weight[b] > heat[group[b]])
+        heat[group[b]] = weight[b];
+    }
+  } else {
+    // a procedure is as hot as its hottest call, which is as hot as the caller
+    heat[group[0]] = 1;
+    for(round = 0; round <= num_segments; round++) {
+      int changed = 0;
+      for(i = 0; i < cx; i++) {
+        long long h;
+        b = block_of[i];
+        if(!reached[b] || (code[i].op != CAL && code[i].op != TCL) || code[i].m < 0 || code[i].m >= cx)
+          continue;
+        h = heat[group[b]] * weight[b];
+        if(h > LAYOUT_MAX_HEAT)
+          h = LAYOUT_MAX_HEAT;
+        g = group[block_of[code[i].m]];
+        if(h > heat[g]) {
+          heat[g] = h;
+          changed = 1;
+        }
+      }
+      if(!changed)
+        break;
+    }
+  }
+
+  for(b = 0; b < nb; b++)
+    cold[b] = b && profile_size && weight[b] >= 0 && weight[b] * LAYOUT_COLD < heat[group[b]];
+
+  // main first, then the procedures from hottest to coldest, then cold blocks
+  n = 0;
+  memset(placed, 0, num_segments * sizeof(int));
+  for(g = group[0]; g >= 0; ) {
+    int best = -1;
+    placed[g] = 1;
+    for(b = 0; b < nb; b++) {
+      if(reached[b] && group[b] == g && !cold[b])
+        order[n++] = b;
+    }
+    // ties keep the original order
+    for(b = 0; b < nb; b++) {
+      if(reached[b] && !placed[group[b]] && (best < 0 || heat[group[b]] > heat[best]))
+        best = group[b];
+    }
+    g = best;
+  }
+  for(b = 0; b < nb; b++) {
+    if(reached[b] && cold[b])
+      order[n++] = b;
+  }
+
+  // what happens at the end of each block: 0 = as is, 1 = drop the JMP,
+  // 2 = turn the branch around, 3 = add a JMP
+  for(k = 0; k < n; k++) {
+    int following = k + 1 < n ? start[order[k + 1]] : -1;
+    instruction *last;
+    b = order[k];
+    last = &code[end[b] - 1];
+    tail[b] = 0;
+    if(last->op == JMP && last->m == following)
+      tail[b] = 1;
+    else if(next[b] >= 0 && next[b] != following) {
+      if(is_branch(last->op) && last->m == following && invert_branch(last->op) >= 0)
+        tail[b] = 2;
+      else
+        tail[b] = 3;
+    }
+    new_start[b] = total;
+    total += end[b] - start[b] + (tail[b] == 3) - (tail[b] == 1);
+    if(prev >= 0 && prev + 1 < nb && order[k] != prev + 1)
+      moved++;
+    prev = b;
+  }
+  if(total > MAX_CODE_LENGTH)
+    return 0;
+
+  for(i = 0; i < cx; i++) {
+    line_entry *entry = find_line(i);
+    old_code[i] = code[i];
+    old_seg[i] = entry ? entry->seg : -1;
+  }
+
+  for(i = 0; i < num_segments; i++) {
+    int a = segments[i].addr;
+    if(segments[i].cx && a >= 0 && a < cx)
+      segments[i].addr = reached[block_of[a]] ? new_start[block_of[a]] + a - start[block_of[a]] : -1;
+  }
+
+  // copy the blocks over in their new order
+  num_line_entries = 0;
+  for(k = 0, cx = 0; k < n; k++) {
+    b = order[k];
+    for(i = start[b]; i < end[b]; i++) {
+      instruction ir = old_code[i];
+      if(i == end[b] - 1 && tail[b] == 1)
+        break;
+      if(i == end[b] - 1 && tail[b] == 2) {
+        ir.op = invert_branch(ir.op);
+        ir.m = next[b];
+      }
+      if((ir.op == JMP || is_branch(ir.op) || ir.op == CAL || ir.op == TCL) && ir.m >= 0 && ir.m < old_cx)
+        ir.m = new_start[block_of[ir.m]] + ir.m - start[block_of[ir.m]];
+      if(old_seg[i] >= 0)
+        add_line_entry(cx, ir.line, old_seg[i]);
+      code[cx++] = ir;
+    }
+    if(tail[b] == 3) {
+      i = end[b] - 1;
+      code[cx].op = JMP;
+      code[cx].l = 0;
+      code[cx].m = new_start[block_of[next[b]]] + next[b] - start[block_of[next[b]]];
+      code[cx].line = old_code[i].line;
+      if(old_seg[i] >= 0)
+        add_line_entry(cx, old_code[i].line, old_seg[i]);
+      cx++;
+    }
+  }
+
+  if(DEBUG) printf("DEBUG: layout moved %d of %d blocks\n", moved, n);
+
+  return moved;
+}
+
+/**
+ * Finds the segment whose frame a LOD or STO refers to.
+ *
+ * @param s the segment the instruction is in
+ * @param l the instruction's l value
+ * @return the segment number, -1 if l goes past the main block
+ */
+int var_owner(int s, int l) {
+  while(l-- > 0 && s >= 0)
+    s = segments[s].parent;
+  return s;
+}
+
+/**
+ * Throws out every procedure that can't be called.
+ *
+ * The call graph starts at the main block (and with -c, at every procedure
+ * declared in it, since other units can call those). Anything it doesn't
+ * reach (and isn't the parent of something it does) gets emptied, and
+ * pl0_link() leaves empty segments out completely, JMP and all.
+ *
+ * Must be called before pl0_link().
+ *
+ * @return the number of procedures removed
+ */
+int remove_dead_procedures() {
+  int reachable[MAX_SEGMENTS] = {0};
+  int work[MAX_SEGMENTS];
+  int n = 0, removed = 0;
+  int s, i;
+
+  reachable[0] = 1;
+  work[n++] = 0;
+  for(s = 1; s < num_segments && allow_externals; s++) {
+    if(segments[s].parent == 0) {
+      reachable[s] = 1;
+      work[n++] = s;
+    }
+  }
+
+  while(n) {
+    s = work[--n];
+    for(i = 0; i < segments[s].cx; i++) {
+      instruction *ir = &segments[s].code[i];
+      if((ir->op == CAL || ir->op == TCL) && ir->m >= 0 && ir->m < num_segments && !reachable[ir->m]) {
+        reachable[ir->m] = 1;
+        work[n++] = ir->m;
+      }
+    }
+  }
+
+  // a procedure only gets placed inside of its parent
+  for(s = num_segments - 1; s > 0; s--) {
+    if(reachable[s] && segments[s].parent > 0)
+      reachable[segments[s].parent] = 1;
+  }
+
+  for(s = 1; s < num_segments; s++) {
+    if(!reachable[s] && !segments[s].external && segments[s].cx) {
+      segments[s].cx = 0;
+      removed++;
+    }
+  }
+
+  if(DEBUG) printf("DEBUG: removed %d unreachable procedures\n", removed);
+
+  return removed;
+}
+
+/**
+ * Finds where the code for the value stored by a STO starts.
+ *
+ * Only works for values that can be thrown away, so no reading and no
+ * division (which could fail), and nothing can jump into the middle.
+ *
+ * @param seg the segment
+ * @param i the index of the STO
+ * @param targets 1 for every jump target in the segment
+ * @return the index of the first instruction of the value, -1 if it can't be
+ *         thrown away
+ */
+int value_start(segment *seg, int i, int *targets) {
+  int need = 1;
+  int j;
+
+  for(j = i - 1; j >= seg->body; j--) {
+    instruction *ir = &seg->code[j];
+
+    if(targets[j + 1])
+      return -1;
+
+    if(ir->op == LIT || ir->op == LOD)
+      need--;
+    else if(ir->op == OPR && (ir->m == OPR_NEG || ir->m == OPR_ODD))
+      ;
+    else if(ir->op == OPR && ir->m >= OPR_ADD && ir->m <= OPR_GEQ && ir->m != OPR_DIV && ir->m != OPR_MOD)
+      need++;
+    else
+      return -1;
+
+    if(!need)
+      return j;
+  }
+
+  return -1;
+}
+
+/**
+ * Squeezes the removed instructions out of a segment.
+ *
+ * Same idea as compact_code(), but before linking, so the JMPs and JPCs are
+ * segment-relative and child segments are placed by offset.
+ *
+ * @param s the segment number
+ * @param removed 1 for every instruction to remove (must hold cx ints)
+ * @return the number of instructions removed
+ */
+int compact_segment(int s, int *removed) {
+  segment *seg = &segments[s];
+  int *new_addr = (int *)malloc((seg->cx + 1) * sizeof(int));
+  int i, j, n = 0;
+
+  if(!new_addr)
+    return 0;
+
+  for(i = 0; i < seg->cx; i++) {
+    new_addr[i] = n;
+    if(!removed[i])
+      n++;
+  }
+  new_addr[seg->cx] = n;
+
+  for(i = 0, j = 0; i < seg->cx; i++) {
+    if(removed[i])
+      continue;
+    seg->code[j] = seg->code[i];
+    if((seg->code[j].op == JMP || seg->code[j].op == JPC) && seg->code[j].m >= 0 && seg->code[j].m <= seg->cx)
+      seg->code[j].m = new_addr[seg->code[j].m];
+    j++;
+  }
+
+  for(i = s + 1; i < num_segments; i++) {
+    if(segments[i].parent == s)
+      segments[i].offset = new_addr[segments[i].offset];
+  }
+  seg->body = new_addr[seg->body];
+
+  i = seg->cx - n;
+  seg->cx = n;
+  free(new_addr);
+  return i;
+}
+
+/**
+ * Throws out variables that are never read.
+ *
+ * Every store to such a variable goes away (along with the code for its
+ * value, when that can't fail or read input). Then release_slots() takes back
+ * the slots of the variables that aren't touched at all anymore.
+ *
+ * Must be called before pl0_link().
+ *
+ * @return the number of variables removed
+ */
+int remove_dead_variables() {
+  static int read[MAX_SEGMENTS][MAX_FRAME_SIZE];
+  int s, i, m, owner, removed;
+
+  memset(read, 0, sizeof(read));
+  for(s = 0; s < num_segments; s++) {
+    for(i = 0; i < segments[s].cx; i++) {
+      instruction *ir = &segments[s].code[i];
+      owner = var_owner(s, ir->l);
+      if(ir->op == LOD && owner >= 0 && ir->m >= 0 && ir->m < MAX_FRAME_SIZE)
+        read[owner][ir->m] = 1;
+    }
+  }
+
+  // stores nobody reads
+  for(s = 0; s < num_segments; s++) {
+    segment *seg = &segments[s];
+    int *targets, *dead;
+    int any = 0;
+
+    if(!seg->cx)
+      continue;
+    targets = (int *)calloc(seg->cx + 1, sizeof(int));
+    dead = (int *)calloc(seg->cx, sizeof(int));
+    if(!targets || !dead) {
+      free(targets);
+      free(dead);
+      continue;
+    }
+
+    for(i = 0; i < seg->cx; i++) {
+      if((seg->code[i].op == JMP || seg->code[i].op == JPC) && seg->code[i].m >= 0 && seg->code[i].m <= seg->cx)
+        targets[seg->code[i].m] = 1;
+    }
+
+    for(i = seg->body; i < seg->cx; i++) {
+      instruction *ir = &seg->code[i];
+      int start;
+
+      owner = var_owner(s, ir->l);
+      if(ir->op != STO || owner < 0 || ir->m < 3 || ir->m >= MAX_FRAME_SIZE || read[owner][ir->m])
+        continue;
+      if(owner == 0 && allow_externals)
+        continue;
+      start = value_start(seg, i, targets);
+      if(start < 0)
+        continue;
+      for(m = start; m <= i; m++)
+        dead[m] = 1;
+      any = 1;
+    }
+
+    if(any)
+      compact_segment(s, dead);
+    free(targets);
+    free(dead);
+  }
+
+  removed = release_slots();
+
+  if(DEBUG) printf("DEBUG: removed %d unused variables\n", removed);
+
+  return removed;
+}
+
+/**
+ * Gives back the frame slots that no LOD or STO uses.
+ *
+ * The variables after a free slot move down and the INC for the frame gets
+ * smaller. With -c, the globals stay put, since other units know them by
+ * address.
+ *
+ * @return the number of slots given back
+ */
+int release_slots() {
+  static int used[MAX_SEGMENTS][MAX_FRAME_SIZE];
+  int new_addr[MAX_FRAME_SIZE];
+  int s, i, m, owner, removed = 0;
+
+  memset(used, 0, sizeof(used));
+  for(s = 0; s < num_segments; s++) {
+    for(i = 0; i < segments[s].cx; i++) {
+      instruction *ir = &segments[s].code[i];
+      owner = var_owner(s, ir->l);
+      if((ir->op == LOD || ir->op == STO) && owner >= 0 && ir->m >= 0 && ir->m < MAX_FRAME_SIZE)
+        used[owner][ir->m] = 1;
+    }
+  }
+
+  for(owner = 0; owner < num_segments; owner++) {
+    segment *seg = &segments[owner];
+    int frame_size = 0, dropped = 0;
+
+    if(!seg->cx || (owner == 0 && allow_externals))
+      continue;
+
+    for(i = 0; i < seg->body; i++) {
+      if(seg->code[i].op == INC)
+        frame_size += seg->code[i].m;
+    }
+    if(frame_size > MAX_FRAME_SIZE)
+      continue;
+
+    for(m = 0; m < frame_size; m++) {
+      new_addr[m] = m - dropped;
+      if(m >= 3 && !used[owner][m])
+        dropped++;
+    }
+    if(!dropped)
+      continue;
+
+    for(s = 0; s < num_segments; s++) {
+      for(i = 0; i < segments[s].cx; i++) {
+        instruction *ir = &segments[s].code[i];
+        if((ir->op == LOD || ir->op == STO) && var_owner(s, ir->l) == owner && ir->m >= 0 && ir->m < frame_size)
+          ir->m = new_addr[ir->m];
+      }
+    }
+
+    // the variables all come from the last INC before the statement part
+    for(i = seg->body - 1; i >= 0; i--) {
+      if(seg->code[i].op == INC) {
+        seg->code[i].m -= dropped;
+        break;
+      }
+    }
+    removed += dropped;
+  }
+
+  return removed;
+}
+
+/**
+ * Finds out which of a segment's own variables are live before each
+ * instruction.
+ *
+ * Only LOD and STO with l = 0 count, so this is only right for variables
+ * that no nested procedure uses.
+ *
+ * @param s the segment number
+ * @param size the size of the segment's frame
+ * @return (cx + 1) rows of size flags (the last row is all 0), NULL if out of
+ *         memory; the caller frees it
+ */
+char *find_live_vars(int s, int size) {
+  segment *seg = &segments[s];
+  char *live = (char *)calloc((seg->cx + 1) * size, 1);
+  int changed = 1;
+  int i, m;
+
+  if(!live)
+    return NULL;
+
+  while(changed) {
+    changed = 0;
+    for(i = seg->cx - 1; i >= seg->body; i--) {
+      instruction *ir = &seg->code[i];
+      char *in = &live[i * size];
+
+      for(m = 0; m < size; m++) {
+        int value = live_after(seg, i, live, size, m);
+        if(ir->op == STO && ir->l == 0 && ir->m == m)
+          value = 0;
+        else if(ir->op == LOD && ir->l == 0 && ir->m == m)
+          value = 1;
+        if(value != in[m]) {
+          in[m] = value;
+          changed = 1;
+        }
+      }
+    }
+  }
+
+  return live;
+}
+
+/**
+ * Tells whether a variable is live right after an instruction.
+ *
+ * @param seg the segment
+ * @param i the instruction
+ * @param live the liveness rows from find_live_vars()
+ * @param size the size of the segment's frame
+ * @param m the variable
+ * @return 1 if some path from here reads m before storing to it
+ */
+int live_after(segment *seg, int i, char *live, int size, int m) {
+  instruction *ir = &seg->code[i];
+  int target = ir->m >= 0 && ir->m < seg->cx ? ir->m : seg->cx;
+
+  if(ir->op == JMP)
+    return live[target * size + m];
+  if(ir->op == TCL || (ir->op == OPR && ir->m == OPR_RET))
+    return 0;
+  if(ir->op == JPC && live[target * size + m])
+    return 1;
+  return live[(i + 1) * size + m];
+}
+
+/**
+ * Lets variables that are never live at the same time share a frame slot.
+ *
+ * Two variables interfere when one of them gets stored to while the other is
+ * live. Each variable moves into the slot of the first one before it that
+ * doesn't interfere with anything in that slot. Variables a nested procedure
+ * uses (see find_escaping_vars()) and variables that could be read before
+ * they're stored to keep their own slot.
+ *
+ * @param s the segment number
+ * @return the number of variables that moved into another one's slot
+ */
+int color_slots(int s) {
+  static char interfere[MAX_FRAME_SIZE][MAX_FRAME_SIZE];
+  segment *seg = &segments[s];
+  int size = frame_size(s);
+  int candidate[MAX_FRAME_SIZE];
+  int slot[MAX_FRAME_SIZE];
+  char *live;
+  int moved = 0;
+  int i, m, x, r;
+
+  if(!seg->cx || size > MAX_FRAME_SIZE)
+    return 0;
+  live = find_live_vars(s, size);
+  if(!live)
+    return 0;
+
+  for(m = 0; m < size; m++) {
+    slot[m] = m;
+    candidate[m] = m >= 3 && !var_escapes[s][m] && !live[seg->body * size + m];
+  }
+
+  memset(interfere, 0, sizeof(interfere));
+  for(i = seg->body; i < seg->cx; i++) {
+    instruction *ir = &seg->code[i];
+    if(ir->op != STO || ir->l != 0 || ir->m < 0 || ir->m >= size)
+      continue;
+    for(x = 0; x < size; x++) {
+      if(x != ir->m && live_after(seg, i, live, size, x)) {
+        interfere[ir->m][x] = 1;
+        interfere[x][ir->m] = 1;
+      }
+    }
+  }
+  free(live);
+
+  for(m = 3; m < size; m++) {
+    if(!candidate[m])
+      continue;
+    for(r = 3; r < m && slot[m] == m; r++) {
+      if(!candidate[r] || slot[r] != r)
+        continue;
+      for(x = r; x < m && (slot[x] != r || !interfere[m][x]); x++);
+      if(x == m) {
+        slot[m] = r;
+        moved++;
+      }
+    }
+  }
+
+  if(moved) {
+    for(i = 0; i < seg->cx; i++) {
+      instruction *ir = &seg->code[i];
+      if((ir->op == LOD || ir->op == STO) && ir->l == 0 && ir->m >= 0 && ir->m < size)
+        ir->m = slot[ir->m];
+    }
+  }
+
+  return moved;
+}
+
+/**
+ * Moves variables that only their own procedure uses into the VM's register
+ * file.
+ *
+ * Each frame gets NUM_REGISTERS registers, which LODR and STOR reach without
+ * any address arithmetic. The most used variables that no nested procedure
+ * uses (see find_escaping_vars()) and that can't be read before they're set
+ * get them, and release_slots() gives their frame slots back.
+ *
+ * Must be called before pl0_link().
+ *
+ * @return the number of variables moved into registers
+ */
+int promote_registers() {
+  int count[MAX_FRAME_SIZE];
+  int reg[MAX_FRAME_SIZE];
+  int s, i, k, m, promoted = 0;
+
+  find_escaping_vars();
+
+  for(s = 0; s < num_segments; s++) {
+    segment *seg = &segments[s];
+    int size = frame_size(s);
+    char *live;
+
+    if(!seg->cx || size > MAX_FRAME_SIZE)
+      continue;
+    live = find_live_vars(s, size);
+    if(!live)
+      continue;
+
+    memset(count, 0, sizeof(count));
+    for(i = seg->body; i < seg->cx; i++) {
+      instruction *ir = &seg->code[i];
+      if((ir->op == LOD || ir->op == STO) && ir->l == 0 && ir->m >= 0 && ir->m < size)
+        count[ir->m]++;
+    }
+
+    for(m = 0; m < size; m++)
+      reg[m] = -1;
+    for(k = 0; k < NUM_REGISTERS; k++) {
+      int best = -1;
+      for(m = 3; m < size; m++) {
+        if(count[m] && reg[m] < 0 && !var_escapes[s][m] && !live[seg->body * size + m] && (best < 0 || count[m] > count[best]))
+          best = m;
+      }
+      if(best < 0)
+        break;
+      reg[best] = k;
+    }
+    free(live);
+    promoted += k;
+
+    for(i = seg->body; i < seg->cx && k; i++) {
+      instruction *ir = &seg->code[i];
+      if((ir->op == LOD || ir->op == STO) && ir->l == 0 && ir->m >= 0 && ir->m < size && reg[ir->m] >= 0) {
+        ir->op = ir->op == LOD ? LODR : STOR;
+        ir->m = reg[ir->m];
+      }
+    }
+  }
+
+  if(promoted)
+    release_slots();
+
+  if(DEBUG) printf("DEBUG: moved %d variables into registers\n", promoted);
+
+  return promoted;
+}
+
+/**
+ * Runs color_slots() on every segment, then gives the freed slots back.
+ *
+ * Must be called before pl0_link().
+ *
+ * @return the number of slots given back
+ */
+int share_slots() {
+  int s, moved = 0;
+
+  find_escaping_vars();
+  for(s = 0; s < num_segments; s++)
+    moved += color_slots(s);
+
+  if(DEBUG) printf("DEBUG: %d variables share a slot\n", moved);
+
+  return moved ? release_slots() : 0;
+}
+
+/**
+ * Adds up the INCs that build a segment's frame.
+ *
+ * @param s the segment number
+ * @return the size of the frame (sl, dl and ra included)
+ */
+int frame_size(int s) {
+  int i, size = 0;
+  for(i = 0; i < segments[s].body; i++) {
+    if(segments[s].code[i].op == INC)
+      size += segments[s].code[i].m;
+  }
+  return size;
+}
+
+/**
+ * Checks whether a procedure could end up calling itself.
+ *
+ * @param p the procedure's segment number
+ * @return 1 if it could, 0 otherwise
+ */
+int is_recursive(int p) {
+  int seen[MAX_SEGMENTS] = {0};
+  int work[MAX_SEGMENTS + 1];
+  int n = 0, s, i;
+
+  work[n++] = p;
+  while(n) {
+    s = work[--n];
+    for(i = 0; i < segments[s].cx; i++) {
+      instruction *ir = &segments[s].code[i];
+      if(ir->op != CAL || ir->m < 0 || ir->m >= num_segments)
+        continue;
+      if(ir->m == p)
+        return 1;
+      if(!seen[ir->m]) {
+        seen[ir->m] = 1;
+        work[n++] = ir->m;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Counts the calls to a procedure.
+ *
+ * @param p the procedure's segment number
+ * @return the number of CALs to it
+ */
+int count_calls(int p) {
+  int s, i, n = 0;
+  for(s = 0; s < num_segments; s++) {
+    for(i = 0; i < segments[s].cx; i++) {
+      if(segments[s].code[i].op == CAL && segments[s].code[i].m == p)
+        n++;
+    }
+  }
+  return n;
+}
+
+/**
+ * Checks whether an instruction is inside of a loop.
+ *
+ * @param seg the segment
+ * @param i the instruction index
+ * @return 1 if some later JMP goes back to (or before) it, 0 otherwise
+ */
+int in_loop(segment *seg, int i) {
+  int j;
+  for(j = i + 1; j < seg->cx; j++) {
+    if(seg->code[j].op == JMP && seg->code[j].m <= i)
+      return 1;
+  }
+  return 0;
+}
+
+/**
+ * Checks whether a procedure can be inlined.
+ *
+ * It can't be recursive, and it can't call its own nested procedures (those
+ * need its frame). Its code has to be exactly what block() generates: INCs,
+ * the statement part, and a RET at the very end.
+ *
+ * @param p the procedure's segment number
+ * @return the number of instructions that would get inlined, -1 if it can't
+ *         be inlined
+ */
+int inline_size(int p) {
+  segment *seg = &segments[p];
+  int i;
+
+  if(p <= 0 || seg->external || seg->body >= seg->cx)
+    return -1;
+  if(seg->code[seg->cx - 1].op != OPR || seg->code[seg->cx - 1].m != OPR_RET)
+    return -1;
+
+  for(i = 0; i < seg->body; i++) {
+    if(seg->code[i].op != INC)
+      return -1;
+  }
+  for(i = seg->body; i < seg->cx - 1; i++) {
+    instruction *ir = &seg->code[i];
+    if((ir->op == OPR && ir->m == OPR_RET) || (ir->op == CAL && ir->l == 0))
+      return -1;
+  }
+
+  if(is_recursive(p))
+    return -1;
+
+  return seg->cx - 1 - seg->body;
+}
+
+/**
+ * Replaces a CAL with the statement part of the procedure it calls.
+ *
+ * The procedure's variables get new slots at the end of the caller's frame.
+ * Anything it reaches through static links is reached from the caller
+ * instead, which is l - 1 levels further than the CAL's static link went.
+ *
+ * @param s the caller's segment number
+ * @param i the index of the CAL
+ * @return 0 on success, 25 on failure
+ */
+int inline_call(int s, int i) {
+  segment *seg = &segments[s];
+  int link = seg->code[i].l;
+  segment *callee = &segments[seg->code[i].m];
+  int len = callee->cx - 1 - callee->body;
+  int base = frame_size(s);
+  int num_vars = frame_size(seg->code[i].m) - 3;
+  int new_cx = seg->cx - 1 + len;
+  int j;
+
+  if(new_cx > seg->size) {
+    instruction *tmp = (instruction *)realloc(seg->code, new_cx * sizeof(instruction));
+    if(!tmp)
+      return 25;
+    seg->code = tmp;
+    seg->size = new_cx;
+  }
+
+  memmove(&seg->code[i + len], &seg->code[i + 1], (seg->cx - i - 1) * sizeof(instruction));
+  for(j = 0; j < new_cx; j++) {
+    if(j == i)
+      j += len;
+    if(j < new_cx && (seg->code[j].op == JMP || seg->code[j].op == JPC) && seg->code[j].m > i)
+      seg->code[j].m += len - 1;
+  }
+
+  for(j = 0; j < len; j++) {
+    instruction ir = callee->code[callee->body + j];
+    if(ir.op == LOD || ir.op == STO) {
+      if(ir.l == 0)
+        ir.m = base + ir.m - 3;
+      else
+        ir.l += link - 1;
+    } else if(ir.op == CAL) {
+      ir.l += link - 1;
+    } else if(ir.op == JMP || ir.op == JPC) {
+      ir.m = i + ir.m - callee->body;
+    }
+    seg->code[i + j] = ir;
+  }
+
+  for(j = s + 1; j < num_segments; j++) {
+    if(segments[j].parent == s && segments[j].offset > i)
+      segments[j].offset += len - 1;
+  }
+  seg->cx = new_cx;
+
+  // the variables all go on the last INC before the statement part
+  for(j = seg->body - 1; j >= 0 && num_vars; j--) {
+    if(seg->code[j].op == INC) {
+      seg->code[j].m += num_vars;
+      break;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * The inliner.
+ *
+ * Every call to a procedure that can be inlined gets replaced with the
+ * procedure's code when the procedure is tiny (INLINE_SIZE), when this is
+ * the only call to it, or when the call is inside of a loop and the
+ * procedure is still small (INLINE_LOOP_SIZE). With a profile (-u), a hot
+ * call gets inlined up to INLINE_HOT_SIZE wherever it is, and a call that
+ * never ran only gets inlined when the procedure is tiny or has no other
+ * callers. Procedures left without any callers get thrown out by
+ * remove_dead_procedures() afterwards.
+ *
+ * With -c, nothing gets inlined into the main block, since the callee's
+ * variables would become globals without names that the linker can't keep
+ * apart.
+ *
+ * Must be called before pl0_link().
+ *
+ * @return the number of calls inlined
+ */
+int inline_procedures() {
+  int total = 0, inlined = 0;
+  int s, i;
+
+  for(s = 0; s < num_segments; s++)
+    total += segments[s].cx + 1;
+
+  for(s = allow_externals ? 1 : 0; s < num_segments; s++) {
+    // the inlined code can have calls of its own, so i stays put after one
+    for(i = segments[s].body; i < segments[s].cx; i++) {
+      instruction *ir = &segments[s].code[i];
+      int p = ir->m, size, heat;
+
+      if(ir->op != CAL || p <= 0 || p >= num_segments || p == s)
+        continue;
+      size = inline_size(p);
+      if(size < 0)
+        continue;
+      heat = profile_call_heat(s, i);
+      if(size > INLINE_SIZE && count_calls(p) > 1
+          && (heat < 0 || size > (heat > 0 ? INLINE_HOT_SIZE : INLINE_LOOP_SIZE) || (!heat && !in_loop(&segments[s], i))))
+        continue;
+      if(total + size - 1 > MAX_CODE_LENGTH || frame_size(s) + frame_size(p) - 3 > MAX_FRAME_SIZE)
+        continue;
+
+      if(inline_call(s, i))
+        break;
+      total += size - 1;
+      inlined++;
+      i--;
+    }
+  }
+
+  if(DEBUG) printf("DEBUG: inlined %d calls\n", inlined);
+
+  return inlined;
+}
+
+/**
+ * Follows the JMPs starting at an instruction in a segment.
+ *
+ * @param seg the segment
+ * @param i the instruction index
+ * @return the index of the first instruction that isn't a JMP
+ */
+int skip_jumps(segment *seg, int i) {
+  int hops = 0;
+  while(i >= 0 && i < seg->cx && seg->code[i].op == JMP && hops++ < seg->cx)
+    i = seg->code[i].m;
+  return i;
+}
+
+/**
+ * Checks whether a segment instruction is a RET.
+ *
+ * @param seg the segment
+ * @param i the instruction index
+ * @return 1 if it is, 0 otherwise
+ */
+int is_return(segment *seg, int i) {
+  return i >= 0 && i < seg->cx && seg->code[i].op == OPR && seg->code[i].m == OPR_RET;
+}
+
+/**
+ * Checks whether some code computes a single value out of constants and the
+ * procedure's own variables, without anything that could fail.
+ *
+ * @param seg the segment
+ * @param start the first instruction
+ * @param end one past the last instruction
+ * @return 1 if it does, 0 otherwise
+ */
+int is_local_value(segment *seg, int start, int end) {
+  int depth = 0;
+  int i;
+
+  for(i = start; i < end; i++) {
+    instruction *ir = &seg->code[i];
+    if(ir->op == LIT || (ir->op == LOD && ir->l == 0))
+      depth++;
+    else if(ir->op == OPR && (ir->m == OPR_NEG || ir->m == OPR_ODD) && depth >= 1)
+      ;
+    else if(ir->op == OPR && ir->m >= OPR_ADD && ir->m <= OPR_GEQ && ir->m != OPR_DIV && ir->m != OPR_MOD && depth >= 2)
+      depth--;
+    else
+      return 0;
+  }
+
+  return depth == 1;
+}
+
+/**
+ * Matches the accumulator update that a call is followed by.
+ *
+ * That's g := g + e or g := g * e (either way around), and then a return,
+ * where g lives outside of the procedure's frame and e only uses the
+ * procedure's own variables.
+ *
+ * @param seg the segment
+ * @param j the first instruction after the call (JMPs already skipped)
+ * @param targets 1 for every jump target in the segment
+ * @param update set to the STO of the update
+ * @param e_start set to the first instruction of e
+ * @param e_end set to one past the last instruction of e
+ * @return 1 if it matches, 0 otherwise
+ */
+int match_accumulator(segment *seg, int j, int *targets, int *update, int *e_start, int *e_end) {
+  instruction *op, *sto;
+  int k;
+
+  for(k = j; k < seg->cx && seg->code[k].op != STO; k++) {
+    if(k > j && targets[k])
+      return 0;
+  }
+  if(k >= seg->cx || k - j < 3 || targets[k] || !is_return(seg, skip_jumps(seg, k + 1)))
+    return 0;
+
+  sto = &seg->code[k];
+  op = &seg->code[k - 1];
+  if(sto->l < 1 || op->op != OPR || (op->m != OPR_ADD && op->m != OPR_MUL))
+    return 0;
+
+  if(seg->code[j].op == LOD && seg->code[j].l == sto->l && seg->code[j].m == sto->m) {
+    *e_start = j + 1;
+    *e_end = k - 1;
+  } else if(seg->code[k - 2].op == LOD && seg->code[k - 2].l == sto->l && seg->code[k - 2].m == sto->m) {
+    *e_start = j;
+    *e_end = k - 2;
+  } else {
+    return 0;
+  }
+
+  *update = k;
+  return is_local_value(seg, *e_start, *e_end);
+}
+
+/**
+ * Turns the calls in tail position in a procedure into jumps.
+ *
+ * A call that's only followed by a return doesn't need the caller's frame
+ * anymore. If the procedure calls itself, that's just a JMP back to the
+ * start of its statement part, since the frame is already the right shape.
+ * Any other procedure gets a TCL, which hands the frame over to it. (Unless
+ * the callee is nested in the caller, since it needs the caller's frame for
+ * its static link.)
+ *
+ * A call to itself that's followed by an accumulator update (see
+ * match_accumulator()) works too. The update gets deferred into a new
+ * variable in the frame, and applied to g once, right before returning.
+ *
+ * @param s the segment number
+ * @return the number of calls turned into jumps
+ */
+int tail_calls(int s) {
+  segment *seg = &segments[s];
+  int *targets, *new_index;
+  instruction *out;
+  int acc_l = -1, acc_m = 0, acc_op = 0, acc = 0;
+  int size, n = 0, count = 0, calls = 0, loop;
+  int i, j, update, e_start, e_end;
+
+  if(s <= 0 || seg->external || seg->body >= seg->cx)
+    return 0;
+  for(i = 0; i < seg->body; i++) {
+    if(seg->code[i].op != INC)
+      return 0;
+  }
+
+  targets = (int *)calloc(seg->cx + 1, sizeof(int));
+  new_index = (int *)malloc((seg->cx + 1) * sizeof(int));
+  if(!targets || !new_index) {
+    free(targets);
+    free(new_index);
+    return 0;
+  }
+  for(i = 0; i < seg->cx; i++) {
+    if((seg->code[i].op == JMP || seg->code[i].op == JPC) && seg->code[i].m >= 0 && seg->code[i].m <= seg->cx)
+      targets[seg->code[i].m] = 1;
+    if(seg->code[i].op == CAL)
+      calls++;
+  }
+
+  // the accumulator (there can only be one per procedure)
+  for(i = seg->body; i < seg->cx && frame_size(s) < MAX_FRAME_SIZE; i++) {
+    instruction *ir = &seg->code[i];
+    if(ir->op != CAL || ir->m != s || ir->l != 1)
+      continue;
+    j = skip_jumps(seg, i + 1);
+    if(!is_return(seg, j) && match_accumulator(seg, j, targets, &update, &e_start, &e_end)) {
+      acc = 1;
+      acc_l = seg->code[update].l;
+      acc_m = seg->code[update].m;
+      acc_op = seg->code[update - 1].m;
+      break;
+    }
+  }
+
+  // worst case: the setup, an update before every RET, and a copy of e for
+  // every call
+  size = 2 + seg->cx * 5 + calls * (seg->cx + 4);
+  out = (instruction *)malloc(size * sizeof(instruction));
+  if(!out) {
+    free(targets);
+    free(new_index);
+    return 0;
+  }
+
+  for(i = 0; i < seg->body; i++)
+    out[n++] = seg->code[i];
+  if(acc) {
+    out[n - 1].m++;
+    out[n].op = LIT;
+    out[n].l = 0;
+    out[n].m = (acc_op == OPR_ADD) ? 0 : 1;
+    out[n++].line = seg->code[seg->body].line;
+    out[n].op = STO;
+    out[n].l = 0;
+    out[n].m = frame_size(s);
+    out[n++].line = seg->code[seg->body].line;
+  }
+  loop = n;
+
+  for(i = seg->body; i < seg->cx; i++) {
+    instruction *ir = &seg->code[i];
+    int line = ir->line;
+
+    new_index[i] = n;
+
+    if(ir->op == CAL && ir->l >= 1 && ir->m >= 0 && ir->m < num_segments && !segments[ir->m].external) {
+      j = skip_jumps(seg, i + 1);
+      if(is_return(seg, j) && ir->m == s && ir->l == 1) {
+        out[n].op = JMP;
+        out[n].l = 0;
+        out[n].m = -1 - loop; // already a new index, see below
+        out[n++].line = line;
+        count++;
+        continue;
+      } else if(is_return(seg, j) && !acc) {
+        out[n] = *ir;
+        out[n++].op = TCL;
+        count++;
+        continue;
+      } else if(acc && ir->m == s && ir->l == 1 && match_accumulator(seg, j, targets, &update, &e_start, &e_end)
+          && seg->code[update].l == acc_l && seg->code[update].m == acc_m && seg->code[update - 1].m == acc_op) {
+        // acc := acc op e, then go around again
+        out[n].op = LOD;
+        out[n].l = 0;
+        out[n].m = frame_size(s);
+        out[n++].line = line;
+        for(j = e_start; j < e_end; j++)
+          out[n++] = seg->code[j];
+        out[n].op = OPR;
+        out[n].l = 0;
+        out[n].m = acc_op;
+        out[n++].line = line;
+        out[n].op = STO;
+        out[n].l = 0;
+        out[n].m = frame_size(s);
+        out[n++].line = line;
+        out[n].op = JMP;
+        out[n].l = 0;
+        out[n].m = -1 - loop;
+        out[n++].line = line;
+        count++;
+        continue;
+      }
+    }
+
+    if(acc && ir->op == OPR && ir->m == OPR_RET) {
+      // g := g op acc
+      out[n].op = LOD;
+      out[n].l = acc_l;
+      out[n].m = acc_m;
+      out[n++].line = line;
+      out[n].op = LOD;
+      out[n].l = 0;
+      out[n].m = frame_size(s);
+      out[n++].line = line;
+      out[n].op = OPR;
+      out[n].l = 0;
+      out[n].m = acc_op;
+      out[n++].line = line;
+      out[n].op = STO;
+      out[n].l = acc_l;
+      out[n].m = acc_m;
+      out[n++].line = line;
+    }
+
+    out[n++] = *ir;
+  }
+  new_index[seg->cx] = n;
+
+  if(count) {
+    for(i = seg->body; i < n; i++) {
+      if(out[i].op != JMP && out[i].op != JPC)
+        continue;
+      if(out[i].m < 0)
+        out[i].m = -1 - out[i].m;
+      else if(out[i].m <= seg->cx)
+        out[i].m = (out[i].m == seg->body) ? loop : new_index[out[i].m];
+    }
+    free(seg->code);
+    seg->code = out;
+    seg->cx = seg->size = n;
+  } else {
+    free(out);
+  }
+
+  free(targets);
+  free(new_index);
+  return count;
+}
+
+/**
+ * Runs tail_calls() over every procedure.
+ *
+ * Must be called before pl0_link().
+ *
+ * @return the number of calls turned into jumps
+ */
+int eliminate_tail_calls() {
+  int s, n = 0;
+
+  for(s = 1; s < num_segments; s++)
+    n += tail_calls(s);
+
+  if(DEBUG) printf("DEBUG: %d calls in tail position\n", n);
+
+  return n;
+}
+
+/**
+ * Recognizes a counted while loop.
+ *
+ * The condition has to compare a variable (the counter) with a constant or
+ * with another variable (the bound), as in LOD a; LIT c; OPR_LSS; JPC, and
+ * the JPC has to leave the loop. The body can't call anything, has to store
+ * the counter exactly once, as a := a + k or a := a - k somewhere that runs
+ * every time around, can't store the bound, and can't be jumped into from
+ * outside of the loop.
+ *
+ * @param s the segment
+ * @param head the first instruction of the condition
+ * @param jump the JMP back to head
+ * @param loop set to what was found
+ * @return 1 if it's a counted loop, 0 otherwise
+ */
+int find_counted_loop(int s, int head, int jump, counted_loop *loop) {
+  segment *seg = &segments[s];
+  instruction *code = seg->code;
+  int side, i, j;
+
+  if(head + 4 > jump || code[head + 2].op != OPR || code[head + 3].op != JPC || code[head + 3].m != jump + 1)
+    return 0;
+  for(j = s + 1; j < num_segments; j++) {
+    if(segments[j].parent == s && segments[j].offset > head && segments[j].offset <= jump)
+      return 0;
+  }
+
+  // anything that jumps into the loop has to go to the top
+  for(i = 0; i < seg->cx; i++) {
+    if((code[i].op == JMP || code[i].op == JPC) && (i < head || i > jump) && code[i].m > head && code[i].m <= jump)
+      return 0;
+  }
+  for(i = head + 4; i < jump; i++) {
+    if(code[i].op == CAL || code[i].op == TCL || code[i].op == INC || (code[i].op == OPR && code[i].m == OPR_RET))
+      return 0;
+    if((code[i].op == JMP || code[i].op == JPC) && (code[i].m < head + 4 || code[i].m > jump))
+      return 0;
+  }
+
+  // either side of the comparison can be the counter
+  for(side = 0; side < 2; side++) {
+    instruction *counter = &code[head + side], *bound = &code[head + 1 - side];
+    int stores = 0, at = -1;
+
+    if(counter->op != LOD || (bound->op != LIT && bound->op != LOD) || (bound->op == LOD && bound->l == counter->l && bound->m == counter->m))
+      continue;
+
+    loop->rel = code[head + 2].m;
+    if(side) {
+      if(loop->rel == OPR_LSS) loop->rel = OPR_GTR;
+      else if(loop->rel == OPR_LEQ) loop->rel = OPR_GEQ;
+      else if(loop->rel == OPR_GTR) loop->rel = OPR_LSS;
+      else if(loop->rel == OPR_GEQ) loop->rel = OPR_LEQ;
+    }
+    if(loop->rel != OPR_LSS && loop->rel != OPR_LEQ && loop->rel != OPR_GTR && loop->rel != OPR_GEQ)
+      return 0;
+
+    for(i = head + 4; i < jump; i++) {
+      if(code[i].op != STO)
+        continue;
+      if(bound->op == LOD && code[i].l == bound->l && code[i].m == bound->m)
+        break;
+      if(code[i].l == counter->l && code[i].m == counter->m) {
+        stores++;
+        at = i - 3;
+      }
+    }
+    if(i < jump || stores != 1 || at < head + 4)
+      continue;
+
+    // the update has to be counter +/- constant
+    if(code[at + 2].op != OPR || (code[at + 2].m != OPR_ADD && code[at + 2].m != OPR_SUB))
+      continue;
+    if(code[at].op == LOD && code[at].l == counter->l && code[at].m == counter->m && code[at + 1].op == LIT)
+      loop->step = code[at + 2].m == OPR_ADD ? code[at + 1].m : -code[at + 1].m;
+    else if(code[at + 2].m == OPR_ADD && code[at].op == LIT && code[at + 1].op == LOD && code[at + 1].l == counter->l && code[at + 1].m == counter->m)
+      loop->step = code[at].m;
+    else
+      continue;
+    if(!loop->step || ((loop->rel == OPR_LSS || loop->rel == OPR_LEQ) != (loop->step > 0)))
+      continue;
+
+    // and it has to run exactly once every time around
+    for(i = head + 4; i < jump; i++) {
+      if((code[i].op == JMP || code[i].op == JPC) && ((i < at && code[i].m > at) || (code[i].m <= at + 3 && i >= at)))
+        break;
+    }
+    if(i < jump)
+      continue;
+
+    loop->head = head;
+    loop->jump = jump;
+    loop->l = counter->l;
+    loop->m = counter->m;
+    loop->bound = *bound;
+    return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * Unrolls a counted loop.
+ *
+ * The loop becomes a test that all of the next unroll_factor trips around
+ * the loop will happen (counter + (n - 1) * step still on the right side of
+ * the bound), followed by that many copies of the body and a JMP back to the
+ * test. The original loop follows, to finish up whatever is left. With a
+ * constant bound, bound - (n - 1) * step gets worked out here (and the loop
+ * is left alone if that doesn't fit in an int). With a variable, the test
+ * first makes sure that the subtraction doesn't wrap around.
+ *
+ * @param s the segment
+ * @param loop the loop, from find_counted_loop()
+ * @param n how many copies of the body to make
+ * @return the number of instructions added, 0 if the loop was left alone,
+ *         -1 if there's no memory
+ */
+int unroll_loop(int s, counted_loop *loop, int n) {
+  segment *seg = &segments[s];
+  int len = loop->jump - loop->head - 4; // the body
+  long long delta = (long long)(n - 1) * loop->step;
+  int cond = loop->rel; // the counter is on the left
+  int guard = loop->step > 0 ? OPR_LSS : OPR_GTR;
+  instruction test[12];
+  int t = 0, added, rest, i, j, k;
+  instruction *out;
+
+  if(loop->bound.op == LIT) {
+    long long limit = loop->bound.m - delta;
+    if(limit < -2147483647LL - 1 || limit > 2147483647LL)
+      return 0;
+    test[t++] = (instruction){LOD, loop->l, loop->m, seg->code[loop->head].line};
+    test[t++] = (instruction){LIT, 0, (int)limit, seg->code[loop->head].line};
+  } else {
+    if(delta < -2147483647LL - 1 || delta > 2147483647LL)
+      return 0;
+    // bound - delta < bound (or > for a loop counting down), or it wrapped
+    test[t++] = loop->bound;
+    test[t++] = (instruction){LIT, 0, (int)delta, seg->code[loop->head].line};
+    test[t++] = (instruction){OPR, 0, OPR_SUB, seg->code[loop->head].line};
+    test[t++] = loop->bound;
+    test[t++] = (instruction){OPR, 0, guard, seg->code[loop->head].line};
+    test[t++] = (instruction){JPC, 0, 0, seg->code[loop->head].line};
+    test[t++] = (instruction){LOD, loop->l, loop->m, seg->code[loop->head].line};
+    test[t++] = loop->bound;
+    test[t++] = (instruction){LIT, 0, (int)delta, seg->code[loop->head].line};
+    test[t++] = (instruction){OPR, 0, OPR_SUB, seg->code[loop->head].line};
+  }
+  test[t++] = (instruction){OPR, 0, cond, seg->code[loop->head].line};
+  test[t++] = (instruction){JPC, 0, 0, seg->code[loop->head].line};
+
+  added = t + n * len + 1;
+  rest = loop->head + added; // where the original loop ends up
+  out = (instruction *)malloc((seg->cx + added) * sizeof(instruction));
+  if(!out)
+    return -1;
+
+  memcpy(out, seg->code, loop->head * sizeof(instruction));
+  memcpy(&out[rest], &seg->code[loop->head], (seg->cx - loop->head) * sizeof(instruction));
+
+  // everything after the loop head moves down
+  for(i = 0; i < seg->cx + added; i++) {
+    if(i == loop->head)
+      i = rest;
+    if((out[i].op == JMP || out[i].op == JPC) && out[i].m > loop->head)
+      out[i].m += added;
+  }
+  for(i = rest; i <= rest + len + 4; i++) {
+    if((out[i].op == JMP || out[i].op == JPC) && out[i].m == loop->head)
+      out[i].m = rest;
+  }
+
+  for(i = 0; i < t; i++) {
+    out[loop->head + i] = test[i];
+    if(test[i].op == JPC)
+      out[loop->head + i].m = rest;
+  }
+
+  for(k = 0; k < n; k++) {
+    int copy = loop->head + t + k * len;
+    for(j = 0; j < len; j++) {
+      instruction ir = seg->code[loop->head + 4 + j];
+      if(ir.op == JMP || ir.op == JPC)
+        ir.m = copy + ir.m - (loop->head + 4);
+      out[copy + j] = ir;
+    }
+  }
+  out[loop->head + t + n * len] = seg->code[loop->jump];
+  out[loop->head + t + n * len].m = loop->head;
+
+  for(j = s + 1; j < num_segments; j++) {
+    if(segments[j].parent == s && segments[j].offset > loop->head)
+      segments[j].offset += added;
+  }
+
+  free(seg->code);
+  seg->code = out;
+  seg->cx = seg->size = seg->cx + added;
+
+  return added;
+}
+
+/**
+ * Unrolls the counted while loops (see find_counted_loop()) by
+ * unroll_factor, or by less when the copies would come to more than
+ * UNROLL_SIZE instructions. Loops that closed_form_loops() handles (or left
+ * behind for when the closed form doesn't apply) are skipped. With a profile
+ * (-u), loops that never ran are left alone and hot ones get to use up to
+ * UNROLL_HOT_SIZE.
+ *
+ * Must be called before pl0_link().
+ *
+ * @return the number of loops unrolled
+ */
+int unroll_loops() {
+  static int updates[MAX_CODE_LENGTH];
+  int total = 0, unrolled = 0;
+  int s, j;
+
+  if(unroll_factor < 2)
+    return 0;
+
+  for(s = 0; s < num_segments; s++)
+    total += segments[s].cx + 1;
+
+  for(s = 0; s < num_segments; s++) {
+    for(j = segments[s].body; j < segments[s].cx; j++) {
+      segment *seg = &segments[s];
+      counted_loop loop;
+      int n = unroll_factor, added, heat, size;
+
+      if(seg->code[j].op != JMP || seg->code[j].m < seg->body || seg->code[j].m >= j)
+        continue;
+      if(!find_counted_loop(s, seg->code[j].m, j, &loop) || linear_updates(s, &loop, updates))
+        continue;
+      heat = profile_loop_heat(s, loop.head);
+      if(heat < 0)
+        continue;
+      size = heat > 0 ? UNROLL_HOT_SIZE : UNROLL_SIZE;
+
+      while(n > 1 && n * (j - loop.head - 4) > size)
+        n--;
+      if(n < 2 || total + n * (j - loop.head - 4) + 13 > MAX_CODE_LENGTH)
+        continue;
+
+      added = unroll_loop(s, &loop, n);
+      if(added < 0)
+        return unrolled;
+      if(!added)
+        continue;
+
+      // carry on after the original loop, which is now the leftover loop
+      total += added;
+      unrolled++;
+      j += added;
+    }
+  }
+
+  if(DEBUG) printf("DEBUG: unrolled %d loops\n", unrolled);
+
+  return unrolled;
+}
+
+/**
+ * Checks whether a counted loop's body is nothing but linear updates, like
+ * c := c + 3 or c := c - b, where what gets added doesn't change in the loop.
+ *
+ * @param s the segment
+ * @param loop the loop, from find_counted_loop()
+ * @param updates set to the first instruction of each update (must hold
+ *                MAX_CODE_LENGTH ints)
+ * @return how many updates there are (the counter's included), 0 if the body
+ *         is anything else
+ */
+int linear_updates(int s, counted_loop *loop, int *updates) {
+  instruction *code = segments[s].code;
+  int start = loop->head + 4, len = loop->jump - start;
+  int n = 0, i, j;
+
+  if(!len || len % 4)
+    return 0;
+
+  for(i = start; i < loop->jump; i += 4) {
+    instruction *x = &code[i + 3], *term;
+    if(x->op != STO || code[i + 2].op != OPR || (code[i + 2].m != OPR_ADD && code[i + 2].m != OPR_SUB))
+      return 0;
+    if(code[i].op == LOD && code[i].l == x->l && code[i].m == x->m)
+      term = &code[i + 1];
+    else if(code[i + 2].m == OPR_ADD && code[i + 1].op == LOD && code[i + 1].l == x->l && code[i + 1].m == x->m)
+      term = &code[i];
+    else
+      return 0;
+    // x := x + x doubles x every time around
+    if((term->op != LIT && term->op != LOD) || (term->op == LOD && term->l == x->l && term->m == x->m))
+      return 0;
+    updates[n++] = i;
+  }
+
+  // every variable gets updated once, and nothing updated gets added
+  for(i = 0; i < n; i++) {
+    instruction *x = &code[updates[i] + 3];
+    int self = (code[updates[i]].op == LOD && code[updates[i]].l == x->l && code[updates[i]].m == x->m)
+        ? updates[i] : updates[i] + 1;
+    for(j = start; j < loop->jump; j++) {
+      if(j != self && code[j].op == LOD && code[j].l == x->l && code[j].m == x->m)
+        return 0;
+      if(j != updates[i] + 3 && code[j].op == STO && code[j].l == x->l && code[j].m == x->m)
+        return 0;
+    }
+  }
+
+  return n;
+}
+
+/**
+ * Inserts code into a segment.
+ *
+ * Jumps to anything after at move along with it, and jumps to at end up at
+ * the start of the new code. The new code's own jumps have to be set up for
+ * where it ends up.
+ *
+ * @param s the segment
+ * @param at where the code goes
+ * @param ins the code
+ * @param n how many instructions there are
+ * @return 0 on success, 25 if there's no memory
+ */
+int segment_insert(int s, int at, instruction *ins, int n) {
+  segment *seg = &segments[s];
+  int i;
+
+  if(seg->cx + n > seg->size) {
+    instruction *tmp = (instruction *)realloc(seg->code, (seg->cx + n) * sizeof(instruction));
+    if(!tmp)
+      return 25;
+    seg->code = tmp;
+    seg->size = seg->cx + n;
+  }
+
+  memmove(&seg->code[at + n], &seg->code[at], (seg->cx - at) * sizeof(instruction));
+  seg->cx += n;
+  for(i = 0; i < seg->cx; i++) {
+    if(i == at)
+      i += n;
+    if(i < seg->cx && (seg->code[i].op == JMP || seg->code[i].op == JPC) && seg->code[i].m > at)
+      seg->code[i].m += n;
+  }
+  memcpy(&seg->code[at], ins, n * sizeof(instruction));
+
+  for(i = s + 1; i < num_segments; i++) {
+    if(segments[i].parent == s && segments[i].offset > at)
+      segments[i].offset += n;
+  }
+
+  return 0;
+}
+
+/**
+ * Replaces a counted loop made of linear updates (see linear_updates())
+ * with what it works out to.
+ *
+ * The number of trips is |bound - counter| / |step| (rounded the right way),
+ * kept in the temporary t as one less than that, and every update x := x + c
+ * becomes x := x + (t + 1) * c. Adding c that many times wraps around in
+ * exactly the same way as the multiply does, so the only things that need
+ * the loop are when bound - counter wraps around, or when the counter's last
+ * step would, which the loop goes on past. The original loop stays behind
+ * for those.
+ *
+ * @param s the segment
+ * @param loop the loop, from find_counted_loop()
+ * @param updates the updates, from linear_updates()
+ * @param n how many updates there are
+ * @param t the temporary's frame address
+ * @return the number of instructions added, -1 if there's no memory
+ */
+int close_loop(int s, counted_loop *loop, int *updates, int n, int t) {
+  instruction *code = segments[s].code;
+  static instruction out[MAX_CODE_LENGTH];
+  int line = code[loop->head].line;
+  int up = loop->step > 0;
+  int strict = loop->rel == OPR_LSS || loop->rel == OPR_GTR;
+  int step = up ? loop->step : -loop->step;
+  instruction counter = {LOD, loop->l, loop->m, line};
+  int len = 0, exit_jump, wrapped[2], i;
+
+  // no trips at all
+  out[len++] = counter;
+  out[len++] = loop->bound;
+  out[len++] = (instruction){OPR, 0, loop->rel, line};
+  exit_jump = len;
+  out[len++] = (instruction){JPC, 0, 0, line};
+
+  // t := |bound - counter|, unless that wraps
+  out[len++] = up ? loop->bound : counter;
+  out[len++] = up ? counter : loop->bound;
+  out[len++] = (instruction){OPR, 0, OPR_SUB, line};
+  out[len++] = (instruction){STO, 0, t, line};
+  out[len++] = (instruction){LOD, 0, t, line};
+  out[len++] = (instruction){LIT, 0, 0, line};
+  out[len++] = (instruction){OPR, 0, strict ? OPR_GTR : OPR_GEQ, line};
+  wrapped[0] = len;
+  out[len++] = (instruction){JPC, 0, 0, line};
+
+  // t := trips - 1
+  if(strict || step > 1) {
+    out[len++] = (instruction){LOD, 0, t, line};
+    if(strict) {
+      out[len++] = (instruction){LIT, 0, 1, line};
+      out[len++] = (instruction){OPR, 0, OPR_SUB, line};
+    }
+    if(step > 1) {
+      out[len++] = (instruction){LIT, 0, step, line};
+      out[len++] = (instruction){OPR, 0, OPR_DIV, line};
+    }
+    out[len++] = (instruction){STO, 0, t, line};
+  }
+
+  // the counter's last value has to have room for one more step
+  out[len++] = counter;
+  out[len++] = (instruction){LOD, 0, t, line};
+  if(step > 1) {
+    out[len++] = (instruction){LIT, 0, step, line};
+    out[len++] = (instruction){OPR, 0, OPR_MUL, line};
+  }
+  out[len++] = (instruction){OPR, 0, up ? OPR_ADD : OPR_SUB, line};
+  out[len++] = (instruction){LIT, 0, up ? 2147483647 - step : -2147483647 - 1 + step, line};
+  out[len++] = (instruction){OPR, 0, up ? OPR_LEQ : OPR_GEQ, line};
+  wrapped[1] = len;
+  out[len++] = (instruction){JPC, 0, 0, line};
+
+  for(i = 0; i < n; i++) {
+    instruction *u = &code[updates[i]];
+    instruction x = u[3], term;
+    int opr = u[2].m;
+
+    term = (u[0].op == LOD && u[0].l == x.l && u[0].m == x.m) ? u[1] : u[0];
+    x.op = LOD;
+    out[len++] = x;
+    out[len++] = (instruction){LOD, 0, t, line};
+    out[len++] = (instruction){LIT, 0, 1, line};
+    out[len++] = (instruction){OPR, 0, OPR_ADD, line};
+    if(term.op != LIT || term.m != 1) {
+      out[len++] = term;
+      out[len++] = (instruction){OPR, 0, OPR_MUL, line};
+    }
+    out[len++] = (instruction){OPR, 0, opr, u[2].line};
+    out[len++] = u[3];
+  }
+  out[len++] = (instruction){JMP, 0, 0, line};
+
+  // the jumps out go past the loop, and the ones that need the loop go to it
+  out[exit_jump].m = out[len - 1].m = loop->jump + 1 + len;
+  out[wrapped[0]].m = out[wrapped[1]].m = loop->head + len;
+
+  if(segment_insert(s, loop->head, out, len))
+    return -1;
+  segments[s].code[loop->jump + len].m = loop->head + len;
+
+  return len;
+}
+
+/**
+ * Replaces counted loops that only do linear updates (see linear_updates())
+ * with straight-line code, see close_loop().
+ *
+ * The trip count needs a new variable, so with -c this leaves the main
+ * block alone.
+ *
+ * Must be called before pl0_link().
+ *
+ * @return the number of loops replaced
+ */
+int closed_form_loops() {
+  static int updates[MAX_CODE_LENGTH];
+  int total = 0, closed = 0;
+  int s, j;
+
+  for(s = 0; s < num_segments; s++)
+    total += segments[s].cx + 1;
+
+  for(s = allow_externals ? 1 : 0; s < num_segments; s++) {
+    int t = -1;
+
+    for(j = segments[s].body; j < segments[s].cx; j++) {
+      segment *seg = &segments[s];
+      counted_loop loop;
+      int n, added;
+
+      if(seg->code[j].op != JMP || seg->code[j].m < seg->body || seg->code[j].m >= j)
+        continue;
+      if(!find_counted_loop(s, seg->code[j].m, j, &loop) || !(n = linear_updates(s, &loop, updates)))
+        continue;
+      if(total + 30 + 11 * n > MAX_CODE_LENGTH)
+        continue;
+
+      // one temporary will do for all of them
+      if(t < 0) {
+        int k;
+        t = frame_size(s);
+        if(t >= MAX_FRAME_SIZE)
+          break;
+        for(k = seg->body - 1; k >= 0 && seg->code[k].op != INC; k--);
+        if(k < 0)
+          break;
+        seg->code[k].m++;
+      }
+
+      added = close_loop(s, &loop, updates, n, t);
+      if(added < 0)
+        return closed;
+
+      total += added;
+      closed++;
+      j += added;
+    }
+  }
+
+  if(DEBUG) printf("DEBUG: closed %d loops\n", closed);
+
+  return closed;
+}
+
+/**
+ * Hashes a procedure's code, leaving out the targets of its calls.
+ *
+ * JMP and JPC targets are already relative to the start of the segment, and
+ * l is relative to the procedure's own level, so two procedures that only
+ * differ in their names hash the same.
+ *
+ * @param s the segment
+ * @return the hash
+ */
+unsigned procedure_hash(int s) {
+  segment *seg = &segments[s];
+  unsigned h = 2166136261u;
+  int i;
+
+  h = (h ^ seg->level) * 16777619u;
+  h = (h ^ seg->body) * 16777619u;
+  for(i = 0; i < seg->cx; i++) {
+    instruction *ir = &seg->code[i];
+    h = (h ^ ir->op) * 16777619u;
+    h = (h ^ ir->l) * 16777619u;
+    if(ir->op != CAL && ir->op != TCL)
+      h = (h ^ ir->m) * 16777619u;
+  }
+
+  return h;
+}
+
+/**
+ * Tells whether two procedures do the same thing.
+ *
+ * Calls match if they go to procedures that are already known to be the same,
+ * or if both procedures call themselves.
+ *
+ * @param s one segment
+ * @param t the other segment
+ * @param same the class of every segment (see fold_procedures())
+ * @return 1 if they're the same, 0 if not
+ */
+int same_procedure(int s, int t, int *same) {
+  segment *a = &segments[s], *b = &segments[t];
+  int i;
+
+  if(a->level != b->level || a->body != b->body || a->cx != b->cx)
+    return 0;
+
+  for(i = 0; i < a->cx; i++) {
+    instruction *x = &a->code[i], *y = &b->code[i];
+    if(x->op != y->op || x->l != y->l)
+      return 0;
+    if(x->op == CAL || x->op == TCL) {
+      if(x->m < 0 || x->m >= num_segments || y->m < 0 || y->m >= num_segments)
+        return 0;
+      if(!(x->m == s && y->m == t) && same[x->m] != same[y->m])
+        return 0;
+    } else if(x->m != y->m) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/**
+ * Folds procedures with identical code into one.
+ *
+ * Procedures start out different, and two of them become the same once their
+ * code matches (see same_procedure()), until nothing else changes. Every call
+ * then goes to one procedure out of each bunch, preferably one whose parent
+ * is staying, and remove_dead_procedures() throws out the ones nobody calls
+ * any more (with -c, procedures other units can call stay, but calls inside
+ * of the unit still get folded).
+ *
+ * Must be called before pl0_link(), after the passes that look at which
+ * variables nested procedures use, since a folded procedure can end up
+ * reaching into a different parent's frame.
+ *
+ * @return the number of procedures that got folded into another one
+ */
+int fold_procedures() {
+  unsigned hash[MAX_SEGMENTS];
+  int same[MAX_SEGMENTS], keep[MAX_SEGMENTS];
+  int changed = 1, folded = 0;
+  int s, t, i, p;
+
+  for(s = 0; s < num_segments; s++) {
+    same[s] = keep[s] = s;
+    if(s && segments[s].cx && !segments[s].external)
+      hash[s] = procedure_hash(s);
+  }
+
+  while(changed) {
+    changed = 0;
+    for(t = 2; t < num_segments; t++) {
+      if(same[t] != t || !segments[t].cx || segments[t].external)
+        continue;
+      for(s = 1; s < t; s++) {
+        if(same[s] != s || !segments[s].cx || segments[s].external || hash[s] != hash[t])
+          continue;
+        if(same_procedure(s, t, same)) {
+          for(i = t; i < num_segments; i++) {
+            if(same[i] == t)
+              same[i] = s;
+          }
+          changed = 1;
+          break;
+        }
+      }
+    }
+  }
+
+  // the procedure that stays for each bunch only gets placed if its parent does
+  for(s = 1; s < num_segments; s++) {
+    if(same[s] == s)
+      continue;
+    p = segments[keep[same[s]]].parent;
+    if(p > 0 && keep[same[p]] != p && (segments[s].parent == 0 || keep[same[segments[s].parent]] == segments[s].parent))
+      keep[same[s]] = s;
+  }
+
+  for(s = 0; s < num_segments; s++) {
+    for(i = 0; i < segments[s].cx; i++) {
+      instruction *ir = &segments[s].code[i];
+      if((ir->op == CAL || ir->op == TCL) && ir->m > 0 && ir->m < num_segments)
+        ir->m = keep[same[ir->m]];
+    }
+  }
+
+  for(s = 1; s < num_segments; s++) {
+    if(segments[s].cx && keep[same[s]] != s)
+      folded++;
+  }
+  if(folded)
+    remove_dead_procedures();
+
+  if(DEBUG) printf("DEBUG: folded %d procedures\n", folded);
+
+  return folded;
+}
@@ -6,10 +6,13 @@
  * This is where the majority of the parsing and code generation gets done.
  */
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "pl0-compiler.h"
+#include "pl0-cache.h"
+#include "pl0-link.h"
 #include "pl0-parsegen.h"
 #include "pl0-tokens.h"
 #include "pm0.h"
@@ -62,21 +65,40 @@ const char *parse_errors[NUM_PARSE_ERRORS] = {
   /* 26. */ "out must be followed by an expression.",
   /* 27. */ "in must be followed by an identifier.",
   /* 28. */ "Cannot reuse this symbol here.",
-  /* 29. */ "Cannot redefine constants."
+  /* 29. */ "Cannot redefine constants.",
+  /* 30. */ "Too many procedures."
 };
 
 int curr_m[MAX_LEXI_LEVELS + 1] = {0};
 int curr_l = 0;
+int curr_seg = 0;
+char *cache_path = NULL; // set for incremental compiles (-i)
+fingerprint seg_fingerprint[MAX_SEGMENTS];
+int seg_cacheable[MAX_SEGMENTS] = {0};
+int seg_line[MAX_SEGMENTS] = {0}; // line each statement part starts on
+int allow_externals = 0; // set when compiling a unit into an object file
+int opt_level = 0; // set with -O
+char last_symbol_name[12] = {0};
+int token_line = 0, token_column = 0; // where the last token came from
+int curr_line = 0; // source line for emit()
 
 /**
  * This is the main function for parsing/code generation.
  *
+ * Code gets generated into one segment per procedure (see pl0-link.c), so
+ * pl0_link() has to be called before code[] is of any use.
+ *
  * @param input_file the raw token file to read from (all numbers and spaces)
  */
-int pl0_parse(FILE *input_file, int a_flag) {
+int pl0_parse(FILE *input_file) {
   token_type token = nulsym;
   int error_code = 0;
 
+  curr_seg = new_segment("", -1, 0);
+
+  if(cache_path)
+    load_cache(cache_path);
+
   token = get_token(input_file);
 
   error_code = block(input_file, &token);
@@ -86,19 +108,15 @@ int pl0_parse(FILE *input_file, int a_flag) {
       error_code = 9;
     } else {
       // return 0; in main()
+      curr_line = token_line;
       error_code = emit(OPR, 0, OPR_RET);
       if(error_code)
         return error_code;
     }
   }
 
-  if(!error_code && a_flag) {
-    printf("%s\n\n", get_parse_error(error_code));
-
-    print_code(stdout);
-    print_code_pretty(stdout);
-    printf("\n");
-  }
+  if(!error_code && cache_path)
+    save_cache(cache_path, seg_fingerprint, seg_cacheable, seg_line);
 
   return error_code;
 }
@@ -113,6 +131,7 @@ int block(FILE *input_file, token_type *token) {
   symbol *symbol;
 
   // sl, dl, ra
+  curr_line = token_line;
   curr_m[curr_l] += 3;
   error_code = emit(INC, 0, 3);
   if(error_code)
@@ -201,11 +220,16 @@ int block(FILE *input_file, token_type *token) {
     if(!symbol->kind) {
       symbol->kind = 3;
       symbol->level = curr_l;
-      symbol->addr = cx+1; /*curr_m[curr_l]++;*/
+      symbol->addr = new_segment(symbol->name, curr_seg, curr_l + 1);
+      if(symbol->addr < 0)
+        return 30;
       curr_l++;
+      // every procedure gets a fresh frame, even if a sibling came first
+      curr_m[curr_l] = 0;
     } else {
       return 28;
     }
+    int proc_seg = symbol->addr;
 
     // semicolonsym
     *token = get_token(input_file);
@@ -214,24 +238,27 @@ int block(FILE *input_file, token_type *token) {
 
     *token = get_token(input_file);
 
-    // JMP over the proc code
-    int c1 = cx;
-    error_code = emit(JMP, 0, 0);
-    if(error_code)
-      return error_code;
+    // the JMP over the proc code gets added by pl0_link(), but it still
+    // counts towards MAX_CODE_LENGTH
+    if(cx >= MAX_CODE_LENGTH)
+      return 25;
+    cx++;
+
+    // recurse block again, this time into the procedure's own segment
+    int parent_seg = curr_seg;
+    curr_seg = proc_seg;
 
-    // recurse block again
     error_code = block(input_file, token);
     if(error_code)
       return error_code;
 
     // return
+    curr_line = token_line;
     error_code = emit(OPR, 0, OPR_RET);
     if(error_code)
       return error_code;
 
-    // set the address for the JMP
-    code[c1].m = cx;
+    curr_seg = parent_seg;
 
     // some cleanup, uses the curr_l global
     // clears all symbols at curr_l and then decrement curr_l
@@ -244,6 +271,33 @@ int block(FILE *input_file, token_type *token) {
     *token = get_token(input_file);
   }
 
+  segments[curr_seg].body = segments[curr_seg].cx;
+
+  // with -i, a statement that hasn't changed can come straight from the cache
+  if(cache_path) {
+    long pos = ftell(input_file);
+    token_type first = *token;
+    int first_line = token_line, first_column = token_column;
+    int cacheable = 1;
+    fingerprint *fp = &seg_fingerprint[curr_seg];
+
+    *fp = fingerprint_statement(input_file, token, &cacheable);
+    seg_cacheable[curr_seg] = cacheable;
+    seg_line[curr_seg] = first_line;
+    if(cacheable) {
+      error_code = emit_cached(curr_seg, *fp, first_line);
+      if(error_code != 1)
+        return error_code;
+    }
+
+    // no luck, go back and parse it for real
+    fseek(input_file, pos, SEEK_SET);
+    *token = first;
+    token_line = first_line;
+    token_column = first_column;
+    error_code = 0;
+  }
+
   error_code = statement(input_file, token);
   if(error_code)
     return error_code;
@@ -264,9 +318,13 @@ int block(FILE *input_file, token_type *token) {
  *              | e ] .
  */
 int statement(FILE *input_file, token_type *token) {
+  segment *seg = &segments[curr_seg];
   symbol *symbol;
   //int number;
   int error_code = 0;
+  int line = token_line;
+
+  curr_line = line;
 
   if(*token == identsym) {
     symbol = get_symbol(input_file, 0);
@@ -305,7 +363,11 @@ int statement(FILE *input_file, token_type *token) {
     if(!symbol) {
       return 14;
     } else if(!symbol->kind) {
-      return 11;
+      if(!allow_externals)
+        return 11;
+      error_code = declare_external(symbol);
+      if(error_code)
+        return error_code;
     } else if(symbol->kind != 3) {
       return 15;
     }
@@ -341,6 +403,8 @@ int statement(FILE *input_file, token_type *token) {
 
   // ifsym
   else if(*token == ifsym) {
+    int cond = seg->cx;
+
     *token = get_token(input_file);
 
     // condition
@@ -353,7 +417,32 @@ int statement(FILE *input_file, token_type *token) {
 
     *token = get_token(input_file);
 
-    int c1 = cx;
+    // if the condition is a constant, only one branch gets any code
+    if(opt_level && is_constant(cond)) {
+      int taken = seg->code[cond].m != 0;
+      truncate_code(cond);
+
+      // the branch that never runs still gets parsed, then thrown away
+      error_code = statement(input_file, token);
+      if(error_code)
+        return error_code;
+      if(!taken)
+        truncate_code(cond);
+
+      if(*token == elsesym) {
+        int c1 = seg->cx;
+        *token = get_token(input_file);
+        error_code = statement(input_file, token);
+        if(error_code)
+          return error_code;
+        if(taken)
+          truncate_code(c1);
+      }
+
+      return error_code;
+    }
+
+    int c1 = seg->cx;
     error_code = emit(JPC, 0, 0);
     if(error_code)
       return error_code;
@@ -363,12 +452,13 @@ int statement(FILE *input_file, token_type *token) {
       return error_code;
 
     // this is for jumping over the else
-    int c2 = cx;
+    int c2 = seg->cx;
+    curr_line = line;
     error_code = emit(JMP, 0, 0);
     if(error_code)
       return error_code;
 
-    code[c1].m = cx;
+    seg->code[c1].m = seg->cx;
 
     // token is either semicolonsym or elsesym at this point
     if(*token == elsesym) {
@@ -377,14 +467,14 @@ int statement(FILE *input_file, token_type *token) {
       if(error_code) return error_code;
     }
 
-    code[c2].m = cx;
+    seg->code[c2].m = seg->cx;
 
     return error_code;
   }
 
   // whilesym
   else if(*token == whilesym) {
-    int cx1 = cx;
+    int cx1 = seg->cx;
 
     *token = get_token(input_file);
 
@@ -393,7 +483,31 @@ int statement(FILE *input_file, token_type *token) {
     if(error_code)
       return error_code;
 
-    int cx2 = cx;
+    // a constant condition either loops forever or never runs the body
+    if(opt_level && is_constant(cx1)) {
+      int taken = seg->code[cx1].m != 0;
+      truncate_code(cx1);
+
+      if(*token != dosym)
+        return 18; // do expected
+
+      *token = get_token(input_file);
+
+      error_code = statement(input_file, token);
+      if(error_code)
+        return error_code;
+
+      if(taken) {
+        curr_line = line;
+        error_code = emit(JMP, 0, cx1);
+      } else {
+        truncate_code(cx1);
+      }
+
+      return error_code;
+    }
+
+    int cx2 = seg->cx;
 
     error_code = emit(JPC, 0, 0);
     if(error_code)
@@ -408,10 +522,11 @@ int statement(FILE *input_file, token_type *token) {
     if(error_code)
       return error_code;
 
+    curr_line = line;
     error_code = emit(JMP, 0, cx1);
     if(error_code)
       return error_code;
-    code[cx2].m = cx;
+    seg->code[cx2].m = seg->cx;
 
     return error_code;
   }
@@ -476,6 +591,7 @@ int statement(FILE *input_file, token_type *token) {
 int condition(FILE *input_file, token_type *token) {
   int error_code = 0;
   token_type relop = nulsym;
+  int left = segments[curr_seg].cx, right = left;
 
   // oddsym
   if(*token == oddsym) {
@@ -495,6 +611,7 @@ int condition(FILE *input_file, token_type *token) {
     }
 
     relop = *token;
+    right = segments[curr_seg].cx;
 
     *token = get_token(input_file);
   }
@@ -505,25 +622,25 @@ int condition(FILE *input_file, token_type *token) {
 
   switch(relop) {
     case oddsym: // odd
-      error_code = emit(OPR, 0, OPR_ODD);
+      error_code = emit_operation(OPR_ODD, left, right);
       break;
     case eqsym:  // =
-      error_code = emit(OPR, 0, OPR_EQL);
+      error_code = emit_operation(OPR_EQL, left, right);
       break;
     case neqsym: // <>
-      error_code = emit(OPR, 0, OPR_NEQ);
+      error_code = emit_operation(OPR_NEQ, left, right);
       break;
     case lessym: // <
-      error_code = emit(OPR, 0, OPR_LSS);
+      error_code = emit_operation(OPR_LSS, left, right);
       break;
     case leqsym: // <=
-      error_code = emit(OPR, 0, OPR_LEQ);
+      error_code = emit_operation(OPR_LEQ, left, right);
       break;
     case gtrsym: // >
-      error_code = emit(OPR, 0, OPR_GTR);
+      error_code = emit_operation(OPR_GTR, left, right);
       break;
     case geqsym: // >=
-      error_code = emit(OPR, 0, OPR_GEQ);
+      error_code = emit_operation(OPR_GEQ, left, right);
       break;
     default:
       break;
@@ -540,6 +657,7 @@ int condition(FILE *input_file, token_type *token) {
 int expression(FILE *input_file, token_type *token) {
   int error_code = 0;
   int addop = nulsym;
+  int left = segments[curr_seg].cx, right;
 
   if(*token == plussym || *token == minussym) {
     addop = *token;
@@ -550,7 +668,7 @@ int expression(FILE *input_file, token_type *token) {
       return error_code;
 
     if(addop == minussym)
-      error_code = emit(OPR, 0, OPR_NEG); // negate
+      error_code = emit_operation(OPR_NEG, left, left); // negate
     if(error_code)
       return error_code;
   }
@@ -563,6 +681,7 @@ int expression(FILE *input_file, token_type *token) {
 
   while(*token == plussym || *token == minussym) {
     addop = *token;
+    right = segments[curr_seg].cx;
     *token = get_token(input_file);
 
     error_code = term(input_file, token);
@@ -570,9 +689,9 @@ int expression(FILE *input_file, token_type *token) {
       return error_code;
 
     if(addop == plussym)
-      error_code = emit(OPR, 0, OPR_ADD); // addition
+      error_code = emit_operation(OPR_ADD, left, right); // addition
     else
-      error_code = emit(OPR, 0, OPR_SUB); // subtraction
+      error_code = emit_operation(OPR_SUB, left, right); // subtraction
 
     if(error_code)
       return error_code;
@@ -589,6 +708,7 @@ int expression(FILE *input_file, token_type *token) {
 int term(FILE *input_file, token_type *token) {
   int error_code = 0;
   int mulop = nulsym;
+  int left = segments[curr_seg].cx, right;
 
   error_code = factor(input_file, token);
   if(error_code)
@@ -596,6 +716,7 @@ int term(FILE *input_file, token_type *token) {
 
   while(*token == multsym || *token == slashsym) {
     mulop = *token;
+    right = segments[curr_seg].cx;
     *token = get_token(input_file);
 
     error_code = factor(input_file, token);
@@ -603,9 +724,9 @@ int term(FILE *input_file, token_type *token) {
       return error_code;
 
     if(mulop == multsym)
-      error_code = emit(OPR, 0, OPR_MUL); // multiplication
+      error_code = emit_operation(OPR_MUL, left, right); // multiplication
     else
-      error_code = emit(OPR, 0, OPR_DIV); // division
+      error_code = emit_operation(OPR_DIV, left, right); // division
 
     if(error_code)
       return error_code;
@@ -691,12 +812,14 @@ int factor(FILE *input_file, token_type *token) {
 /**
  * Gets (and returns) a token from the token file.
  *
+ * Also sets token_line and token_column to where the token was in the source.
+ *
  * @param input_file the token file
  * @return the token_type scanned from the file
  */
 token_type get_token(FILE *input_file) {
   int tmp;
-  if(fscanf(input_file, "%d", &tmp) == 1) {
+  if(fscanf(input_file, "%d %d %d", &token_line, &token_column, &tmp) == 3) {
     if(tmp >= 1 && tmp <= 34) {
       if(DEBUG) printf("DEBUG: get_token: %d %s\n", (token_type)tmp, get_token_symbol((token_type)tmp));
       return (token_type)tmp;
@@ -716,36 +839,108 @@ token_type get_token(FILE *input_file) {
  */
 symbol *get_symbol(FILE *input_file, int is_new) {
   char symbol_name[12];
-  int idx = -1;
 
   if(fscanf(input_file, "%11s", symbol_name) == 1 && strlen(symbol_name) > 0) {
     if(DEBUG) printf("DEBUG: symbol_name = %s\n", symbol_name);
-    int tmp_l = curr_l;
-    do {
-      idx = symbol_hash(symbol_name, tmp_l--);
-    } while(!is_new && (idx < 0 || idx >= MAX_SYMBOL_TABLE_SIZE || !symbol_table[idx].kind) && tmp_l >= 0);
+    strcpy(last_symbol_name, symbol_name);
+    return find_symbol(symbol_name, is_new);
+  }
 
-    if(DEBUG) printf("DEBUG: idx = %d\n", idx);
+  return NULL;
+}
 
-    if(idx >= 0 && idx < MAX_SYMBOL_TABLE_SIZE) {
-      if(is_new) {
-        strcpy(symbol_table[idx].name, symbol_name);
-        if(DEBUG) printf("DEBUG: BRAND NEW SYMBOL!!!!!!!!!!!\n");
-      }
-      if(DEBUG) printf("DEBUG: ********************************\n");
-      if(DEBUG) printf("DEBUG: symbol_table[%d].kind = %d\n", idx, symbol_table[idx].kind);
-      if(DEBUG) printf("DEBUG: symbol_table[%d].name = %s\n", idx, symbol_table[idx].name);
-      if(DEBUG) printf("DEBUG: symbol_table[%d].val = %d\n", idx, symbol_table[idx].val);
-      if(DEBUG) printf("DEBUG: symbol_table[%d].level = %d\n", idx, symbol_table[idx].level);
-      if(DEBUG) printf("DEBUG: symbol_table[%d].addr = %d\n", idx, symbol_table[idx].addr);
-      if(DEBUG) printf("DEBUG: ********************************\n");
-      return &symbol_table[idx];
+/**
+ * Looks up a symbol by name, starting at curr_l and working outwards.
+ *
+ * @param symbol_name the name of the symbol
+ * @param is_new specifies whether or not we're getting a new symbol
+ * @return a pointer into the symbol table, or NULL if the table is full
+ */
+symbol *find_symbol(char *symbol_name, int is_new) {
+  int idx = -1;
+  int tmp_l = curr_l;
+
+  do {
+    idx = symbol_hash(symbol_name, tmp_l--);
+  } while(!is_new && (idx < 0 || idx >= MAX_SYMBOL_TABLE_SIZE || !symbol_table[idx].kind) && tmp_l >= 0);
+
+  if(DEBUG) printf("DEBUG: idx = %d\n", idx);
+
+  if(idx >= 0 && idx < MAX_SYMBOL_TABLE_SIZE) {
+    if(is_new) {
+      strcpy(symbol_table[idx].name, symbol_name);
+      if(DEBUG) printf("DEBUG: BRAND NEW SYMBOL!!!!!!!!!!!\n");
     }
+    if(DEBUG) printf("DEBUG: ********************************\n");
+    if(DEBUG) printf("DEBUG: symbol_table[%d].kind = %d\n", idx, symbol_table[idx].kind);
+    if(DEBUG) printf("DEBUG: symbol_table[%d].name = %s\n", idx, symbol_table[idx].name);
+    if(DEBUG) printf("DEBUG: symbol_table[%d].val = %d\n", idx, symbol_table[idx].val);
+    if(DEBUG) printf("DEBUG: symbol_table[%d].level = %d\n", idx, symbol_table[idx].level);
+    if(DEBUG) printf("DEBUG: symbol_table[%d].addr = %d\n", idx, symbol_table[idx].addr);
+    if(DEBUG) printf("DEBUG: ********************************\n");
+    return &symbol_table[idx];
   }
 
   return NULL;
 }
 
+/**
+ * Skims over a statement without generating any code and fingerprints it.
+ *
+ * The statement ends at the first semicolon or period that isn't inside of a
+ * begin/end. Every token goes into the fingerprint, along with what each
+ * identifier resolves to, since that's all the code for a statement depends
+ * on. Line numbers go in relative to the first token, so the statement can
+ * move around in the file and still match. Leaves *token on the token
+ * following the statement.
+ *
+ * @param input_file the token file
+ * @param token the first token of the statement
+ * @param cacheable set to 0 if the statement can't come from the cache
+ * @return the fingerprint
+ */
+fingerprint fingerprint_statement(FILE *input_file, token_type *token, int *cacheable) {
+  fingerprint fp = fingerprint_int(fingerprint_int(FINGERPRINT_BASIS, curr_l), opt_level);
+  char symbol_name[12];
+  symbol *symbol;
+  int depth = 0;
+  int first_line = token_line;
+
+  while(*token != nulsym) {
+    if(depth == 0 && (*token == semicolonsym || *token == periodsym))
+      return fp;
+
+    if(*token == beginsym) {
+      depth++;
+    } else if(*token == endsym) {
+      if(--depth < 0)
+        break;
+    }
+
+    fp = fingerprint_int(fp, *token);
+    fp = fingerprint_int(fp, token_line - first_line);
+
+    if(*token == identsym) {
+      if(fscanf(input_file, "%11s", symbol_name) != 1)
+        break;
+      symbol = find_symbol(symbol_name, 0);
+      // undeclared identifiers are errors (or externals), parse those for real
+      if(!symbol || !symbol->kind)
+        break;
+      fp = fingerprint_int(fp, symbol->kind);
+      fp = fingerprint_int(fp, curr_l - symbol->level);
+      fp = fingerprint_int(fp, symbol->kind == 1 ? symbol->val : symbol->addr);
+    } else if(*token == numbersym) {
+      fp = fingerprint_int(fp, get_number(input_file));
+    }
+
+    *token = get_token(input_file);
+  }
+
+  *cacheable = 0;
+  return fp;
+}
+
 /**
  * Gets a number from the token file.
  *
@@ -774,9 +969,11 @@ const char *get_parse_error(int e) {
 }
 
 /**
- * Emits code into the global code array.
+ * Emits code into the current procedure's segment.
  *
- * cx and code[] are created in pl0-compiler.c
+ * cx counts every instruction in the program so far, so we can still bail out
+ * once the linked program would be longer than MAX_CODE_LENGTH. The instruction
+ * is tagged with curr_line for the line table.
  *
  * @param op the op code
  * @param l the l value (lexical level)
@@ -788,19 +985,220 @@ int emit(int op, int l, int m) {
     return 25;
   else {
     if(DEBUG) {
-      printf("DEBUG: cx = %d, op = %d (%s), l = %d, m = %d", cx, op, get_op_code_symbol(op), l, m);
+      printf("DEBUG: seg = %d, cx = %d, op = %d (%s), l = %d, m = %d", curr_seg, segments[curr_seg].cx, op, get_op_code_symbol(op), l, m);
       if(op == OPR)
         printf(" (%s)", get_opr_symbol(m));
       printf("\n");
     }
-    code[cx].op = op;
-    code[cx].l = l;
-    code[cx].m = m;
+    if(segment_emit(curr_seg, op, l, m))
+      return 25;
+    segments[curr_seg].code[segments[curr_seg].cx - 1].line = curr_line;
     cx++;
   }
   return 0;
 }
 
+/**
+ * Checks whether the code from start to the end of the current segment is a
+ * single LIT, i.e. a constant.
+ *
+ * @param start index of the first instruction in the current segment
+ * @return 1 if it's a constant, 0 otherwise
+ */
+int is_constant(int start) {
+  segment *seg = &segments[curr_seg];
+  return seg->cx == start + 1 && seg->code[start].op == LIT;
+}
+
+/**
+ * Throws away the code at the end of the current segment.
+ *
+ * Only safe for code that nothing jumps into from the outside, like an
+ * operand or a branch that can never be taken.
+ *
+ * @param start index of the first instruction to throw away
+ */
+void truncate_code(int start) {
+  segment *seg = &segments[curr_seg];
+  cx -= seg->cx - start;
+  seg->cx = start;
+}
+
+/**
+ * Removes a range of instructions from the middle of an expression.
+ *
+ * Expressions don't have any jumps in them, so everything after the range can
+ * just slide down.
+ *
+ * @param start index of the first instruction to remove
+ * @param end index of the first instruction to keep
+ */
+void remove_code(int start, int end) {
+  segment *seg = &segments[curr_seg];
+  memmove(&seg->code[start], &seg->code[end], (seg->cx - end) * sizeof(instruction));
+  cx -= end - start;
+  seg->cx -= end - start;
+}
+
+/**
+ * Checks whether any code from start to end in the current segment divides.
+ *
+ * Division is the only way an expression can fail at run time, so any other
+ * expression can be thrown away if its value isn't needed.
+ *
+ * @param start index of the first instruction
+ * @param end index of the first instruction after the code
+ * @return 1 if there's a division in there, 0 otherwise
+ */
+int has_division(int start, int end) {
+  segment *seg = &segments[curr_seg];
+  int i;
+  for(i = start; i < end; i++) {
+    if(seg->code[i].op == OPR && (seg->code[i].m == OPR_DIV || seg->code[i].m == OPR_MOD))
+      return 1;
+  }
+  return 0;
+}
+
+/**
+ * Tells whether an OPR on constants can be worked out at compile time.
+ *
+ * A division that PM/0 would stop the program for (by zero, or INT_MIN by
+ * -1) has to stay, so it still gets reported when it runs.
+ *
+ * @param m the OPR code
+ * @param a the left (or only) operand
+ * @param b the right operand
+ * @return 1 if fold_operation() can work it out, 0 if not
+ */
+int can_fold(int m, int a, int b) {
+  if(m == OPR_DIV || m == OPR_MOD)
+    return b != 0 && !(b == -1 && a == INT_MIN);
+  return 1;
+}
+
+/**
+ * Works out an OPR on constants, the same way PM/0 would.
+ *
+ * Overflow wraps around like it does in the VM. Check can_fold() first.
+ *
+ * @param m the OPR code
+ * @param a the left (or only) operand
+ * @param b the right operand
+ * @return the result
+ */
+int fold_operation(int m, int a, int b) {
+  switch(m) {
+    case OPR_NEG: return (int)(0u - (unsigned)a);
+    case OPR_ADD: return (int)((unsigned)a + (unsigned)b);
+    case OPR_SUB: return (int)((unsigned)a - (unsigned)b);
+    case OPR_MUL: return (int)((unsigned)a * (unsigned)b);
+    case OPR_DIV: return can_fold(m, a, b) ? a / b : 0;
+    case OPR_ODD: return a % 2;
+    case OPR_MOD: return can_fold(m, a, b) ? a % b : 0;
+    case OPR_EQL: return a == b;
+    case OPR_NEQ: return a != b;
+    case OPR_LSS: return a < b;
+    case OPR_LEQ: return a <= b;
+    case OPR_GTR: return a > b;
+    case OPR_GEQ: return a >= b;
+  }
+  return 0;
+}
+
+/**
+ * Emits an arithmetic or relational OPR, folding it at compile time if it can.
+ *
+ * The operands are already in the current segment: the left one starts at
+ * left and the right one starts at right (for NEG and ODD, right == left).
+ * With -O, constant operands get folded into a single LIT, double negation
+ * cancels out, and x+0, x-0, 0+x, 0-x, x*1, 1*x, x*0, 0*x and x/1 get
+ * simplified. Division by a constant zero (or INT_MIN by -1) is left for
+ * PM/0 to report.
+ *
+ * @param m the OPR code
+ * @param left index of the first instruction of the left operand
+ * @param right index of the first instruction of the right operand
+ * @return 0 on success, 25 on failure
+ */
+int emit_operation(int m, int left, int right) {
+  segment *seg = &segments[curr_seg];
+  int unary = (m == OPR_NEG || m == OPR_ODD);
+
+  if(!opt_level)
+    return emit(OPR, 0, m);
+
+  if(unary) {
+    if(is_constant(left)) {
+      seg->code[left].m = fold_operation(m, seg->code[left].m, 0);
+      return 0;
+    }
+    // -(-x)
+    if(m == OPR_NEG && seg->code[seg->cx - 1].op == OPR && seg->code[seg->cx - 1].m == OPR_NEG) {
+      truncate_code(seg->cx - 1);
+      return 0;
+    }
+    return emit(OPR, 0, m);
+  }
+
+  int a = seg->code[left].m, b = seg->code[right].m;
+  int left_constant = (right == left + 1 && seg->code[left].op == LIT);
+  int right_constant = is_constant(right);
+
+  if(left_constant && right_constant && can_fold(m, a, b)) {
+    seg->code[left].m = fold_operation(m, a, b);
+    truncate_code(right);
+    return 0;
+  }
+
+  // x+0, x-0, x*1, x/1
+  if(right_constant && ((b == 0 && (m == OPR_ADD || m == OPR_SUB)) || (b == 1 && (m == OPR_MUL || m == OPR_DIV)))) {
+    truncate_code(right);
+    return 0;
+  }
+
+  // 0+x, 1*x
+  if(left_constant && ((a == 0 && m == OPR_ADD) || (a == 1 && m == OPR_MUL))) {
+    remove_code(left, right);
+    return 0;
+  }
+
+  // 0-x
+  if(left_constant && a == 0 && m == OPR_SUB) {
+    remove_code(left, right);
+    return emit_operation(OPR_NEG, left, left);
+  }
+
+  // x*0, 0*x
+  if(m == OPR_MUL && ((right_constant && b == 0) || (left_constant && a == 0)) && !has_division(left, seg->cx)) {
+    truncate_code(left);
+    return emit(LIT, 0, 0);
+  }
+
+  return emit(OPR, 0, m);
+}
+
+/**
+ * Declares a procedure that lives in another unit.
+ *
+ * Only used when compiling into an object file. The procedure gets an empty
+ * segment marked as external, as if it had been declared in the main block,
+ * and the linker fills in the real one later.
+ *
+ * @param symbol the (empty) symbol table slot returned by get_symbol()
+ * @return 0 on success, 30 if there are too many procedures
+ */
+int declare_external(symbol *symbol) {
+  strcpy(symbol->name, last_symbol_name);
+  symbol->kind = 3;
+  symbol->level = 0;
+  symbol->addr = new_segment(symbol->name, 0, 1);
+  if(symbol->addr < 0)
+    return 30;
+  segments[symbol->addr].external = 1;
+  return 0;
+}
+
 /**
  * Cleans up after declaring a procedure.
  *
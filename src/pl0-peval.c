@@ -0,0 +1,259 @@
+/*
+ * PL/0 Compiler
+ * Filename: pl0-peval.c
+ *
+ * Partial evaluation. Whatever a program does before it reads its first
+ * input comes out the same every time, so it gets run once at compile time
+ * instead. The code it ran is replaced with a prologue that prints what got
+ * printed, puts the main block's frame and registers back the way the run
+ * left them and jumps to where the run stopped. A program that never reads
+ * anything comes down to its outputs.
+ */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pl0-compiler.h"
+#include "pl0-opt.h"
+#include "pl0-peval.h"
+#include "pm0.h"
+
+/**
+ * Remembers where a run is in the main block.
+ *
+ * @param state where to keep it (steps and outputs are left to the caller)
+ * @param pc the next instruction
+ * @param sp the current SP
+ * @param stack the stack
+ * @param known 1 for every slot of the stack that the run wrote
+ * @param registers the main block's registers
+ * @param known_registers 1 for every register the run wrote
+ */
+void save_main_state(main_state *state, int pc, int sp, int *stack, char *known, int *registers, char *known_registers) {
+  state->pc = pc;
+  state->sp = sp;
+  memcpy(state->stack, stack, sp * sizeof(int));
+  memcpy(state->known, known, sp);
+  memcpy(state->registers, registers, sizeof(state->registers));
+  memcpy(state->known_registers, known_registers, sizeof(state->known_registers));
+}
+
+/**
+ * Runs code[] on PM/0's own vm_step(), for as long as that gives the same
+ * result on every run.
+ *
+ * The run stops before it reads input, before anything PM/0 would stop the
+ * program for (division by zero, running out of stack) and before it reads
+ * memory that it didn't write itself, since what's in there is up to whatever
+ * ran before. It also stops after PEVAL_STEPS instructions, or once the
+ * outputs wouldn't fit in code[] any more. If it stops inside of a procedure,
+ * it backs up to the last call out of the main block.
+ *
+ * @param state set to where the run stopped
+ * @param outputs set to what the run printed (state->outputs of them count)
+ * @return the number of instructions run to get to state
+ */
+int run_prefix(main_state *state, int *outputs) {
+  static vm_state vm;
+  static char known[MAX_STACK_HEIGHT];
+  static char known_registers[MAX_STACK_HEIGHT / 3 + 1][NUM_REGISTERS];
+  int steps = 0, n = 0;
+  int failed;
+
+  memset(known, 0, sizeof(known));
+  memset(known_registers, 0, sizeof(known_registers));
+  known[0] = known[1] = known[2] = 1;
+
+  failed = load_vm(&vm, code, cx);
+  save_main_state(state, vm.pc, vm.sp, vm.stack, known, vm.registers[0], known_registers[0]);
+  state->steps = state->outputs = 0;
+
+  // code that doesn't check out is left for PM/0 to complain about
+  if(failed)
+    return 0;
+
+  while(vm.pc < cx && vm.ar >= 0 && steps < PEVAL_STEPS) {
+    instruction *ir = &code[vm.pc];
+    int *stack = vm.stack;
+    int sp = vm.sp, ar = vm.ar;
+    int addr = vm_address(&vm, ir);
+
+    if(ar == 0 && ir->op == CAL) {
+      save_main_state(state, vm.pc, sp, stack, known, vm.registers[0], known_registers[0]);
+      state->steps = steps;
+      state->outputs = n;
+    }
+
+    if((ir->op == LOD || ir->op == LODL || ir->op == LODG || ir->op == LODD) && !known[addr])
+      break;
+    if(ir->op == LODR && !known_registers[ar][ir->m])
+      break;
+
+    if(ir->op == SIO_IN)
+      break;
+    if(ir->op == OPR && (ir->m == OPR_DIV || ir->m == OPR_MOD)
+        && (stack[sp - 1] == 0 || (stack[sp - 1] == -1 && stack[sp - 2] == INT_MIN)))
+      break;
+    if(ir->op == CAL && sp + vm.need[vm.pc] > MAX_STACK_HEIGHT)
+      break;
+    if(ir->op == TCL && (ar == 0 || vm.bp - 1 + vm.need[vm.pc] > MAX_STACK_HEIGHT))
+      break;
+    // LIT and SIO for every output, LIT and STO for every slot and register
+    if(ir->op == SIO_OUT && 2 * (n + 1 + sp + NUM_REGISTERS) + 2 + cx > MAX_CODE_LENGTH)
+      break;
+
+    // nothing above lets it fail
+    vm_step(&vm);
+    steps++;
+
+    // whatever it wrote is known now
+    if(ir->op == SIO_OUT)
+      outputs[n++] = stack[vm.sp];
+    else if(ir->op == CAL)
+      known[sp] = known[sp + 1] = known[sp + 2] = 1;
+    else if(ir->op == STO || ir->op == STOL || ir->op == STOG || ir->op == STOD)
+      known[addr] = 1;
+    else if(ir->op == STOR)
+      known_registers[ar][ir->m] = 1;
+    else if(ir->op != INC && vm.sp > sp)
+      known[vm.sp - 1] = 1;
+  }
+
+  if(vm.pc >= cx || vm.ar < 0) {
+    state->pc = -1;
+    state->sp = 0;
+  } else if(vm.ar == 0) {
+    save_main_state(state, vm.pc, vm.sp, vm.stack, known, vm.registers[0], known_registers[0]);
+  } else {
+    return state->steps;
+  }
+  state->steps = steps;
+  state->outputs = n;
+
+  return steps;
+}
+
+/**
+ * Writes the code that stands in for a run.
+ *
+ * The last instruction is a JMP to where the run stopped (in code[]), or a
+ * RET if the program was over by then.
+ *
+ * @param state where the run stopped
+ * @param outputs what the run printed
+ * @param prologue where to put the code
+ * @return the number of instructions written
+ */
+int write_prologue(main_state *state, int *outputs, instruction *prologue) {
+  int n = 0, i;
+
+  for(i = 0; i < state->outputs; i++) {
+    prologue[n++] = (instruction){LIT, 0, outputs[i], 0};
+    prologue[n++] = (instruction){SIO_OUT, 0, 1, 0};
+  }
+  if(state->pc < 0) {
+    prologue[n++] = (instruction){OPR, 0, OPR_RET, 0};
+    return n;
+  }
+
+  if(state->sp)
+    prologue[n++] = (instruction){INC, 0, state->sp, 0};
+  for(i = 0; i < state->sp; i++) {
+    // PM/0 starts the main block's SL, DL and RA out at 0
+    if(!state->known[i] || (i < 3 && !state->stack[i]))
+      continue;
+    prologue[n++] = (instruction){LIT, 0, state->stack[i], 0};
+    prologue[n++] = (instruction){STOG, 0, i, 0};
+  }
+  for(i = 0; i < NUM_REGISTERS; i++) {
+    if(!state->known_registers[i])
+      continue;
+    prologue[n++] = (instruction){LIT, 0, state->registers[i], 0};
+    prologue[n++] = (instruction){STOR, 0, i, 0};
+  }
+  prologue[n++] = (instruction){JMP, 0, state->pc, 0};
+
+  return n;
+}
+
+/**
+ * Runs as much of code[] as it can at compile time (see run_prefix()) and
+ * puts a prologue in place of it. Must be called after pl0_link().
+ *
+ * Code that the prologue skips over for good gets removed.
+ *
+ * @return the number of instructions that got run at compile time
+ */
+int partial_evaluate() {
+  static main_state state;
+  static int outputs[MAX_CODE_LENGTH];
+  static instruction prologue[MAX_CODE_LENGTH];
+  int reached[MAX_CODE_LENGTH], work[MAX_CODE_LENGTH];
+  int nw = 0, k, i, j;
+
+  if(!run_prefix(&state, outputs))
+    return 0;
+  k = write_prologue(&state, outputs, prologue);
+  if(k + cx > MAX_CODE_LENGTH)
+    return 0;
+
+  // make room for the prologue
+  for(i = cx - 1; i >= 0; i--) {
+    code[i + k] = code[i];
+    if(code[i + k].op == JMP || is_branch(code[i + k].op) || code[i + k].op == CAL || code[i + k].op == TCL)
+      code[i + k].m += k;
+  }
+  for(i = 0; i < k; i++)
+    code[i] = prologue[i];
+  if(state.pc >= 0)
+    code[k - 1].m += k;
+  for(i = 0; i < num_segments; i++) {
+    if(segments[i].addr >= 0 && segments[i].addr <= cx)
+      segments[i].addr += k;
+  }
+  for(i = 0; i < num_line_entries; i++)
+    line_table[i].pc += k;
+  cx += k;
+
+  // whatever can't be reached from the prologue any more
+  for(i = 0; i < cx; i++)
+    reached[i] = 0;
+  reached[0] = 1;
+  work[nw++] = 0;
+  while(nw) {
+    instruction *ir = &code[work[--nw]];
+    int next[2] = {-1, -1};
+
+    if(ir->op == JMP)
+      next[0] = ir->m;
+    else if(is_branch(ir->op) || ir->op == CAL) {
+      next[0] = ir->m;
+      next[1] = ir - code + 1;
+    } else if(ir->op == TCL)
+      next[0] = ir->m;
+    else if(!(ir->op == OPR && ir->m == OPR_RET))
+      next[0] = ir - code + 1;
+
+    for(j = 0; j < 2; j++) {
+      if(next[j] >= 0 && next[j] < cx && !reached[next[j]]) {
+        reached[next[j]] = 1;
+        work[nw++] = next[j];
+      }
+    }
+  }
+  for(i = 0; i < cx; i++)
+    reached[i] = !reached[i];
+  compact_code(reached);
+
+  // the JMP isn't needed if the run stopped right where the prologue ends
+  if(state.pc >= 0 && code[k - 1].op == JMP && code[k - 1].m == k) {
+    for(i = 0; i < cx; i++)
+      reached[i] = i == k - 1;
+    compact_code(reached);
+  }
+
+  if(DEBUG) printf("DEBUG: ran %d instructions at compile time, %d outputs\n", state.steps, state.outputs);
+
+  return state.steps;
+}
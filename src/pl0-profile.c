@@ -0,0 +1,330 @@
+/*
+ * PL/0 Compiler
+ * Filename: pl0-profile.c
+ *
+ * Execution profiles. With -p, PM/0 counts how many times each instruction
+ * runs and how many times each jump is taken, and those counts get added to
+ * the profile file next to the input file, so profiles from several runs add
+ * up. With -u, the optimizer reads the profile back to find the hot calls.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pl0-compiler.h"
+#include "pl0-opt.h"
+#include "pl0-profile.h"
+#include "pm0.h"
+
+profile_entry profile[MAX_PROFILE_ENTRIES];
+int profile_size = 0;
+
+// source lines covered by each segment, from before any optimization
+int first_line[MAX_SEGMENTS];
+int last_line[MAX_SEGMENTS];
+
+/**
+ * Remembers which source lines each procedure's code came from.
+ *
+ * Must be called after pl0_parse() and before the optimizer moves code
+ * between procedures.
+ */
+void record_line_ranges() {
+  int s, i;
+
+  for(s = 0; s < num_segments; s++) {
+    first_line[s] = last_line[s] = -1;
+    for(i = 0; i < segments[s].cx; i++) {
+      int line = segments[s].code[i].line;
+      if(line <= 0)
+        continue;
+      if(first_line[s] < 0 || line < first_line[s])
+        first_line[s] = line;
+      if(line > last_line[s])
+        last_line[s] = line;
+    }
+  }
+}
+
+/**
+ * Finds the procedure a source line is in.
+ *
+ * Nested procedures sit inside of their parent's lines, so the most deeply
+ * nested procedure that covers the line wins.
+ *
+ * @param line the source line
+ * @return the segment number, -1 if no procedure covers the line
+ */
+int line_owner(int line) {
+  int best = -1;
+  int s;
+
+  for(s = 0; s < num_segments; s++) {
+    if(first_line[s] < 0 || line < first_line[s] || line > last_line[s])
+      continue;
+    if(best < 0 || segments[s].level > segments[best].level
+        || (segments[s].level == segments[best].level && last_line[s] - first_line[s] < last_line[best] - first_line[best]))
+      best = s;
+  }
+
+  return best;
+}
+
+/**
+ * Finds the entry for a key in a list of profile entries, adding it if it
+ * isn't there yet.
+ *
+ * @param entries the list
+ * @param n the number of entries in it
+ * @param key the kind, proc, offset and callee to look for
+ * @return the entry, NULL if it isn't there and the list is full
+ */
+profile_entry *add_profile_entry(profile_entry *entries, int *n, profile_entry *key) {
+  int i;
+
+  for(i = 0; i < *n; i++) {
+    if(entries[i].kind == key->kind && entries[i].offset == key->offset
+        && !strcmp(entries[i].proc, key->proc) && !strcmp(entries[i].callee, key->callee))
+      return &entries[i];
+  }
+  if(*n >= MAX_PROFILE_ENTRIES)
+    return NULL;
+
+  entries[*n] = *key;
+  entries[*n].count = entries[*n].other = 0;
+  return &entries[(*n)++];
+}
+
+/**
+ * Fills in the key for a source line.
+ *
+ * @param key the entry to fill in
+ * @param kind the kind of entry
+ * @param line the source line
+ * @param callee the procedure being called (PROFILE_CALL only)
+ * @return 0 on success, 1 if the line isn't in any procedure
+ */
+int make_profile_key(profile_entry *key, int kind, int line, char *callee) {
+  int s = line_owner(line);
+
+  if(s < 0)
+    return 1;
+  memset(key, 0, sizeof(profile_entry));
+  key->kind = kind;
+  strcpy(key->proc, strlen(segments[s].name) ? segments[s].name : "-");
+  key->offset = line - first_line[s];
+  strcpy(key->callee, (kind == PROFILE_CALL && callee) ? callee : "-");
+  return 0;
+}
+
+/**
+ * Loads the profile file, if there is one.
+ *
+ * A missing or unreadable profile just means there's nothing to go on.
+ *
+ * @param path the profile file
+ * @return the number of entries loaded
+ */
+int load_profile(char *path) {
+  FILE *profile_file = fopen(path, "r");
+  char magic[12], kind[12];
+  int version = 0, n = 0, i;
+
+  destroy_profile();
+  if(!profile_file)
+    return 0;
+
+  if(fscanf(profile_file, "%11s %d %d", magic, &version, &n) != 3 || strcmp(magic, "pl0-profile") || version != PROFILE_VERSION) {
+    fclose(profile_file);
+    return 0;
+  }
+
+  for(i = 0; i < n && profile_size < MAX_PROFILE_ENTRIES; i++) {
+    profile_entry *e = &profile[profile_size];
+    int ok;
+
+    memset(e, 0, sizeof(profile_entry));
+    strcpy(e->callee, "-");
+    if(fscanf(profile_file, "%11s %11s %d", kind, e->proc, &e->offset) != 3)
+      break;
+    if(!strcmp(kind, "line")) {
+      e->kind = PROFILE_LINE;
+      ok = fscanf(profile_file, "%lld", &e->count) == 1;
+    } else if(!strcmp(kind, "branch")) {
+      e->kind = PROFILE_BRANCH;
+      ok = fscanf(profile_file, "%lld %lld", &e->count, &e->other) == 2;
+    } else if(!strcmp(kind, "call")) {
+      e->kind = PROFILE_CALL;
+      ok = fscanf(profile_file, "%11s %lld", e->callee, &e->count) == 2;
+    } else {
+      ok = 0;
+    }
+    if(!ok)
+      break;
+    profile_size++;
+  }
+
+  fclose(profile_file);
+
+  if(DEBUG) printf("DEBUG: loaded %d profile entries from %s\n", profile_size, path);
+
+  return profile_size;
+}
+
+/**
+ * Adds the counts from a run of code[] to the profile file.
+ *
+ * Whatever is in the file already gets read first, so the counts from every
+ * run add up. A line's count is the count of its busiest instruction.
+ *
+ * @param path the profile file
+ * @param counts how many times each instruction ran
+ * @param taken how many times each instruction jumped somewhere else
+ * @return 0 on success, 1 on failure
+ */
+int save_profile(char *path, int *counts, int *taken) {
+  static profile_entry run[MAX_PROFILE_ENTRIES];
+  FILE *profile_file;
+  int n = 0;
+  int pc, i, s;
+
+  load_profile(path);
+
+  for(pc = 0; pc < cx; pc++) {
+    line_entry *entry = find_line(pc);
+    instruction *ir = &code[pc];
+    profile_entry key, *e;
+
+    if(!entry || entry->line <= 0 || make_profile_key(&key, PROFILE_LINE, entry->line, NULL))
+      continue;
+    e = add_profile_entry(run, &n, &key);
+    if(e && counts[pc] > e->count)
+      e->count = counts[pc];
+
+    if(is_branch(ir->op)) {
+      key.kind = PROFILE_BRANCH;
+      e = add_profile_entry(run, &n, &key);
+      if(e) {
+        e->count += taken[pc];
+        e->other += counts[pc] - taken[pc];
+      }
+    } else if(ir->op == CAL || ir->op == TCL) {
+      for(s = 0; s < num_segments && (!segments[s].cx || segments[s].addr != ir->m); s++);
+      if(s == num_segments)
+        continue;
+      make_profile_key(&key, PROFILE_CALL, entry->line, strlen(segments[s].name) ? segments[s].name : "-");
+      e = add_profile_entry(run, &n, &key);
+      if(e)
+        e->count += counts[pc];
+    }
+  }
+
+  for(i = 0; i < n; i++) {
+    profile_entry *e = add_profile_entry(profile, &profile_size, &run[i]);
+    if(e) {
+      e->count += run[i].count;
+      e->other += run[i].other;
+    }
+  }
+
+  profile_file = fopen(path, "w");
+  if(!profile_file)
+    return 1;
+
+  fprintf(profile_file, "pl0-profile %d %d\n", PROFILE_VERSION, profile_size);
+  for(i = 0; i < profile_size; i++) {
+    profile_entry *e = &profile[i];
+    if(e->kind == PROFILE_LINE)
+      fprintf(profile_file, "line %s %d %lld\n", e->proc, e->offset, e->count);
+    else if(e->kind == PROFILE_BRANCH)
+      fprintf(profile_file, "branch %s %d %lld %lld\n", e->proc, e->offset, e->count, e->other);
+    else
+      fprintf(profile_file, "call %s %d %s %lld\n", e->proc, e->offset, e->callee, e->count);
+  }
+
+  fclose(profile_file);
+  return 0;
+}
+
+/**
+ * Looks up the profile entry for a source line.
+ *
+ * @param kind the kind of entry
+ * @param line the source line
+ * @param callee the procedure being called (PROFILE_CALL only)
+ * @return the entry, NULL if the profile doesn't know the line
+ */
+profile_entry *find_profile_entry(int kind, int line, char *callee) {
+  profile_entry key;
+  int i;
+
+  if(!profile_size || make_profile_key(&key, kind, line, callee))
+    return NULL;
+  for(i = 0; i < profile_size; i++) {
+    if(profile[i].kind == key.kind && profile[i].offset == key.offset
+        && !strcmp(profile[i].proc, key.proc) && !strcmp(profile[i].callee, key.callee))
+      return &profile[i];
+  }
+  return NULL;
+}
+
+/**
+ * Tells how hot a call is according to the profile.
+ *
+ * @param s the segment the CAL is in (before linking)
+ * @param i the index of the CAL in the segment
+ * @return 1 if it's within PROFILE_HOT of the busiest call, -1 if it never
+ *         ran, 0 if it's in between or the profile doesn't know it
+ */
+int profile_call_heat(int s, int i) {
+  instruction *ir = &segments[s].code[i];
+  profile_entry *e;
+  long long max = 0;
+  int j;
+
+  if(ir->m < 0 || ir->m >= num_segments)
+    return 0;
+  e = find_profile_entry(PROFILE_CALL, ir->line, strlen(segments[ir->m].name) ? segments[ir->m].name : "-");
+  if(!e)
+    return 0;
+  if(!e->count)
+    return -1;
+
+  for(j = 0; j < profile_size; j++) {
+    if(profile[j].kind == PROFILE_CALL && profile[j].count > max)
+      max = profile[j].count;
+  }
+  return e->count * PROFILE_HOT >= max ? 1 : 0;
+}
+
+/**
+ * Tells how hot a loop is according to the profile.
+ *
+ * @param s the segment the loop is in (before linking)
+ * @param i the index of the first instruction of the loop's condition
+ * @return 1 if its line is within PROFILE_HOT of the busiest line, -1 if it
+ *         never ran, 0 if it's in between or the profile doesn't know it
+ */
+int profile_loop_heat(int s, int i) {
+  profile_entry *e = find_profile_entry(PROFILE_LINE, segments[s].code[i].line, NULL);
+  long long max = 0;
+  int j;
+
+  if(!e)
+    return 0;
+  if(!e->count)
+    return -1;
+
+  for(j = 0; j < profile_size; j++) {
+    if(profile[j].kind == PROFILE_LINE && profile[j].count > max)
+      max = profile[j].count;
+  }
+  return e->count * PROFILE_HOT >= max ? 1 : 0;
+}
+
+/**
+ * Forgets the profile.
+ */
+void destroy_profile() {
+  profile_size = 0;
+}
@@ -6,226 +6,94 @@
  * The PL/0 Virtual Machine. The v_flag controls what to output.
  */
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "pl0-compiler.h"
 #include "pm0.h"
 
+// for profiling (see -p): how many times each instruction ran and how many
+// times it went somewhere other than the next instruction, NULL if not
+int *exec_counts = NULL;
+int *taken_counts = NULL;
+
 /**
  * The main function for the virtual machine.
  *
  * @param input_file the input_file to read from (should be in PL/0 assembly)
  */
 int pm0(FILE *input_file, int v_flag) {
-  instruction code[MAX_CODE_LENGTH];
-  int stack[MAX_STACK_HEIGHT];
-  int activation_records[MAX_LEXI_LEVELS + 1]; // accounts for MAIN + 3 more levels
-
-  int sp = 0, bp = 1, pc = 0;
-  instruction *ir = code;
-  int i = 0, i_cnt = 0;
-  int ar = 0; // current activation record
-  int sio_print = 0;
-  int sio_scan = 0;
-
-  /* some initialization */
-  stack[0] = 0;
-  stack[1] = 0;
-  stack[2] = 0;
-
-  for(i = 0; i <= MAX_LEXI_LEVELS; i++) {
-    activation_records[i] = -1;
-  }
-  /* end initialization */
+  static instruction code[MAX_CODE_LENGTH];
+  static vm_state vm;
+  instruction *ir;
+  int i = 0;
 
-  i = 0;
-  while(!feof(input_file))
+  while(i < MAX_CODE_LENGTH && !feof(input_file))
     if(fscanf(input_file, "%d %d %d", &code[i].op, &code[i].l, &code[i].m) == 3)
       i++;
-  i_cnt = i;
+  if(load_vm(&vm, code, i))
+    return 1;
   /* done parsing the file */
 
+  /*
+   * From here on, nothing gets checked that verify_code() already made sure
+   * of. The only thing left is whether the stack has room for each call.
+   */
+
   /* begin execution */
   if(v_flag) {
     printf("LINE   OP    L    M      PC   BP   SP    Stack\n");
     printf("--------------------------------------------------------------------\n");
-    printf("Initial values:          %2d   %2d   %2d    (initialized to all zeroes)\n", pc, bp, sp);
+    printf("Initial values:          %2d   %2d   %2d    (initialized to all zeroes)\n", vm.pc, vm.bp, vm.sp);
     printf("--------------------------------------------------------------------\n");
   }
 
-  while(pc < i_cnt && ar >= 0) {
+  while(vm.pc < vm.n && vm.ar >= 0) {
     /* begin fetch */
-    ir = &code[pc];
-    if(v_flag) printf("%4d ", pc);
-    pc++;
+    ir = &code[vm.pc];
+    if(v_flag) printf("%4d ", vm.pc);
+    if(exec_counts) exec_counts[vm.pc]++;
     /* end fetch */
 
     /* execute */
-    switch(ir->op) {
-      case 1:
-        // lit
-        stack[sp] = ir->m;
-        sp++;
-        break;
-      case 2:
-        // opr
-        switch(ir->m) {
-          case 0:
-            // ret
-            sp = bp - 1;
-            bp = stack[sp + 1];
-            pc = stack[sp + 2];
-
-            activation_records[ar] = -1;
-            ar--;
-            break;
-          case 1:
-            // neg
-            stack[sp - 1] = -stack[sp - 1];
-            break;
-          case 2:
-            // add
-            sp--;
-            stack[sp - 1] =  stack[sp - 1] + stack[sp];
-            break;
-          case 3:
-            // sub
-            sp--;
-            stack[sp - 1] = stack[sp - 1] - stack[sp];
-            break;
-          case 4:
-            // mul
-            sp--;
-            stack[sp - 1] = stack[sp - 1] * stack[sp];
-            break;
-          case 5:
-            // div
-            sp--;
-            stack[sp - 1] = stack[sp - 1] / stack[sp];
-            break;
-          case 6:
-            // odd
-            stack[sp - 1] = stack[sp - 1] % 2;
-            break;
-          case 7:
-            // mod
-            sp--;
-            stack[sp - 1] = stack[sp - 1] % stack[sp];
-            break;
-          case 8:
-            // eql
-            sp--;
-            stack[sp - 1] = stack[sp - 1] == stack[sp];
-            break;
-          case 9:
-            // neq
-            sp--;
-            stack[sp - 1] = stack[sp - 1] != stack[sp];
-            break;
-          case 10:
-            // lss
-            sp--;
-            stack[sp - 1] = stack[sp - 1] < stack[sp];
-            break;
-          case 11:
-            // leq
-            sp--;
-            stack[sp - 1] = stack[sp - 1] <= stack[sp];
-            break;
-          case 12:
-            // gtr
-            sp--;
-            stack[sp - 1] = stack[sp - 1] > stack[sp];
-            break;
-          case 13:
-            // geq
-            sp--;
-            stack[sp - 1] = stack[sp - 1] >= stack[sp];
-            break;
-        }
-        break;
-      case 3:
-        // lod
-        stack[sp] = stack[base(stack, ir->l, bp) - 1 + ir->m];
-        sp++;
-        break;
-      case 4:
-        // sto
-        sp--;
-        stack[base(stack, ir->l, bp) - 1 + ir->m] = stack[sp];
-        break;
-      case 5:
-        // cal
-        stack[sp] = base(stack, ir->l, bp); // static link (SL)
-        stack[sp + 1] = bp; // dynamic link (DL)
-        stack[sp + 2] = pc; // return address (RA)
-        bp = sp + 1;
-        pc = ir->m;
-
-        activation_records[ar] = sp;
-        for(i = (ar - 1); i >= 0; i--) {
-          activation_records[ar] -= activation_records[i];
-        }
-        ar++;
-        activation_records[ar] = 3;
-        break;
-      case 6:
-        // inc
-        sp += ir->m;
-        break;
-      case 7:
-        // jmp
-        pc = ir->m;
-        break;
-      case 8:
-        // jpc
-        sp--;
-        if(stack[sp] == 0)
-          pc = ir->m;
-        break;
-      case 9:
-        // sio
-        sp--;
-        sio_print = 1;
-        break;
-      case 10:
-        // sio
-        sio_scan = 1;
-        break;
-    }
+    if(vm_step(&vm))
+      return 1;
     /* end execute */
 
+    if(taken_counts && vm.pc != ir - code + 1)
+      taken_counts[ir - code]++;
+
     if(v_flag) {
-      printf("%4s %4d %4d      %2d %4d %4d   ", get_op_code_symbol(ir->op), ir->l, ir->m, pc, bp, sp);
-      print_stack(stack, sp, activation_records, ar);
+      printf("%4s %4d %4d      %2d %4d %4d   ", get_op_code_symbol(ir->op), ir->l, ir->m, vm.pc, vm.bp, vm.sp);
+      print_stack(vm.stack, vm.sp, vm.activation_records, vm.ar);
       printf("\n");
     }
 
-    if(sio_print) {
+    if(ir->op == SIO_OUT) {
       if(v_flag) {
         printf("\n");
         printf("-----------\n");
       }
 
-      printf("Output: %d\n", stack[sp]);
+      printf("Output: %d\n", vm.stack[vm.sp]);
 
       if(v_flag) {
         printf("-----------\n");
         printf("\n");
       }
-      sio_print = 0;
     }
 
-    if(sio_scan) {
+    if(ir->op == SIO_IN) {
       if(v_flag) {
         printf("\n");
         printf("-----------\n");
       }
 
       printf("Input: ");
-      scanf("%d", &stack[sp]);
-      sp++;
+      scanf("%d", &vm.stack[vm.sp]);
+      vm.sp++;
 
       // hack to flush input buffer in case user was stupid
       int ch;
@@ -235,8 +103,6 @@ int pm0(FILE *input_file, int v_flag) {
         printf("-----------\n");
         printf("\n");
       }
-
-      sio_scan = 0;
     }
   }
   /* end execution */
@@ -244,6 +110,676 @@ int pm0(FILE *input_file, int v_flag) {
   return EXIT_SUCCESS;
 }
 
+/**
+ * Gets a machine ready to run a program from its first instruction.
+ *
+ * @param vm the machine
+ * @param code the program, which has to stay where it is while vm runs it
+ * @param n the number of instructions
+ * @return 0 if the program checks out, 1 (after reporting why) if it doesn't
+ */
+int load_vm(vm_state *vm, instruction *code, int n) {
+  int i;
+
+  vm->code = code;
+  vm->n = n;
+  vm->sp = 0;
+  vm->bp = 1;
+  vm->pc = 0;
+  vm->ar = 0;
+
+  /* some initialization */
+  vm->stack[0] = 0;
+  vm->stack[1] = 0;
+  vm->stack[2] = 0;
+  vm->display[0] = vm->bp;
+  vm->frame_level[0] = 0;
+  vm->saved_display[0] = vm->bp;
+
+  for(i = 0; i <= MAX_STACK_HEIGHT / 3; i++) {
+    vm->activation_records[i] = -1;
+  }
+  /* end initialization */
+
+  if(verify_code(code, n, vm->need))
+    return 1;
+  for(i = 0; i < n; i++) {
+    if(code[i].op == DIVC)
+      magic_number(code[i].m, &vm->magic[i], &vm->shift[i]);
+  }
+
+  return 0;
+}
+
+/**
+ * Finds the stack slot that a load or a store uses.
+ *
+ * @param vm the machine
+ * @param ir the instruction, before it runs
+ * @return the slot, or -1 if ir doesn't load or store on the stack
+ */
+int vm_address(vm_state *vm, instruction *ir) {
+  switch(ir->op) {
+    case LOD:
+    case STO:
+      return base(vm->stack, ir->l, vm->bp) - 1 + ir->m;
+    case LODL:
+    case STOL:
+      return vm->bp - 1 + ir->m;
+    case LODG:
+    case STOG:
+      return ir->m;
+    case LODD:
+    case STOD:
+      return vm->display[ir->l] - 1 + ir->m;
+  }
+  return -1;
+}
+
+/**
+ * Runs the instruction at vm->pc. Input and output are left to the caller
+ * (see pm0()), so the compiler can run code the same way (see pl0-peval.c).
+ *
+ * @param vm the machine, set up by load_vm()
+ * @return 0, or 1 (after reporting why) if the program has to stop
+ */
+int vm_step(vm_state *vm) {
+  instruction *ir = &vm->code[vm->pc];
+  int *stack = vm->stack;
+  int *activation_records = vm->activation_records;
+  int *display = vm->display;
+  int *frame_level = vm->frame_level;
+  int *saved_display = vm->saved_display;
+  int sp = vm->sp, bp = vm->bp, pc = vm->pc + 1, ar = vm->ar;
+  int level, i;
+
+  switch(ir->op) {
+    case 1:
+      // lit
+      stack[sp] = ir->m;
+      sp++;
+      break;
+    case 2:
+      // opr
+      switch(ir->m) {
+        case 0:
+          // ret
+          sp = bp - 1;
+          bp = stack[sp + 1];
+          pc = stack[sp + 2];
+
+          display[frame_level[ar]] = saved_display[ar];
+          activation_records[ar] = -1;
+          ar--;
+          break;
+        case 1:
+          // neg
+          stack[sp - 1] = (int)(0u - (unsigned)stack[sp - 1]);
+          break;
+        case 2:
+          // add
+          sp--;
+          stack[sp - 1] = (int)((unsigned)stack[sp - 1] + (unsigned)stack[sp]);
+          break;
+        case 3:
+          // sub
+          sp--;
+          stack[sp - 1] = (int)((unsigned)stack[sp - 1] - (unsigned)stack[sp]);
+          break;
+        case 4:
+          // mul
+          sp--;
+          stack[sp - 1] = (int)((unsigned)stack[sp - 1] * (unsigned)stack[sp]);
+          break;
+        case 5:
+          // div
+          sp--;
+          if(stack[sp] == 0)
+            return vm_error("Division by zero", pc - 1);
+          if(stack[sp] == -1 && stack[sp - 1] == INT_MIN)
+            return vm_error("Division overflow", pc - 1);
+          stack[sp - 1] = stack[sp - 1] / stack[sp];
+          break;
+        case 6:
+          // odd
+          stack[sp - 1] = stack[sp - 1] % 2;
+          break;
+        case 7:
+          // mod
+          sp--;
+          if(stack[sp] == 0)
+            return vm_error("Division by zero", pc - 1);
+          if(stack[sp] == -1 && stack[sp - 1] == INT_MIN)
+            return vm_error("Division overflow", pc - 1);
+          stack[sp - 1] = stack[sp - 1] % stack[sp];
+          break;
+        case 8:
+          // eql
+          sp--;
+          stack[sp - 1] = stack[sp - 1] == stack[sp];
+          break;
+        case 9:
+          // neq
+          sp--;
+          stack[sp - 1] = stack[sp - 1] != stack[sp];
+          break;
+        case 10:
+          // lss
+          sp--;
+          stack[sp - 1] = stack[sp - 1] < stack[sp];
+          break;
+        case 11:
+          // leq
+          sp--;
+          stack[sp - 1] = stack[sp - 1] <= stack[sp];
+          break;
+        case 12:
+          // gtr
+          sp--;
+          stack[sp - 1] = stack[sp - 1] > stack[sp];
+          break;
+        case 13:
+          // geq
+          sp--;
+          stack[sp - 1] = stack[sp - 1] >= stack[sp];
+          break;
+        case 14:
+          // dup
+          stack[sp] = stack[sp - 1];
+          sp++;
+          break;
+        case 15:
+          // over
+          stack[sp] = stack[sp - 2];
+          sp++;
+          break;
+      }
+      break;
+    case 3:
+      // lod
+      stack[sp] = stack[vm_address(vm, ir)];
+      sp++;
+      break;
+    case 4:
+      // sto
+      sp--;
+      stack[vm_address(vm, ir)] = stack[sp];
+      break;
+    case 5:
+      // cal
+      if(sp + vm->need[pc - 1] > MAX_STACK_HEIGHT)
+        return vm_error("Stack overflow", pc - 1);
+      level = frame_level[ar] - ir->l;
+      stack[sp] = display[level]; // static link (SL)
+      stack[sp + 1] = bp; // dynamic link (DL)
+      stack[sp + 2] = pc; // return address (RA)
+      bp = sp + 1;
+      pc = ir->m;
+
+      frame_level[ar + 1] = level + 1;
+      saved_display[ar + 1] = display[level + 1];
+      display[level + 1] = bp;
+
+      activation_records[ar] = sp;
+      for(i = (ar - 1); i >= 0; i--) {
+        activation_records[ar] -= activation_records[i];
+      }
+      ar++;
+      activation_records[ar] = 3;
+      break;
+    case 6:
+      // inc
+      sp += ir->m;
+      break;
+    case 7:
+      // jmp
+      pc = ir->m;
+      break;
+    case 8:
+      // jpc
+      sp--;
+      if(stack[sp] == 0)
+        pc = ir->m;
+      break;
+    case 9:
+      // sio: pops the value, which pm0() then prints from stack[sp]
+      sp--;
+      break;
+    case 10:
+      // sio: pm0() reads the value and pushes it
+      break;
+    case 11:
+      // tcl: a call that takes over the current frame, keeping its DL and RA
+      if(bp - 1 + vm->need[pc - 1] > MAX_STACK_HEIGHT)
+        return vm_error("Stack overflow", pc - 1);
+      level = frame_level[ar] - ir->l;
+      stack[bp - 1] = display[level]; // static link (SL)
+      sp = bp - 1;
+      pc = ir->m;
+      activation_records[ar] = 3;
+
+      display[frame_level[ar]] = saved_display[ar];
+      frame_level[ar] = level + 1;
+      saved_display[ar] = display[level + 1];
+      display[level + 1] = bp;
+      break;
+    case 12:
+      // shl: multiply by 2^m
+      stack[sp - 1] = (int)((unsigned)stack[sp - 1] << ir->m);
+      break;
+    case 13:
+      // divc: divide by the constant m
+      stack[sp - 1] = magic_divide(stack[sp - 1], vm->magic[pc - 1], vm->shift[pc - 1]);
+      break;
+    case 14:
+      // jeq
+      sp -= 2;
+      if(stack[sp] == stack[sp + 1])
+        pc = ir->m;
+      break;
+    case 15:
+      // jne
+      sp -= 2;
+      if(stack[sp] != stack[sp + 1])
+        pc = ir->m;
+      break;
+    case 16:
+      // jlt
+      sp -= 2;
+      if(stack[sp] < stack[sp + 1])
+        pc = ir->m;
+      break;
+    case 17:
+      // jle
+      sp -= 2;
+      if(stack[sp] <= stack[sp + 1])
+        pc = ir->m;
+      break;
+    case 18:
+      // jgt
+      sp -= 2;
+      if(stack[sp] > stack[sp + 1])
+        pc = ir->m;
+      break;
+    case 19:
+      // jge
+      sp -= 2;
+      if(stack[sp] >= stack[sp + 1])
+        pc = ir->m;
+      break;
+    case 20:
+      // jevn
+      sp--;
+      if(stack[sp] % 2 == 0)
+        pc = ir->m;
+      break;
+    case 21:
+      // lodl
+      stack[sp] = stack[vm_address(vm, ir)];
+      sp++;
+      break;
+    case 22:
+      // stol
+      sp--;
+      stack[vm_address(vm, ir)] = stack[sp];
+      break;
+    case 23:
+      // lodg
+      stack[sp] = stack[vm_address(vm, ir)];
+      sp++;
+      break;
+    case 24:
+      // stog
+      sp--;
+      stack[vm_address(vm, ir)] = stack[sp];
+      break;
+    case 25:
+      // lodd
+      stack[sp] = stack[vm_address(vm, ir)];
+      sp++;
+      break;
+    case 26:
+      // stod
+      sp--;
+      stack[vm_address(vm, ir)] = stack[sp];
+      break;
+    case 27:
+      // lodr
+      stack[sp] = vm->registers[ar][ir->m];
+      sp++;
+      break;
+    case 28:
+      // stor
+      sp--;
+      vm->registers[ar][ir->m] = stack[sp];
+      break;
+  }
+
+  vm->sp = sp;
+  vm->bp = bp;
+  vm->pc = pc;
+  vm->ar = ar;
+
+  return 0;
+}
+
+/**
+ * Reports a runtime error, along with where it happened in the source.
+ *
+ * @param message what went wrong
+ * @param pc the address of the instruction that went wrong
+ * @return 1, so it can be returned straight from pm0()
+ */
+int vm_error(const char *message, int pc) {
+  line_entry *entry = find_line(pc);
+
+  fflush(stdout);
+  fprintf(stderr, "VM ERROR: %s at %d", message, pc);
+  if(entry && entry->line) {
+    fprintf(stderr, " (line %d", entry->line);
+    if(strlen(segments[entry->seg].name))
+      fprintf(stderr, ", procedure %s", segments[entry->seg].name);
+    fprintf(stderr, ")");
+  }
+  fprintf(stderr, ".\n");
+
+  return 1;
+}
+
+/**
+ * Tells how an instruction changes the height of the stack.
+ *
+ * @param ir the instruction
+ * @param pops set to how many values it pops (or needs to be there)
+ * @return how many values it leaves in their place
+ */
+int stack_effect(instruction *ir, int *pops) {
+  *pops = 0;
+  switch(ir->op) {
+    case LIT:
+    case LOD:
+    case LODL:
+    case LODG:
+    case LODD:
+    case LODR:
+    case SIO_IN:
+      return 1;
+    case STO:
+    case STOL:
+    case STOG:
+    case STOD:
+    case STOR:
+    case JPC:
+    case JEVN:
+    case SIO_OUT:
+      *pops = 1;
+      return 0;
+    case SHL:
+    case DIVC:
+      *pops = 1;
+      return 1;
+    case INC:
+      return ir->m;
+    case JEQ:
+    case JNE:
+    case JLT:
+    case JLE:
+    case JGT:
+    case JGE:
+      *pops = 2;
+      return 0;
+    case OPR:
+      if(ir->m == OPR_NEG || ir->m == OPR_ODD) {
+        *pops = 1;
+        return 1;
+      } else if(ir->m == OPR_DUP) {
+        *pops = 1;
+        return 2;
+      } else if(ir->m == OPR_OVER) {
+        *pops = 2;
+        return 3;
+      } else if(ir->m != OPR_RET) {
+        *pops = 2;
+        return 1;
+      }
+  }
+  return 0;
+}
+
+/**
+ * Finds every instruction that a procedure can run without calling anything.
+ *
+ * @param code the program
+ * @param n the number of instructions
+ * @param e the procedure's first instruction
+ * @param seen scratch space (n ints), which has to hold something other than
+ *             e + 1 for every instruction the first time e is walked
+ * @param body set to the addresses of the instructions
+ * @return how many there are
+ */
+int walk_procedure(instruction *code, int n, int e, int *seen, int *body) {
+  int count = 0, k;
+
+  seen[e] = e + 1;
+  body[count++] = e;
+  for(k = 0; k < count; k++) {
+    instruction *ir = &code[body[k]];
+    int next[2] = {-1, -1};
+    int j;
+
+    if(ir->op == JMP)
+      next[0] = ir->m;
+    else if(ir->op == JPC || (ir->op >= JEQ && ir->op <= JEVN)) {
+      next[0] = ir->m;
+      next[1] = body[k] + 1;
+    } else if(ir->op != TCL && !(ir->op == OPR && ir->m == OPR_RET))
+      next[0] = body[k] + 1;
+
+    for(j = 0; j < 2; j++) {
+      if(next[j] >= 0 && next[j] < n && seen[next[j]] != e + 1) {
+        seen[next[j]] = e + 1;
+        body[count++] = next[j];
+      }
+    }
+  }
+
+  return count;
+}
+
+/**
+ * Checks a program before it runs, so the interpreter doesn't have to.
+ *
+ * Every instruction that can run gets a stack height, counted from the bottom
+ * of its frame. It has to be the same however the instruction is reached, and
+ * can never be less than what the instruction pops. The main block and every
+ * CAL or TCL target start a procedure at height 0, and every procedure but
+ * the main block has to start with an INC that makes room for its SL, DL and
+ * RA. Each procedure also gets a static level (0 for the main block) from the
+ * l of the calls to it, which every other l it uses has to stay inside of.
+ * Every load and store has to stay inside of the frame it goes to, and since
+ * the same procedure can be called from more than one place, that means the
+ * smallest frame that its static links could lead to.
+ *
+ * @param code the program
+ * @param n the number of instructions
+ * @param need set to how much of the stack the procedure called by each CAL
+ *             or TCL could use (frame included)
+ * @return 0 if the program checks out, 1 (after reporting why) if it doesn't
+ */
+int verify_code(instruction *code, int n, int *need) {
+  static int height[MAX_CODE_LENGTH], level[MAX_CODE_LENGTH], depth[MAX_CODE_LENGTH];
+  static int frame[MAX_CODE_LENGTH], seen[MAX_CODE_LENGTH], work[MAX_CODE_LENGTH];
+  static int body[MAX_CODE_LENGTH], entries[MAX_CODE_LENGTH];
+  static int chain_frame[MAX_CODE_LENGTH][MAX_LEXI_LEVELS + 1]; // by links followed
+  int nw = 0, ne = 0, changed;
+  int pc, k, j, e, l, d;
+
+  if(!n)
+    return 0;
+
+  for(pc = 0; pc < n; pc++) {
+    instruction *ir = &code[pc];
+    if(ir->op < LIT || ir->op > STOR || (ir->op == OPR && (ir->m < OPR_RET || ir->m > OPR_OVER))
+        || (ir->op == INC && ir->m < 0) || (ir->op == SHL && (ir->m < 0 || ir->m > 31)))
+      return vm_error("Bad instruction", pc);
+    if((ir->op == JMP || ir->op == JPC || (ir->op >= JEQ && ir->op <= JEVN) || ir->op == CAL || ir->op == TCL) && (ir->m < 0 || ir->m >= n))
+      return vm_error("Bad jump target", pc);
+    if((ir->op == CAL || ir->op == TCL) && (code[ir->m].op != INC || code[ir->m].m < 3))
+      return vm_error("Bad frame", ir->m);
+    if(ir->op == DIVC && ir->m < 2)
+      return vm_error("Bad divisor", pc);
+    if((ir->op == LODR || ir->op == STOR) && (ir->m < 0 || ir->m >= NUM_REGISTERS))
+      return vm_error("Bad register", pc);
+    height[pc] = level[pc] = -1;
+    seen[pc] = 0;
+  }
+
+  // stack heights
+  height[0] = 0;
+  work[nw++] = 0;
+  while(nw) {
+    instruction *ir;
+    int pops, after, next[2] = {-1, -1};
+
+    pc = work[--nw];
+    ir = &code[pc];
+    after = height[pc] + stack_effect(ir, &pops);
+    if(height[pc] < pops)
+      return vm_error("Stack underflow", pc);
+    after -= pops;
+    if(after > MAX_STACK_HEIGHT)
+      return vm_error("Stack overflow", pc);
+
+    if(ir->op == CAL || ir->op == TCL) {
+      if(height[ir->m] < 0) {
+        height[ir->m] = 0;
+        work[nw++] = ir->m;
+      } else if(height[ir->m])
+        return vm_error("Inconsistent stack height", ir->m);
+    }
+
+    if(ir->op == JMP)
+      next[0] = ir->m;
+    else if(ir->op == JPC || (ir->op >= JEQ && ir->op <= JEVN)) {
+      next[0] = ir->m;
+      next[1] = pc + 1;
+    } else if(ir->op != TCL && !(ir->op == OPR && ir->m == OPR_RET))
+      next[0] = pc + 1;
+
+    for(j = 0; j < 2; j++) {
+      if(next[j] < 0 || next[j] >= n)
+        continue; // running off the end stops the program
+      if(height[next[j]] < 0) {
+        height[next[j]] = after;
+        work[nw++] = next[j];
+      } else if(height[next[j]] != after)
+        return vm_error("Inconsistent stack height", next[j]);
+    }
+  }
+
+  // static levels, from the main block down through the calls
+  level[0] = 0;
+  entries[ne++] = 0;
+  for(k = 0; k < ne; k++) {
+    int count;
+    e = entries[k];
+    count = walk_procedure(code, n, e, seen, body);
+    depth[e] = 3;
+    frame[e] = 0;
+    for(j = 0; j < count; j++) {
+      instruction *ir = &code[body[j]];
+      int pops, after = height[body[j]] + stack_effect(ir, &pops) - pops;
+
+      if(after > depth[e])
+        depth[e] = after;
+      if(ir->op == INC && after > frame[e])
+        frame[e] = after;
+
+      if(((ir->op == LOD || ir->op == STO) && (ir->l < 0 || ir->l > level[e]))
+          || ((ir->op == LODD || ir->op == STOD) && (ir->l < 0 || ir->l > level[e])))
+        return vm_error("Bad static link", body[j]);
+      if(ir->op != CAL && ir->op != TCL)
+        continue;
+
+      l = level[e] - ir->l;
+      if(ir->l < 0 || l < 0 || l >= MAX_LEXI_LEVELS || (level[ir->m] >= 0 && level[ir->m] != l + 1))
+        return vm_error("Bad static link", body[j]);
+      if(level[ir->m] < 0) {
+        level[ir->m] = l + 1;
+        entries[ne++] = ir->m;
+      }
+    }
+  }
+
+  /*
+   * The smallest frame each procedure can find d static links up. A call with
+   * l from e makes the frame l links up from e the callee's parent, so the
+   * callee's d-th frame up is one of e's at l + d - 1. Recursion can feed a
+   * procedure back into its own parents, so this goes until nothing shrinks.
+   */
+  for(k = 0; k < ne; k++) {
+    e = entries[k];
+    for(d = 0; d <= MAX_LEXI_LEVELS; d++)
+      chain_frame[e][d] = d ? INT_MAX : frame[e];
+  }
+  do {
+    changed = 0;
+    for(pc = 0; pc < n; pc++)
+      seen[pc] = 0;
+    for(k = 0; k < ne; k++) {
+      int count;
+      e = entries[k];
+      count = walk_procedure(code, n, e, seen, body);
+      for(j = 0; j < count; j++) {
+        instruction *ir = &code[body[j]];
+
+        if(ir->op != CAL && ir->op != TCL)
+          continue;
+        for(d = 1; d <= level[ir->m]; d++) {
+          if(chain_frame[e][ir->l + d - 1] < chain_frame[ir->m][d]) {
+            chain_frame[ir->m][d] = chain_frame[e][ir->l + d - 1];
+            changed = 1;
+          }
+        }
+      }
+    }
+  } while(changed);
+
+  // addresses
+  for(pc = 0; pc < n; pc++)
+    seen[pc] = 0;
+  for(k = 0; k < ne; k++) {
+    int count;
+    e = entries[k];
+    count = walk_procedure(code, n, e, seen, body);
+    for(j = 0; j < count; j++) {
+      instruction *ir = &code[body[j]];
+
+      if(ir->op == LOD || ir->op == STO)
+        d = ir->l;
+      else if(ir->op == LODL || ir->op == STOL)
+        d = 0;
+      else if(ir->op == LODG || ir->op == STOG)
+        d = level[e];
+      else if(ir->op == LODD || ir->op == STOD)
+        d = level[e] - ir->l;
+      else
+        continue;
+      if(ir->m < 0 || ir->m >= chain_frame[e][d])
+        return vm_error("Bad address", body[j]);
+    }
+  }
+
+  if(depth[0] > MAX_STACK_HEIGHT)
+    return vm_error("Stack overflow", 0);
+  for(pc = 0; pc < n; pc++) {
+    if((code[pc].op == CAL || code[pc].op == TCL) && height[pc] >= 0)
+      need[pc] = depth[code[pc].m];
+  }
+
+  return 0;
+}
+
 /**
  * Return the string representation of an op code.
  *
@@ -292,6 +828,78 @@ const char *get_op_code_symbol(int op) {
       // sio
       return "SIO";
       break;
+    case 11:
+      // tcl
+      return "TCL";
+      break;
+    case 12:
+      // shl
+      return "SHL";
+      break;
+    case 13:
+      // divc
+      return "DIVC";
+      break;
+    case 14:
+      // jeq
+      return "JEQ";
+      break;
+    case 15:
+      // jne
+      return "JNE";
+      break;
+    case 16:
+      // jlt
+      return "JLT";
+      break;
+    case 17:
+      // jle
+      return "JLE";
+      break;
+    case 18:
+      // jgt
+      return "JGT";
+      break;
+    case 19:
+      // jge
+      return "JGE";
+      break;
+    case 20:
+      // jevn
+      return "JEVN";
+      break;
+    case 21:
+      // lodl
+      return "LODL";
+      break;
+    case 22:
+      // stol
+      return "STOL";
+      break;
+    case 23:
+      // lodg
+      return "LODG";
+      break;
+    case 24:
+      // stog
+      return "STOG";
+      break;
+    case 25:
+      // lodd
+      return "LODD";
+      break;
+    case 26:
+      // stod
+      return "STOD";
+      break;
+    case 27:
+      // lodr
+      return "LODR";
+      break;
+    case 28:
+      // stor
+      return "STOR";
+      break;
   }
   return "ERR";
 }
@@ -360,6 +968,14 @@ const char *get_opr_symbol(int op) {
       // geq
       return "OPR_GEQ";
       break;
+    case 14:
+      // dup
+      return "OPR_DUP";
+      break;
+    case 15:
+      // over
+      return "OPR_OVER";
+      break;
   }
   return "ERR";
 }
@@ -381,6 +997,63 @@ int base(int *stack, int l, int bp) {
   return base;
 }
 
+/**
+ * Works out the magic number for dividing by a constant.
+ *
+ * Dividing by d is then a multiply-high by the magic number and a shift,
+ * which is a lot cheaper than a real divide. See Hacker's Delight, chapter
+ * 10.
+ *
+ * @param d the divisor (must be at least 2)
+ * @param magic set to the magic number
+ * @param shift set to the shift
+ */
+void magic_number(int d, int *magic, int *shift) {
+  const unsigned two31 = 0x80000000u;
+  unsigned ad = (unsigned)d;
+  unsigned anc = two31 - 1 - two31 % ad;
+  unsigned q1 = two31 / anc, r1 = two31 - q1 * anc;
+  unsigned q2 = two31 / ad, r2 = two31 - q2 * ad;
+  unsigned delta;
+  int p = 31;
+
+  do {
+    p++;
+    q1 *= 2;
+    r1 *= 2;
+    if(r1 >= anc) {
+      q1++;
+      r1 -= anc;
+    }
+    q2 *= 2;
+    r2 *= 2;
+    if(r2 >= ad) {
+      q2++;
+      r2 -= ad;
+    }
+    delta = ad - r2;
+  } while(q1 < delta || (q1 == delta && r1 == 0));
+
+  *magic = (int)(q2 + 1);
+  *shift = p - 32;
+}
+
+/**
+ * Divides by a constant, truncating towards zero like the / operator.
+ *
+ * @param n the dividend
+ * @param magic the magic number that magic_number() worked out for d
+ * @param shift the shift that magic_number() worked out for d
+ * @return n / d
+ */
+int magic_divide(int n, int magic, int shift) {
+  int q = (int)(((long long)magic * n) >> 32);
+  if(magic < 0)
+    q += n;
+  q >>= shift;
+  return q + (int)((unsigned)n >> 31);
+}
+
 /**
  * Output a string representation of the stack.
  *